@@ -0,0 +1,94 @@
+#include "../multi_array.hh"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+template<typename F> double seconds(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void benchmark(const char* name, const multi_array<double, 1>& values, const multi_array<double, 1>& weights, size_t bins)
+{
+    const size_t n = values.Size();
+    multi_array<double, 1> naive = zeros<double>(bins);
+    multi_array<size_t, 1> indices(array<size_t, 1>{{ n }});
+    for (size_t i = 0; i < n; i++)
+    {
+        indices[i] = min(size_t(values[i] * bins), bins - 1);
+    }
+
+    uint64_t checksum = 0;
+    double tRead = seconds([&]() {
+        const size_t* x = indices.DataPointer();
+        const double* w = weights.DataPointer();
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t bits;
+            memcpy(&bits, w + i, sizeof(bits));
+            checksum += x[i] + bits;
+        }
+    });
+    double tNaive = seconds([&]() {
+        for (size_t i = 0; i < n; i++)
+        {
+            naive.At({ indices[i] }) += weights[i];
+        }
+    });
+    multi_array<double, 1> located = zeros<double>(bins);
+    double tLocated = seconds([&]() {
+        for (size_t i = 0; i < n; i++)
+        {
+            const double x = values[i] * bins;
+            if ((x >= 0.0) && (x <= double(bins)))
+            {
+                located.At({ min(size_t(x), bins - 1) }) += weights[i];
+            }
+        }
+    });
+    multi_array<double, 1> counts = zeros<double>(bins);
+    double tBincount = seconds([&]() { counts = bincount(indices, weights, bins); });
+    multi_array<double, 1> spectrum = zeros<double>(bins);
+    double tHistogram = seconds([&]() { spectrum = histogram1d(values, bins, 0.0, 1.0, weights); });
+    double difference = 0.0;
+    for (size_t i = 0; i < bins; i++)
+    {
+        difference = max(difference, fabs(counts[i] - naive[i]) + fabs(spectrum[i] - naive[i]));
+    }
+
+    cout << name << " (" << n << " entries, " << bins << " bins)" << endl;
+    cout << "  Reading indices and weights: " << n / tRead * 1e-6 << " M entries/s (checksum " << checksum % 10 << ")" << endl;
+    cout << "  At() loop over bin indices:  " << n / tNaive * 1e-6 << " M entries/s" << endl;
+    cout << "  bincount:                    " << n / tBincount * 1e-6 << " M entries/s" << endl;
+    cout << "  At() loop over values:       " << n / tLocated * 1e-6 << " M entries/s" << endl;
+    cout << "  histogram1d:                 " << n / tHistogram * 1e-6 << " M entries/s" << endl;
+    cout << "  largest difference from the naive loop: " << difference << endl;
+}
+
+int main()
+{
+    const size_t n = 10000000;
+    mt19937_64 generator(42);
+    uniform_real_distribution<double> uniform;
+    exponential_distribution<double> exponential(500.0);
+
+    multi_array<double, 1> flat(array<size_t, 1>{{ n }});
+    multi_array<double, 1> peaked(array<size_t, 1>{{ n }});
+    multi_array<double, 1> weights(array<size_t, 1>{{ n }});
+    for (size_t i = 0; i < n; i++)
+    {
+        flat[i] = uniform(generator);
+        peaked[i] = min(exponential(generator), 0.999);    // Most entries in the first two bins
+        weights[i] = uniform(generator);
+    }
+
+    benchmark("Uniform", flat, weights, 1000);
+    benchmark("Skewed", peaked, weights, 1000);
+    benchmark("Uniform", flat, weights, 100000);
+    return 0;
+}
@@ -6,12 +6,47 @@
 #include <ostream>
 #include <functional>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <cmath>
+#include <memory>
+#include <chrono>
+
+#if !defined(G4MULTIARRAY_USE_THREADS) || G4MULTIARRAY_USE_THREADS
+    #include <thread>
+    #include <mutex>
+    #include <exception>
+#endif
+
+#if defined(G4MULTIARRAY_USE_CBLAS) && G4MULTIARRAY_USE_CBLAS
+    #include <cstddef>
+    #include <stdint.h>
+    // In a namespace: some cblas.h define names (e.g. bfloat16) clashing with ours
+    namespace cblas
+    {
+        #include <cblas.h>
+    }
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+#if defined(__SSE__) || defined(__AVX__) || defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__)
+    #include <immintrin.h>
+#endif
 
 // Forward definition of types
 template<typename T, size_t N> class multi_array;
 template<typename T, size_t N> class multi_array_view;
 template<typename T, size_t N> class multi_array_view_const;
 template<typename T, size_t N, template<typename, size_t> class data_policy> class multi_array_base;
+template<size_t N> class bit_array;
+template<typename T, size_t N> class multi_array_masked_view;
 
 template<typename T> multi_array<T, 1> asarray(const std::vector<T>&);
 template<typename T, size_t N> multi_array<T, 1> asarray(const std::array<T, N>&);
@@ -26,1167 +61,7777 @@ template<size_t N> size_t get_product(const std::array<size_t, N>& arr)
     return total;
 }
 
-template<size_t N> struct slicer_base
+/** Number of set bits in a 64-bit word. **/
+inline size_t bit_popcount(uint64_t word)
 {
-public:
-    static constexpr size_t new_dim(int M) { return (N == 1) ? (M-1) : M; }
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return __popcnt64(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+#endif
+}
 
-    // template<size_t M> using target_array_type = std::array<size_t, new_dim(M)>;
+/** Position of the lowest set bit in a (non-zero) 64-bit word. **/
+inline size_t bit_ctz(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index;
+#else
+    return bit_popcount((word & (~word + 1)) - 1);
+#endif
+}
 
-    // template<size_t M> using target_pair_type = std::pair<target_array_type<M>, target_array_type<M>>;
+inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
 
-    template<class... Ts> constexpr slicer_base(Ts... args)
-        : fNumbers({args...})
+inline float bits_float(uint32_t bits)
+{
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/** Convert float to IEEE 754 half precision (round to nearest even). **/
+inline uint16_t float_to_half_bits(float value)
+{
+#if defined(__F16C__)
+    return _cvtss_sh(value, 0);
+#else
+    uint32_t bits = float_bits(value);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t result;
+    if (bits >= 0x47800000u)        // Inf or NaN (including overflow)
     {
-        static_assert(N <= 3, "Cannot have slicer with dim > 3");
+        result = (bits > 0x7F800000u) ? 0x7E00 : 0x7C00;
     }
+    else if (bits < 0x38800000u)    // Subnormal or zero: let the FPU round
+    {
+        result = float_bits(bits_float(bits) + 0.5f) - 0x3F000000u;
+    }
+    else
+    {
+        uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += 0xC8000FFFu + mantissaOdd;  // Rebias the exponent and round
+        result = bits >> 13;
+    }
+    return result | (sign >> 16);
+#endif
+}
 
-protected:
-    std::array<int, N> fNumbers;
-};
-
-template<size_t N> struct slicer : public slicer_base<N>
+/** Convert IEEE 754 half precision to float (exact). **/
+inline float half_bits_to_float(uint16_t half)
 {
-    using slicer_base<N>::new_dim;
-
-    static constexpr size_t deltaDim = 0;
-
-    using slicer_base<N>::slicer_base;
-
-    using slicer_base<N>::fNumbers;
-
-    template<size_t M> std::tuple<size_t, std::array<size_t, new_dim(M)>, std::array<size_t, new_dim(M)>>
-        apply(size_t offset, std::array<size_t, M> shape, std::array<size_t, M> strides, size_t I) const
+#if defined(__F16C__)
+    return _cvtsh_ss(half);
+#else
+    uint32_t bits = uint32_t(half & 0x7FFF) << 13;
+    uint32_t exponent = bits & 0x0F800000u;
+    bits += 0x38000000u;
+    if (exponent == 0x0F800000u)    // Inf or NaN
     {
-        if (N == 0)
-        {
-            return std::make_tuple(offset, shape, strides);     // All things equal :-)
-        }
-        else
-        {
-            if (fNumbers[0] > fNumbers[1])
-            {
-                throw std::runtime_error("TODO: something intelligent");
-            }
-            if ((fNumbers[1] > shape[I]) || (fNumbers[0] >= shape[I]))
-            {
-                throw std::runtime_error("TODO: something intelligent");
-            }
-
-            size_t newOffset = offset + strides[I] * fNumbers[0];
-            std::array<size_t, new_dim(M)> newShape;
-            std::array<size_t, new_dim(M)> newStrides;
-
-            size_t iStride = (N == 2) ? 1 : fNumbers[2];
-            for (int i = 0; i < I; i++)
-            {
-                newShape[i] = shape[i];
-                newStrides[i] = strides[i];
-            }
-            newShape[I] = (fNumbers[1] - fNumbers[0]);
-            newStrides[I] = strides[I] * iStride;
-            if (iStride > 1)
-            {
-                ((newShape[I] -= 1) /= iStride) += 1;
-            }
-            for (int j = I+1; j < new_dim(M); j++)
-            {
-                newShape[j] = shape[j];
-                newStrides[j] = strides[j];
-            }
-
-            return std::make_tuple(newOffset, newShape, newStrides);
-        }
+        bits += 0x38000000u;
     }
-};
+    else if (exponent == 0)         // Zero or subnormal
+    {
+        bits = float_bits(bits_float(bits + 0x00800000u) - bits_float(0x38800000u));
+    }
+    return bits_float(bits | (uint32_t(half & 0x8000) << 16));
+#endif
+}
 
-/* template<class... Ts> multi_array_view<T, slicer_result<T, N, Ts...>
+/** Convert float to bfloat16 (round to nearest even, NaN stays NaN). **/
+inline uint16_t float_to_bfloat16_bits(float value)
 {
+    uint32_t bits = float_bits(value);
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u)
+    {
+        return (bits >> 16) | 0x40;
+    }
+    return (bits + 0x7FFFu + ((bits >> 16) & 1)) >> 16;
 }
 
-template<class T1, class... Ts> multi_array_view<T, slicer_result<T, N, T1, Ts...>
+inline float bfloat16_bits_to_float(uint16_t bfloat)
 {
-    static constexpr size_t
-}*/
+    return bits_float(uint32_t(bfloat) << 16);
+}
 
-template<> struct slicer<1> : public slicer_base<1>
+/**
+  * @short IEEE 754 half-precision storage type.
+  *
+  * Only used for storage, all arithmetic is done in float.
+  */
+struct float16
 {
-    using slicer_base<1>::new_dim;
+    float16() : bits(0) { }
 
-    using slicer_base<1>::slicer_base;
+    float16(float value) : bits(float_to_half_bits(value)) { }
 
-    using slicer_base<1>::fNumbers;
+    operator float() const { return half_bits_to_float(bits); }
 
-    static constexpr size_t deltaDim = 1;
+    float16& operator+= (float other) { return *this = float(*this) + other; }
 
-    template<size_t M> std::tuple<size_t, std::array<size_t, new_dim(M)>, std::array<size_t, new_dim(M)>>
-        apply(size_t offset, std::array<size_t, M> shape, std::array<size_t, M> strides, size_t I) const
-    {
-        if (fNumbers[0] >= (int)shape[I])
-        {
-            throw std::runtime_error("TODO: something intelligent");
-        }
-		size_t start;
-		if (fNumbers[0] >= 0)
-		{
-			start = (size_t)fNumbers[0];
-		}
-		else
-		{
-			start = shape[I] + fNumbers[0];
-		}
+    float16& operator-= (float other) { return *this = float(*this) - other; }
 
-        size_t newOffset = offset + strides[I] * start;
-        std::array<size_t, new_dim(M)> newShape;
-        std::array<size_t, new_dim(M)> newStrides;
-        for (int i = 0; i < I; i++)
-        {
-            newShape[i] = shape[i];
-            newStrides[i] = strides[i];
-        }
-        for (int j = I; j < new_dim(M); j++)
-        {
-            newShape[j] = shape[j+1];
-            newStrides[j] = strides[j+1];
-        }
-        return std::make_tuple(newOffset, newShape, newStrides);     // All things equal :-)
-    }
+    float16& operator*= (float other) { return *this = float(*this) * other; }
+
+    float16& operator/= (float other) { return *this = float(*this) / other; }
+
+    uint16_t bits;
 };
 
-template<class... Ts> constexpr slicer<(sizeof...(Ts))> make_slicer(Ts... others)
+/**
+  * @short bfloat16 storage type (upper half of IEEE float).
+  *
+  * Only used for storage, all arithmetic is done in float.
+  */
+struct bfloat16
 {
-    return slicer<(sizeof...(Ts))>(others...);
-}
+    bfloat16() : bits(0) { }
 
-struct slice_helper
-{
-    template<typename... Ts> slicer<sizeof...(Ts)> operator()(Ts... args) const
-    {
-        return make_slicer(args...);
-    }
-};
+    bfloat16(float value) : bits(float_to_bfloat16_bits(value)) { }
 
-constexpr slice_helper _;
+    operator float() const { return bfloat16_bits_to_float(bits); }
 
-// template<typename T, size_t N, template<typename, size_t> class data_policy> class multi_array_base
+    bfloat16& operator+= (float other) { return *this = float(*this) + other; }
 
-/** Creates strides for a regular array. **/
-template<size_t N> std::array<size_t, N> get_strides(const std::array<size_t, N>& arr)
-{
-    std::array<size_t, N> result;
-    result[N - 1] = 1;
-    for (size_t i = 1; i < N; i++)
-    {
-        result[N - 1 - i] = result[N - i] * arr[N - i];
-    }
-    return result;
-}
+    bfloat16& operator-= (float other) { return *this = float(*this) - other; }
 
-/** Creates gslice for a view. **/
-template<size_t N> std::gslice get_gslice(size_t offset, std::array<size_t, N> shape, std::array<size_t, N> strides)
-{
-    std::valarray<size_t> shape_(N);
-    std::valarray<size_t> strides_(N);
-    std::copy(shape.begin(), shape.end(), std::begin(shape_));
-    std::copy(strides.begin(), strides.end(), std::begin(strides_));
-    return std::gslice(offset, shape_, strides_);
-}
+    bfloat16& operator*= (float other) { return *this = float(*this) * other; }
 
-template<size_t N> class index_impl
-{
-public:
-    using index_type = std::array<size_t, N>;
+    bfloat16& operator/= (float other) { return *this = float(*this) / other; }
 
-    index_impl(const index_type& shape)
-        : fShape(shape), fStrides(get_strides(shape)), fSize(get_product(shape))
-    { }
+    uint16_t bits;
+};
 
-    index_impl(const index_type& shape, const index_type& strides, size_t offset)
-        : fShape(shape), fStrides(strides), fSize(get_product(shape)), fOffset(offset)
-    { }
+inline std::ostream& operator<< (std::ostream& os, const float16& value) { return os << float(value); }
 
-    size_t Size() const { return fSize; }
+inline std::ostream& operator<< (std::ostream& os, const bfloat16& value) { return os << float(value); }
 
-    const index_type& Shape() const { return fShape; }
+/** Maximum number of elements converted at once by block kernels. **/
+constexpr size_t storage_block_size = 256;
 
-protected:
-    size_t make_index(const index_type& arr, bool check_index = true) const
-    {
-        size_t index = fOffset;
-        for (int i = 0; i < N; i++)
-        {
-            if (check_index && (arr[i] >= fShape[i]))
-            {
-                throw std::runtime_error("Index overflow.");
-            }
-            index += fStrides[i] * arr[i];
-        }
-        return index;
-    }
+/**
+  * @short How elements are stored and in which type they are computed.
+  *
+  * Kernels work on blocks of compute_type: begin_block() provides them
+  * (converting into the buffer if needed), end_block() writes them back.
+  */
+template<typename T> struct storage_traits
+{
+    using compute_type = T;
 
-    index_type fShape;
+    constexpr static bool is_converted = false;
 
-    index_type fStrides;
+    static const compute_type* begin_block(const T* data, compute_type*, size_t) { return data; }
 
-    size_t fSize;
+    static compute_type* begin_block(T* data, compute_type*, size_t) { return data; }
 
-    size_t fOffset{ 0 };
+    static void end_block(const compute_type*, T*, size_t) { }
 };
 
-template<typename T, size_t N> class array_owner_impl : public index_impl<N>
+template<> struct storage_traits<float16>
 {
-public:
-    // Type aliases
-    using data_type = std::valarray<T>;
-    using base_type = index_impl<N>;
-    using typename base_type::index_type;
-
-    array_owner_impl(const data_type& data, const index_type& shape)
-        : base_type(shape), fData(data)
-    { }
-
-    array_owner_impl(const data_type&& data, const index_type& shape)
-        : base_type(shape), fData(data)
-    { }
-
-    constexpr static bool read_write_access = true;
+    using compute_type = float;
 
-    const std::valarray<T>& Data() const { return fData; }
+    constexpr static bool is_converted = true;
 
-protected:
-    std::valarray<T>& get_data_array() { return fData; }
+    static void load(const float16* data, float* target, size_t count)
+    {
+        size_t i = 0;
+    #if defined(__F16C__) && defined(__AVX__)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            _mm256_storeu_ps(target + i, _mm256_cvtph_ps(half));
+        }
+    #endif
+        for (; i < count; i++)
+        {
+            target[i] = half_bits_to_float(data[i].bits);
+        }
+    }
 
-    void set_data(const std::valarray<T>& other)
+    static void store(const float* data, float16* target, size_t count)
     {
-        fData = other;
+        size_t i = 0;
+    #if defined(__F16C__) && defined(__AVX__)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(data + i), 0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), half);
+        }
+    #endif
+        for (; i < count; i++)
+        {
+            target[i].bits = float_to_half_bits(data[i]);
+        }
     }
 
-    void set_data(const T& other)
+    static float* begin_block(const float16* data, float* buffer, size_t count)
     {
-        fData = other;
+        load(data, buffer, count);
+        return buffer;
     }
 
-    data_type fData;
+    static void end_block(const float* buffer, float16* data, size_t count) { store(buffer, data, count); }
 };
 
-template<typename T, size_t N, bool is_const> class t_array_view_impl : public index_impl<N>
+template<> struct storage_traits<bfloat16>
 {
-public:
-    constexpr static bool read_write_access = is_const;
-
-    // Type aliases
-    using data_type = typename std::conditional<is_const, const std::valarray<T>&, std::valarray<T>&>::type;
-    // using data_array_type = typename std::conditional<is_const, std::valarray<T>, std::gslice_array<T>>::type;
-    using base_type = index_impl<N>;
-    using typename base_type::index_type;
-
-    // Import base members
-    using index_impl<N>::fStrides;
-    using index_impl<N>::fShape;
-    using index_impl<N>::fOffset;
+    using compute_type = float;
 
-    t_array_view_impl(data_type data, const index_type& shape, const index_type& strides, size_t offset)
-        : base_type(shape, strides, offset), fData(data)
-    {  }
+    constexpr static bool is_converted = true;
 
-    std::valarray<T> Data() const
+    static void load(const bfloat16* data, float* target, size_t count)
     {
-        return fData[get_gslice_()];
+        size_t i = 0;
+    #if defined(__AVX2__)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i bfloat = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(bfloat), 16);
+            _mm256_storeu_ps(target + i, _mm256_castsi256_ps(bits));
+        }
+    #endif
+        for (; i < count; i++)
+        {
+            target[i] = bfloat16_bits_to_float(data[i].bits);
+        }
     }
-private:
-    std::gslice get_gslice_() const
+
+    static void store(const float* data, bfloat16* target, size_t count)
     {
-        auto slice = get_gslice(fOffset, fShape, fStrides);
-        return slice;
+        // Branch-free form of float_to_bfloat16_bits, left to the auto-vectorizer
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t bits = float_bits(data[i]);
+            uint32_t rounded = (bits + 0x7FFFu + ((bits >> 16) & 1)) >> 16;
+            uint32_t quiet = (bits >> 16) | 0x40;
+            target[i].bits = ((bits & 0x7FFFFFFFu) > 0x7F800000u) ? quiet : rounded;
+        }
     }
 
-protected:
-    data_type fData;
-
-    /*data_array_type get_data_array()
-    // Does not work with gcc :-()
-    //auto get_data_array() -> decltype(this->fData[std::gslice()])
+    static float* begin_block(const bfloat16* data, float* buffer, size_t count)
     {
-        auto slize = get_gslice_();
-        return fData[slize];
-    }*/
+        load(data, buffer, count);
+        return buffer;
+    }
 
-    void set_data(const std::valarray<T>& other)
+    static void end_block(const float* buffer, bfloat16* data, size_t count) { store(buffer, data, count); }
+};
+
+/**
+  * @short Read contiguous data in blocks of compute_type.
+  *
+  * Calls f(const compute_type* block, size_t count, size_t offset).
+  */
+template<typename T, typename F> void for_each_block(const T* data, size_t size, F f)
+{
+    using traits = storage_traits<T>;
+    typename traits::compute_type buffer[traits::is_converted ? storage_block_size : 1];
+    for (size_t offset = 0; offset < size; offset += storage_block_size)
     {
-        fData[get_gslice_()] = other;
+        size_t count = std::min(size - offset, storage_block_size);
+        f(traits::begin_block(data + offset, buffer, count), count, offset);
     }
+}
 
-    void set_data(const T& other)
+/**
+  * @short Modify contiguous data in place in blocks of compute_type.
+  *
+  * Calls f(compute_type* block, size_t count, size_t offset).
+  */
+template<typename T, typename F> void transform_blocks(T* data, size_t size, F f)
+{
+    using traits = storage_traits<T>;
+    typename traits::compute_type buffer[traits::is_converted ? storage_block_size : 1];
+    for (size_t offset = 0; offset < size; offset += storage_block_size)
     {
-        fData[get_gslice_()] = other;
+        size_t count = std::min(size - offset, storage_block_size);
+        typename traits::compute_type* block = traits::begin_block(data + offset, buffer, count);
+        f(block, count, offset);
+        traits::end_block(block, data + offset, count);
     }
-};
+}
 
-template<typename T, size_t N> using array_view_impl = t_array_view_impl<T, N, false>;
+/** Whether F can be called on const T& to get a boolean. **/
+template<typename F, typename T> struct is_predicate
+{
+private:
+    template<typename G> static auto test(int) -> decltype(bool(std::declval<G>()(std::declval<const T&>())), std::true_type());
 
-template<typename T, size_t N> using array_const_view_impl = t_array_view_impl<T, N, true>;
+    template<typename> static std::false_type test(...);
 
-template<typename T, size_t N> class array_accessor_impl
-{
 public:
-    using const_item_type = multi_array_view_const<T, N-1>;
-    using item_type = multi_array_view<T, N-1>;
-
-    template<template<typename, size_t> class data_policy> static const_item_type get_const_item(const multi_array_base<T, N, data_policy>& array, size_t i)
-    {
-        return const_item_type(array, i);
-    }
+    constexpr static bool value = !std::is_arithmetic<F>::value && decltype(test<F>(0))::value;
+};
 
-    template<template<typename, size_t> class data_policy> static item_type get_item(multi_array_base<T, N, data_policy>& array, size_t i)
+/** Copy elements of one 64-element block selected by bits of word. **/
+template<typename T> void compress_word(const T* block, uint64_t word, T* output)
+{
+    while (word)
     {
-        return item_type(array, i);
+        *(output++) = block[bit_ctz(word)];
+        word &= word - 1;
     }
-};
+}
 
-template<typename T> class array_accessor_impl<T, 1>
+#if defined(__AVX512F__)
+inline void compress_word(const double* block, uint64_t word, double* output)
 {
-public:
-    using const_item_type = const T&;
-    using item_type = T&;
-
-    template<template<typename, size_t> class data_policy> static const_item_type get_const_item(const multi_array_base<T, 1, data_policy>& array, size_t i)
+    for (size_t i = 0; word; i += 8, word >>= 8)
     {
-        return array.At(std::array<size_t, 1>{i});
+        __mmask8 lanes = __mmask8(word & 0xFF);
+        _mm512_mask_compressstoreu_pd(output, lanes, _mm512_maskz_loadu_pd(lanes, block + i));
+        output += bit_popcount(lanes);
     }
+}
 
-    template<template<typename, size_t> class data_policy> static item_type get_item(multi_array_base<T, 1, data_policy>& array, size_t i)
+inline void compress_word(const float* block, uint64_t word, float* output)
+{
+    for (size_t i = 0; word; i += 16, word >>= 16)
     {
-        return array.At(std::array<size_t, 1>{i});
+        __mmask16 lanes = __mmask16(word & 0xFFFF);
+        _mm512_mask_compressstoreu_ps(output, lanes, _mm512_maskz_loadu_ps(lanes, block + i));
+        output += bit_popcount(lanes);
     }
-};
+}
+#endif
 
 /**
-  * @short multi_array-like object
+  * @short Copy elements selected by mask bits to a contiguous output.
   *
-  * Can be either an array itself, or any of its views.
+  * Empty and full words are handled without looking at the individual bits.
+  * Returns the number of elements written.
   */
-template<typename T, size_t N, template<typename, size_t> class data_policy> class multi_array_base
-    : public data_policy<T, N>
+template<typename T> size_t compress_store(const T* data, const uint64_t* words, size_t size, T* output)
 {
-public:
-    // Type aliases
-    constexpr static size_t Dim = N;
-    using base_type = data_policy<T, N>;
-    using typename base_type::index_type;
-    using const_item_type = typename std::conditional<N == 1, const T&, multi_array_view_const<T, N-1>>::type;
-    using item_type = typename std::conditional<N == 1, T&, multi_array_view<T, N-1>>::type;
-    using accessor_type = array_accessor_impl<T, N>;
-
-    // Friends
-    template<typename, size_t> friend class array_accessor_impl;
-    template<typename, size_t, template<typename, size_t> class> friend class multi_array_base;
-    template<typename, size_t> friend class multi_array;
-    template<typename, size_t> friend class multi_array_view;
-    template<typename, size_t> friend class multi_array_view_const;
-    // template<typename, size_t> friend std::ostream& operator << (std::ostream&, const multi_array_base&);
-
-    // Import members
-    using base_type::Data;
-
-protected:
-    // Import members
-    using index_impl<N>::fStrides;
-    using index_impl<N>::fShape;
-    using index_impl<N>::fSize;
-    using index_impl<N>::fOffset;
-    using base_type::fData;
-
-    using index_impl<N>::make_index;
-    // using base_type::get_data_array;
-    using base_type::set_data;
-
-    using base_type::base_type;
-
-    multi_array_base& operator=(const T& value)
-    {
-        set_data(value);
-        return *this;
-    }
-
-    /* multi_array_base& operator=(const multi_array_base&) = delete;
-    multi_array_base& operator=(const multi_array_base&&) = delete;*/
-
-    template<template <typename, size_t> class data_policy2> multi_array_base& operator=(const multi_array_base<T, N, data_policy2>& other)
+    size_t written = 0;
+    for (size_t w = 0; w * 64 < size; w++)
     {
-        if (other.fShape != fShape)
+        uint64_t word = words[w];
+        if (word == ~uint64_t(0))
         {
-            throw std::runtime_error("Cannot assign data of different shapes.");
+            std::copy(data + w * 64, data + w * 64 + 64, output + written);
+            written += 64;
+        }
+        else if (word)
+        {
+            compress_word(data + w * 64, word, output + written);
+            written += bit_popcount(word);
         }
-        set_data(other.Data());
-        return *this;
-    }
-
-public:
-    template<size_t I, class... Ts>
-        typename std::enable_if<
-            (slicer<sizeof...(Ts)>::new_dim(N) != 0),
-            multi_array_view<T, slicer<sizeof...(Ts)>::new_dim(N)>
-        >::type
-    slice(Ts... slicerArguments)
-    {
-        static_assert(I < N, "TODO: write something intelligent.");
-        slicer<sizeof...(Ts)> theSlicer = make_slicer(slicerArguments...);
-        auto triple = theSlicer.apply(fOffset, fShape, fStrides, I);
-        return multi_array_view<T, slicer<sizeof...(Ts)>::new_dim(N)>(*this, std::get<1>(triple), std::get<2>(triple), std::get<0>(triple));
     }
+    return written;
+}
 
-    template<size_t I, class... Ts>
-        typename std::enable_if<
-            (slicer<sizeof...(Ts)>::new_dim(N) == 0),
-            const T&
-        >::type
-    slice(Ts... slicerArguments)
+/** Bits of the nonzero elements among count (at most 64) consecutive ones. **/
+template<typename T> uint64_t nonzero_word(const T* data, size_t count)
+{
+    uint64_t word = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        static_assert(I < N, "TODO: write something intelligent.");
-        std::array<size_t, 1> ind = {slicerArguments...};
-        return (*this)[ind[0]];
+        word |= uint64_t(data[i] != T()) << i;
     }
+    return word;
+}
 
-    template<size_t I, size_t M>
-        typename std::enable_if<
-            (slicer<M>::new_dim(N) != 0),
-            multi_array_view<T, slicer<M>::new_dim(N)>
-        >::type
-    slice(const slicer<M>& theSlicer)
+#if defined(__SSE2__)
+inline uint64_t nonzero_word(const double* data, size_t count)
+{
+    uint64_t word = 0;
+    size_t i = 0;
+    const __m128d zero = _mm_setzero_pd();
+    for (; i + 2 <= count; i += 2)
     {
-        auto triple = theSlicer.apply(fOffset, fShape, fStrides, I);
-        return multi_array_view<T, slicer<M>::new_dim(N)>(*this, std::get<1>(triple), std::get<2>(triple), std::get<0>(triple));
+        word |= uint64_t(_mm_movemask_pd(_mm_cmpneq_pd(_mm_loadu_pd(data + i), zero))) << i;
     }
-
-    template<size_t I, size_t M>
-        typename std::enable_if<
-            (slicer<M>::new_dim(N) == 0),
-            const T&
-        >::type
-    slice(const slicer<M>& theSlicer)
+    for (; i < count; i++)
     {
-        std::array<size_t, 1> ind = {theSlicer.fNumbers[0]};
-        return (*this)[ind];
+        word |= uint64_t(data[i] != 0.0) << i;
     }
+    return word;
+}
 
-    template<size_t I> multi_array_view<T, N> slice(const slice_helper&)
+inline uint64_t nonzero_word(const float* data, size_t count)
+{
+    uint64_t word = 0;
+    size_t i = 0;
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
     {
-        return multi_array_view<T, N>(*this, fShape, fStrides, fOffset);
+        word |= uint64_t(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(data + i), zero))) << i;
     }
-
-protected:
-    template<int I, typename T1> auto _apply_indices(const T1& t)
-        -> decltype(slice<I>(t))
+    for (; i < count; i++)
     {
-        return slice<I>(t);
+        word |= uint64_t(data[i] != 0.0f) << i;
     }
+    return word;
+}
+#endif
 
-    template<int I, typename T1, typename... Ts> auto _apply_indices(const T1& t, Ts... indices)
-        -> decltype(slice<I>(t)._apply_indices<I, Ts...>(indices...))
+/** Write first + position of each bit set in word. **/
+inline void compress_positions(size_t first, uint64_t word, size_t* output)
+{
+#if defined(__AVX512F__)
+    __m512i positions = _mm512_add_epi64(_mm512_set1_epi64(int64_t(first)), _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0));
+    for (; word; word >>= 8)
     {
-        // auto intermediate = apply_index<I>(t);
-        constexpr int M = decltype(slice<I>(t))::Dim;
-        constexpr int J = I + 1 + M - N;
-        return slice<I>(t)._apply_indices<J, Ts...>(indices...);
+        __mmask8 lanes = __mmask8(word & 0xFF);
+        _mm512_mask_compressstoreu_epi64(output, lanes, positions);
+        output += bit_popcount(lanes);
+        positions = _mm512_add_epi64(positions, _mm512_set1_epi64(8));
     }
-
-public:
-    template<typename... Ts> auto operator()(Ts... indices)
-        -> decltype(_apply_indices<0, Ts...>(indices...))
+#else
+    while (word)
     {
-        return _apply_indices<0, Ts...>(indices...); // Works for 1!
+        *(output++) = first + bit_ctz(word);
+        word &= word - 1;
     }
+#endif
+}
 
-    // template<size_t I, class... Ts> const T&
+/** Elements prefetched ahead by the gather / scatter kernels. **/
+constexpr size_t prefetch_distance = 16;
 
-    /* template<class... Ts> multi_array_view<T, slicer_result<T, N, Ts...>::type apply_indices(Ts... indices)
-    {
+inline void prefetch_read(const void* address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address, 0);
+#elif defined(_MSC_VER)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+}
 
-    }*/
+inline void prefetch_write(const void* address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address, 1);
+#elif defined(_MSC_VER)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+}
 
-    template<typename U> multi_array<T, N> operator*(const U& other) const
+/** output[i] = data[indices[i]], prefetching the elements ahead. **/
+template<typename T> void gather_elements(const T* data, const size_t* indices, size_t count, T* output)
+{
+    size_t i = 0;
+    for (; i + prefetch_distance < count; i++)
     {
-        multi_array<T, N> result = Copy();
-        result *= other;
-        return result;
+        prefetch_read(data + indices[i + prefetch_distance]);
+        output[i] = data[indices[i]];
     }
-
-    template<typename U> multi_array<T, N> operator/(const U& other) const
+    for (; i < count; i++)
     {
-        multi_array<T, N> result = Copy();
-        result /= other;
-        return result;
+        output[i] = data[indices[i]];
     }
+}
 
-    template<typename U> multi_array<T, N> operator+(const U& other) const
+#if defined(__AVX2__)
+inline void gather_elements(const double* data, const size_t* indices, size_t count, double* output)
+{
+    size_t i = 0;
+    for (; i + 4 + prefetch_distance <= count; i += 4)
     {
-        multi_array<T, N> result = Copy();
-        result += other;
-        return result;
+        for (size_t j = 0; j < 4; j++)
+        {
+            prefetch_read(data + indices[i + j + prefetch_distance]);
+        }
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+        _mm256_storeu_pd(output + i, _mm256_i64gather_pd(data, index, sizeof(double)));
     }
-
-    template<typename U> multi_array<T, N> operator-(const U& other) const
+    for (; i < count; i++)
     {
-        multi_array<T, N> result = Copy();
-        result -= other;
-        return result;
+        output[i] = data[indices[i]];
     }
+}
 
-public:
-    T& At(const index_type& i) { return fData[make_index(i)]; }
-
-    const T& At(const index_type& i) const { return fData[make_index(i)]; }
-
-    const_item_type operator[] (size_t i) const { return accessor_type::get_const_item(*this, i); }
-
-    item_type operator[] (size_t i) { return accessor_type::get_item(*this, i); }
-
-    multi_array<T, N> Copy() const { return multi_array<T, N>(*this); }
-
-    template<size_t M> multi_array<T, M> Resize(const std::array<size_t, M>& newShape) const
+inline void gather_elements(const float* data, const size_t* indices, size_t count, float* output)
+{
+    size_t i = 0;
+    for (; i + 4 + prefetch_distance <= count; i += 4)
     {
-        if (!get_product(fShape) == get_product(newShape))
+        for (size_t j = 0; j < 4; j++)
         {
-            throw std::runtime_error("Total size of the new array must equal to the old one.");
+            prefetch_read(data + indices[i + j + prefetch_distance]);
         }
-        auto copy = Copy();
-        return multi_array<T, M>(newShape, copy.Data());
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+        _mm_storeu_ps(output + i, _mm256_i64gather_ps(data, index, sizeof(float)));
     }
-
-    template<class... Ts> multi_array<T, sizeof...(Ts)> Resize(Ts... dims) const
+    for (; i < count; i++)
     {
-        std::array<size_t, sizeof...(Ts)> newShape {dims...};
-        if (!get_product(fShape) == get_product(newShape))
-        {
-            throw std::runtime_error("Total size of the new array must equal to the old one.");
-        }
-        auto copy = Copy();
-        return multi_array<T, sizeof...(Ts)>(newShape, copy.Data());
+        output[i] = data[indices[i]];
     }
+}
+#endif
 
-    // Conversion
-    template<typename U> multi_array<U, N> As() const
+/** data[indices[i]] = values[i] (later duplicates win). **/
+template<typename T> void scatter_elements(T* data, const size_t* indices, size_t count, const T* values)
+{
+    size_t i = 0;
+    for (; i + prefetch_distance < count; i++)
     {
-        std::valarray<U> result;
-        auto data = Data();
-        result.resize(fSize);
-        for (size_t i = 0; i < fSize; i++)
-        {
-            result[i] = U(data[i]);
-        }
-        return multi_array<U, N>(fShape, std::move(result));
+        prefetch_write(data + indices[i + prefetch_distance]);
+        data[indices[i]] = values[i];
     }
-
-    multi_array_view_const<T, N> ReadOnly() const
+    for (; i < count; i++)
     {
-        return multi_array_view_const<T, N>(*this);
+        data[indices[i]] = values[i];
     }
+}
 
-    multi_array<T, N> Apply(std::function<T(T)> f) const
+/** data[indices[i]] += values[i], accumulating duplicates. **/
+template<typename T> void scatter_add_elements(T* data, const size_t* indices, size_t count, const T* values)
+{
+    size_t i = 0;
+    for (; i + prefetch_distance < count; i++)
     {
-        std::valarray<T> result;
-        auto data = Data();
-        result.resize(fSize);
-        for (size_t i = 0; i < fSize; i++)
-        {
-            result[i] = f(data[i]);
-        }
-        return multi_array<T, N>(fShape, std::move(result));
+        prefetch_write(data + indices[i + prefetch_distance]);
+        data[indices[i]] += values[i];
     }
-
-    template<typename U> multi_array<U, N> Apply(std::function<U(const T&)> f) const
+    for (; i < count; i++)
     {
-        std::valarray<U> result;
-        auto data = Data();
-        result.resize(fSize);
-        for (size_t i = 0; i < fSize; i++)
-        {
-            result[i] = f(data[i]);
-        }
-        return multi_array<U, N>(fShape, std::move(result));
+        data[indices[i]] += values[i];
     }
-};
+}
 
-/**
-  * @short Multi-dimensional array, owning its data.
-  */
-template<typename T, size_t N> class multi_array : public multi_array_base<T, N, array_owner_impl>
+/** Omitted start or stop of a slice (written as _ in _(start, stop, step)). **/
+constexpr int slice_omitted = std::numeric_limits<int>::min();
+
+template<size_t N> struct slicer_base
 {
 public:
-    // Type aliases
-    #ifdef __GNUC__
-        using base_type = multi_array_base<T, N, array_owner_impl>;
-    #else
-        using base_type = multi_array_base;
-    #endif
-    using typename base_type::index_type;
-    using typename base_type::data_type;    // std::valarray<T>
+    static constexpr size_t new_dim(int M) { return (N == 1) ? (M-1) : M; }
 
-protected:
-    // Import members
-    using index_impl<N>::fStrides;
-    using index_impl<N>::fShape;
-    using index_impl<N>::fSize;
-    using index_impl<N>::fOffset;
+    // template<size_t M> using target_array_type = std::array<size_t, new_dim(M)>;
+
+    // template<size_t M> using target_pair_type = std::pair<target_array_type<M>, target_array_type<M>>;
+
+    template<class... Ts> constexpr slicer_base(Ts... args)
+        : fNumbers({args...})
+    {
+        static_assert(N <= 3, "Cannot have slicer with dim > 3");
+    }
+
+protected:
+    std::array<int, N> fNumbers;
+};
+
+template<size_t N> struct slicer : public slicer_base<N>
+{
+    using slicer_base<N>::new_dim;
+
+    static constexpr size_t deltaDim = 0;
+
+    using slicer_base<N>::slicer_base;
+
+    using slicer_base<N>::fNumbers;
+
+    template<size_t M> std::tuple<size_t, std::array<size_t, new_dim(M)>, std::array<size_t, new_dim(M)>>
+        apply(size_t offset, std::array<size_t, M> shape, std::array<size_t, M> strides, size_t I) const
+    {
+        if (N == 0)
+        {
+            return std::make_tuple(offset, shape, strides);     // All things equal :-)
+        }
+        else
+        {
+            // Python rules: negative positions count from the end, bounds are clipped
+            const std::ptrdiff_t length = shape[I];
+            const std::ptrdiff_t step = (N == 2) ? 1 : fNumbers[2];
+            if (step == 0)
+            {
+                throw std::runtime_error("Slice step cannot be zero.");
+            }
+            const std::ptrdiff_t start = bound(fNumbers[0], length, step, (step > 0) ? 0 : length - 1);
+            const std::ptrdiff_t stop = bound(fNumbers[1], length, step, (step > 0) ? length : -1);
+            std::ptrdiff_t count = 0;
+            if ((step > 0) && (stop > start))
+            {
+                count = (stop - start - 1) / step + 1;
+            }
+            else if ((step < 0) && (start > stop))
+            {
+                count = (start - stop - 1) / (-step) + 1;
+            }
+
+            size_t newOffset = count ? (offset + strides[I] * size_t(start)) : offset;
+            std::array<size_t, new_dim(M)> newShape;
+            std::array<size_t, new_dim(M)> newStrides;
+
+            for (int i = 0; i < I; i++)
+            {
+                newShape[i] = shape[i];
+                newStrides[i] = strides[i];
+            }
+            newShape[I] = size_t(count);
+            newStrides[I] = size_t(std::ptrdiff_t(strides[I]) * step);   // Wraps around for negative steps
+            for (int j = I+1; j < new_dim(M); j++)
+            {
+                newShape[j] = shape[j];
+                newStrides[j] = strides[j];
+            }
+
+            return std::make_tuple(newOffset, newShape, newStrides);
+        }
+    }
+
+private:
+    static std::ptrdiff_t bound(int value, std::ptrdiff_t length, std::ptrdiff_t step, std::ptrdiff_t omitted)
+    {
+        if (value == slice_omitted)
+        {
+            return omitted;
+        }
+        std::ptrdiff_t result = (value < 0) ? (value + length) : value;
+        if (step > 0)
+        {
+            return std::max(std::ptrdiff_t(0), std::min(result, length));
+        }
+        else
+        {
+            return std::max(std::ptrdiff_t(-1), std::min(result, length - 1));
+        }
+    }
+};
+
+/* template<class... Ts> multi_array_view<T, slicer_result<T, N, Ts...>
+{
+}
+
+template<class T1, class... Ts> multi_array_view<T, slicer_result<T, N, T1, Ts...>
+{
+    static constexpr size_t
+}*/
+
+template<> struct slicer<1> : public slicer_base<1>
+{
+    using slicer_base<1>::new_dim;
+
+    using slicer_base<1>::slicer_base;
+
+    using slicer_base<1>::fNumbers;
+
+    static constexpr size_t deltaDim = 1;
+
+    template<size_t M> std::tuple<size_t, std::array<size_t, new_dim(M)>, std::array<size_t, new_dim(M)>>
+        apply(size_t offset, std::array<size_t, M> shape, std::array<size_t, M> strides, size_t I) const
+    {
+        size_t start = index(fNumbers[0], shape[I]);
+
+        size_t newOffset = offset + strides[I] * start;
+        std::array<size_t, new_dim(M)> newShape;
+        std::array<size_t, new_dim(M)> newStrides;
+        for (int i = 0; i < I; i++)
+        {
+            newShape[i] = shape[i];
+            newStrides[i] = strides[i];
+        }
+        for (int j = I; j < new_dim(M); j++)
+        {
+            newShape[j] = shape[j+1];
+            newStrides[j] = strides[j+1];
+        }
+        return std::make_tuple(newOffset, newShape, newStrides);     // All things equal :-)
+    }
+
+    /** Position along an axis of given length (negative values count from the end). **/
+    static size_t index(int value, size_t length)
+    {
+        std::ptrdiff_t result = (value < 0) ? (value + std::ptrdiff_t(length)) : value;
+        if ((result < 0) || (result >= std::ptrdiff_t(length)))
+        {
+            throw std::runtime_error("Index out of range.");
+        }
+        return size_t(result);
+    }
+};
+
+template<class... Ts> constexpr slicer<(sizeof...(Ts))> make_slicer(Ts... others)
+{
+    return slicer<(sizeof...(Ts))>(others...);
+}
+
+struct slice_helper
+{
+    template<typename... Ts> slicer<sizeof...(Ts)> operator()(Ts... args) const
+    {
+        return make_slicer(argument(args)...);
+    }
+
+private:
+    static constexpr int argument(int value) { return value; }
+
+    // _ itself stands for an omitted start / stop, e.g. _(_, _, -1) reverses an axis
+    static constexpr int argument(const slice_helper&) { return slice_omitted; }
+};
+
+constexpr slice_helper _;
+
+/** Inserts a new axis of length 1 in operator() (like numpy.newaxis). **/
+struct newaxis_type { };
+
+constexpr newaxis_type newaxis {};
+
+/** Stands for all the axes not indexed explicitly in operator() (like ... in numpy). **/
+struct ellipsis_type { };
+
+constexpr ellipsis_type ellipsis {};
+
+/** Number of axes of an array consumed by indices in operator(). **/
+template<typename... Ts> struct consumed_axes
+{
+    static constexpr int value = 0;
+};
+
+template<typename T1, typename... Ts> struct consumed_axes<T1, Ts...>
+{
+    static constexpr int value = 1 + consumed_axes<Ts...>::value;
+};
+
+template<typename... Ts> struct consumed_axes<newaxis_type, Ts...>
+{
+    static constexpr int value = consumed_axes<Ts...>::value;
+};
+
+template<typename... Ts> struct consumed_axes<ellipsis_type, Ts...>
+{
+    static constexpr int value = consumed_axes<Ts...>::value;
+};
+
+// template<typename T, size_t N, template<typename, size_t> class data_policy> class multi_array_base
+
+/** Creates strides for a regular array. **/
+template<size_t N> std::array<size_t, N> get_strides(const std::array<size_t, N>& arr)
+{
+    std::array<size_t, N> result;
+    result[N - 1] = 1;
+    for (size_t i = 1; i < N; i++)
+    {
+        result[N - 1 - i] = result[N - i] * arr[N - i];
+    }
+    return result;
+}
+
+/** Shape of the result of broadcasting two shapes against each other (numpy rules). **/
+template<size_t M, size_t N> std::array<size_t, (M > N) ? M : N> broadcast_shape(const std::array<size_t, M>& a, const std::array<size_t, N>& b)
+{
+    constexpr size_t R = (M > N) ? M : N;
+    std::array<size_t, R> result;
+    for (size_t i = 0; i < R; i++)
+    {
+        // Missing leading axes count as length 1
+        size_t x = (i + M >= R) ? a[i + M - R] : 1;
+        size_t y = (i + N >= R) ? b[i + N - R] : 1;
+        if ((x != y) && (x != 1) && (y != 1))
+        {
+            throw std::runtime_error("Incompatible shapes for broadcasting.");
+        }
+        result[i] = (x == 1) ? y : x;
+    }
+    return result;
+}
+
+/** Strides of an array broadcast to shape (repeated axes get stride 0). **/
+template<size_t M, size_t N> std::array<size_t, N> broadcast_strides(const std::array<size_t, M>& shape, const std::array<size_t, M>& strides,
+    const std::array<size_t, N>& target)
+{
+    static_assert(M <= N, "Cannot broadcast to fewer dimensions.");
+    std::array<size_t, N> result{};
+    for (size_t i = 0; i < M; i++)
+    {
+        size_t j = N - M + i;
+        if (shape[i] == target[j])
+        {
+            result[j] = strides[i];
+        }
+        else if (shape[i] != 1)
+        {
+            throw std::runtime_error("Incompatible shapes for broadcasting.");
+        }
+    }
+    return result;
+}
+
+/**
+  * @short Iteration over elements of equally-shaped strided operands.
+  *
+  * Dimensions of length 1 are dropped and adjacent dimensions whose strides
+  * are compatible in all K operands are merged, so that the inner loop runs
+  * over the longest possible run of elements. Elements are visited in
+  * the C order of the shape; the callback is called for each inner run as
+  *
+  *     f(const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides)
+  *
+  * with K offsets of its first element and K strides (in elements).
+  * Strides may be negative (stored wrapped around in size_t).
+  */
+template<size_t N, size_t K> class nditer
+{
+public:
+    using index_type = std::array<size_t, N>;
+
+    nditer(const index_type& shape, const std::array<index_type, K>& strides, const std::array<size_t, K>& offsets)
+        : fDim(0), fEmpty(false)
+    {
+        for (size_t k = 0; k < K; k++)
+        {
+            fOffsets[k] = std::ptrdiff_t(offsets[k]);
+        }
+        for (size_t i = 0; i < N; i++)
+        {
+            if (shape[i] == 0)
+            {
+                fEmpty = true;
+            }
+            if (shape[i] <= 1)
+            {
+                continue;
+            }
+            bool mergeable = (fDim > 0);
+            for (size_t k = 0; mergeable && (k < K); k++)
+            {
+                mergeable = (fStrides[k][fDim - 1] == strides[k][i] * shape[i]);
+            }
+            if (mergeable)
+            {
+                fShape[fDim - 1] *= shape[i];
+                for (size_t k = 0; k < K; k++)
+                {
+                    fStrides[k][fDim - 1] = strides[k][i];
+                }
+            }
+            else
+            {
+                fShape[fDim] = shape[i];
+                for (size_t k = 0; k < K; k++)
+                {
+                    fStrides[k][fDim] = strides[k][i];
+                }
+                fDim++;
+            }
+        }
+    }
+
+    /** Number of dimensions after coalescing. **/
+    size_t Dim() const { return fDim; }
+
+    /** Length of the inner runs. **/
+    size_t InnerSize() const { return fEmpty ? 0 : (fDim ? fShape[fDim - 1] : 1); }
+
+    template<typename F> void ForEach(F f) const
+    {
+        if (fEmpty)
+        {
+            return;
+        }
+        std::array<std::ptrdiff_t, K> offsets = fOffsets;
+        std::array<std::ptrdiff_t, K> innerStrides;
+        for (size_t k = 0; k < K; k++)
+        {
+            innerStrides[k] = fDim ? std::ptrdiff_t(fStrides[k][fDim - 1]) : 0;
+        }
+        index_type counter{};
+        size_t count = InnerSize();
+        while (true)
+        {
+            f(offsets.data(), count, innerStrides.data());
+
+            // Odometer over the outer dimensions
+            size_t i = (fDim > 1) ? (fDim - 1) : 0;
+            for (; i > 0; i--)
+            {
+                size_t d = i - 1;
+                for (size_t k = 0; k < K; k++)
+                {
+                    offsets[k] += std::ptrdiff_t(fStrides[k][d]);
+                }
+                if (++counter[d] < fShape[d])
+                {
+                    break;
+                }
+                counter[d] = 0;
+                for (size_t k = 0; k < K; k++)
+                {
+                    offsets[k] -= std::ptrdiff_t(fStrides[k][d] * fShape[d]);
+                }
+            }
+            if (i == 0)
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    size_t fDim;
+
+    bool fEmpty;
+
+    index_type fShape;
+
+    std::array<index_type, K> fStrides;
+
+    std::array<std::ptrdiff_t, K> fOffsets;
+};
+
+/** nditer over two operands. **/
+template<size_t N> nditer<N, 2> make_nditer(const std::array<size_t, N>& shape,
+    const std::array<size_t, N>& strides1, size_t offset1, const std::array<size_t, N>& strides2, size_t offset2)
+{
+    return nditer<N, 2>(shape, {{ strides1, strides2 }}, {{ offset1, offset2 }});
+}
+
+/** Copy a strided run of elements (with explicit conversion). **/
+template<typename T, typename U> void copy_strided(const T* source, std::ptrdiff_t sourceStride, U* target, std::ptrdiff_t targetStride, size_t count)
+{
+    std::ptrdiff_t n = count;
+    if ((sourceStride == 1) && (targetStride == 1))
+    {
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = U(source[i]);
+        }
+    }
+    else
+    {
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i * targetStride] = U(source[i * sourceStride]);
+        }
+    }
+}
+
+/** Set all elements of a strided run. **/
+template<typename T> void fill_strided(T* target, std::ptrdiff_t stride, size_t count, const T& value)
+{
+    std::ptrdiff_t n = count;
+    for (std::ptrdiff_t i = 0; i < n; i++)
+    {
+        target[i * stride] = value;
+    }
+}
+
+/** Convert a strided run of elements to contiguous target (through compute types). **/
+template<typename T, typename U> void convert_strided(const T* source, std::ptrdiff_t stride, U* target, size_t count)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    using target_compute_type = typename storage_traits<U>::compute_type;
+    if (stride == 1)
+    {
+        for_each_block(source, count, [&](const compute_type* block, size_t blockSize, size_t offset) {
+            transform_blocks(target + offset, blockSize, [&](target_compute_type* targetBlock, size_t, size_t) {
+                for (size_t i = 0; i < blockSize; i++)
+                {
+                    targetBlock[i] = target_compute_type(block[i]);
+                }
+            });
+        });
+    }
+    else
+    {
+        std::ptrdiff_t n = count;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = U(target_compute_type(compute_type(source[i * stride])));
+        }
+    }
+}
+
+/** Apply f(compute_type&) in place to a strided run. **/
+template<typename T, typename F> void transform_strided(T* data, std::ptrdiff_t stride, size_t count, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (stride == 1)
+    {
+        transform_blocks(data, count, [&f](compute_type* block, size_t blockSize, size_t) {
+            for (size_t i = 0; i < blockSize; i++)
+            {
+                f(block[i]);
+            }
+        });
+    }
+    else
+    {
+        std::ptrdiff_t n = count;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            compute_type x = data[i * stride];
+            f(x);
+            data[i * stride] = T(x);
+        }
+    }
+}
+
+/** Apply f(compute_type&, const compute_type&) in place to pairs from two strided runs. **/
+template<typename T, typename F> void transform_strided(T* data, std::ptrdiff_t stride, const T* other, std::ptrdiff_t otherStride, size_t count, F f)
+{
+    using traits = storage_traits<T>;
+    using compute_type = typename traits::compute_type;
+    if ((stride == 1) && (otherStride == 1))
+    {
+        transform_blocks(data, count, [&](compute_type* block, size_t blockSize, size_t offset) {
+            compute_type buffer[traits::is_converted ? storage_block_size : 1];
+            const compute_type* otherBlock = traits::begin_block(other + offset, buffer, blockSize);
+            for (size_t i = 0; i < blockSize; i++)
+            {
+                f(block[i], otherBlock[i]);
+            }
+        });
+    }
+    else if ((stride == 1) && (otherStride == 0))
+    {
+        // Broadcast operand
+        const compute_type y = *other;
+        transform_blocks(data, count, [&](compute_type* block, size_t blockSize, size_t) {
+            for (size_t i = 0; i < blockSize; i++)
+            {
+                f(block[i], y);
+            }
+        });
+    }
+    else
+    {
+        std::ptrdiff_t n = count;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            compute_type x = data[i * stride];
+            f(x, compute_type(other[i * otherStride]));
+            data[i * stride] = T(x);
+        }
+    }
+}
+
+/** target[i] = f(a[i * aStride], b[i * bStride]) for strided runs (contiguous target). **/
+template<typename T, typename U, typename F> void combine_strided(const T* a, std::ptrdiff_t aStride, const T* b, std::ptrdiff_t bStride,
+    U* target, size_t count, F f)
+{
+    std::ptrdiff_t n = count;
+    if ((aStride == 1) && (bStride == 1))
+    {
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = f(a[i], b[i]);
+        }
+    }
+    else if ((aStride == 1) && (bStride == 0))
+    {
+        const T y = *b;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = f(a[i], y);
+        }
+    }
+    else if ((aStride == 0) && (bStride == 1))
+    {
+        const T x = *a;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = f(x, b[i]);
+        }
+    }
+    else
+    {
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            target[i] = f(a[i * aStride], b[i * bStride]);
+        }
+    }
+}
+
+/** Sum of a strided run (in compute_type). **/
+template<typename T> typename storage_traits<T>::compute_type sum_strided(const T* data, std::ptrdiff_t stride, size_t count)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    compute_type total = compute_type();
+    if (stride == 1)
+    {
+        for_each_block(data, count, [&total](const compute_type* block, size_t blockSize, size_t) {
+            for (size_t i = 0; i < blockSize; i++)
+            {
+                total += block[i];
+            }
+        });
+    }
+    else
+    {
+        std::ptrdiff_t n = count;
+        for (std::ptrdiff_t i = 0; i < n; i++)
+        {
+            total += compute_type(data[i * stride]);
+        }
+    }
+    return total;
+}
+
+/** Edge length of the tiles used when reordering axes in copies. **/
+constexpr size_t transpose_block_size = 32;
+
+/** Magnitude of a (possibly wrapped-around negative) stride. **/
+inline std::ptrdiff_t stride_magnitude(size_t stride)
+{
+    std::ptrdiff_t value = std::ptrdiff_t(stride);
+    return (value < 0) ? -value : value;
+}
+
+/**
+  * @short Copy a rows x cols tile, reordering it between two axes.
+  *
+  * target[i * targetStride + j] = source[i * rowStride + j * colStride]
+  */
+template<typename T> void transpose_tile(const T* source, std::ptrdiff_t rowStride, std::ptrdiff_t colStride,
+    T* target, std::ptrdiff_t targetStride, size_t rows, size_t cols)
+{
+    std::ptrdiff_t m = rows;
+    std::ptrdiff_t n = cols;
+    for (std::ptrdiff_t i = 0; i < m; i++)
+    {
+        for (std::ptrdiff_t j = 0; j < n; j++)
+        {
+            target[i * targetStride + j] = source[i * rowStride + j * colStride];
+        }
+    }
+}
+
+#if defined(__AVX__)
+inline void transpose_tile(const double* source, std::ptrdiff_t rowStride, std::ptrdiff_t colStride,
+    double* target, std::ptrdiff_t targetStride, size_t rows, size_t cols)
+{
+    if (rowStride != 1)
+    {
+        transpose_tile<double>(source, rowStride, colStride, target, targetStride, rows, cols);
+        return;
+    }
+    // 4x4 blocks: load four source columns, shuffle them into four target rows
+    size_t rows4 = rows & ~size_t(3);
+    size_t cols4 = cols & ~size_t(3);
+    for (size_t i = 0; i < rows4; i += 4)
+    {
+        for (size_t j = 0; j < cols4; j += 4)
+        {
+            const double* s = source + i + j * colStride;
+            __m256d v0 = _mm256_loadu_pd(s);
+            __m256d v1 = _mm256_loadu_pd(s + colStride);
+            __m256d v2 = _mm256_loadu_pd(s + 2 * colStride);
+            __m256d v3 = _mm256_loadu_pd(s + 3 * colStride);
+            __m256d t0 = _mm256_unpacklo_pd(v0, v1);
+            __m256d t1 = _mm256_unpackhi_pd(v0, v1);
+            __m256d t2 = _mm256_unpacklo_pd(v2, v3);
+            __m256d t3 = _mm256_unpackhi_pd(v2, v3);
+            double* t = target + i * targetStride + j;
+            _mm256_storeu_pd(t, _mm256_permute2f128_pd(t0, t2, 0x20));
+            _mm256_storeu_pd(t + targetStride, _mm256_permute2f128_pd(t1, t3, 0x20));
+            _mm256_storeu_pd(t + 2 * targetStride, _mm256_permute2f128_pd(t0, t2, 0x31));
+            _mm256_storeu_pd(t + 3 * targetStride, _mm256_permute2f128_pd(t1, t3, 0x31));
+        }
+    }
+    // Remaining right and bottom edges
+    transpose_tile<double>(source + cols4 * colStride, 1, colStride, target + cols4, targetStride, rows4, cols - cols4);
+    transpose_tile<double>(source + rows4, 1, colStride, target + rows4 * targetStride, targetStride, rows - rows4, cols);
+}
+#endif
+
+#if defined(__SSE__)
+inline void transpose_tile(const float* source, std::ptrdiff_t rowStride, std::ptrdiff_t colStride,
+    float* target, std::ptrdiff_t targetStride, size_t rows, size_t cols)
+{
+    if (rowStride != 1)
+    {
+        transpose_tile<float>(source, rowStride, colStride, target, targetStride, rows, cols);
+        return;
+    }
+    size_t rows4 = rows & ~size_t(3);
+    size_t cols4 = cols & ~size_t(3);
+    for (size_t i = 0; i < rows4; i += 4)
+    {
+        for (size_t j = 0; j < cols4; j += 4)
+        {
+            const float* s = source + i + j * colStride;
+            __m128 v0 = _mm_loadu_ps(s);
+            __m128 v1 = _mm_loadu_ps(s + colStride);
+            __m128 v2 = _mm_loadu_ps(s + 2 * colStride);
+            __m128 v3 = _mm_loadu_ps(s + 3 * colStride);
+            _MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+            float* t = target + i * targetStride + j;
+            _mm_storeu_ps(t, v0);
+            _mm_storeu_ps(t + targetStride, v1);
+            _mm_storeu_ps(t + 2 * targetStride, v2);
+            _mm_storeu_ps(t + 3 * targetStride, v3);
+        }
+    }
+    transpose_tile<float>(source + cols4 * colStride, 1, colStride, target + cols4, targetStride, rows4, cols - cols4);
+    transpose_tile<float>(source + rows4, 1, colStride, target + rows4 * targetStride, targetStride, rows - rows4, cols);
+}
+#endif
+
+/**
+  * @short Copy strided elements into a contiguous (C-order) target.
+  *
+  * When the fastest-varying axis of the source is not the last one
+  * (e.g. a transposed view), the plane of these two axes is copied
+  * in tiles small enough to stay in cache for both reading and writing.
+  * Otherwise, this is a plain nditer copy.
+  */
+template<typename T, size_t N> void copy_to_contiguous(const T* source, const std::array<size_t, N>& shape,
+    const std::array<size_t, N>& strides, T* target)
+{
+    std::array<size_t, N> targetStrides = get_strides(shape);
+    size_t p = N;       // Axis with the smallest stride
+    for (size_t i = 0; i < N; i++)
+    {
+        if ((shape[i] > 1) && strides[i] && ((p == N) || (stride_magnitude(strides[i]) < stride_magnitude(strides[p]))))
+        {
+            p = i;
+        }
+    }
+    const size_t last = N - 1;
+    if ((p >= last) || (shape[last] <= 1))
+    {
+        make_nditer(shape, strides, 0, targetStrides, 0).ForEach(
+            [source, target](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* runStrides) {
+                copy_strided(source + offsets[0], runStrides[0], target + offsets[1], runStrides[1], count);
+            });
+        return;
+    }
+
+    // Tiles in the (p, last) plane, the other axes iterated outside
+    std::array<size_t, N> outerShape = shape;
+    outerShape[p] = 1;
+    outerShape[last] = 1;
+    const size_t rows = shape[p];
+    const size_t cols = shape[last];
+    const std::ptrdiff_t rowStride = std::ptrdiff_t(strides[p]);
+    const std::ptrdiff_t colStride = std::ptrdiff_t(strides[last]);
+    const std::ptrdiff_t targetRowStride = std::ptrdiff_t(targetStrides[p]);
+    make_nditer(outerShape, strides, 0, targetStrides, 0).ForEach(
+        [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* runStrides) {
+            for (size_t k = 0; k < count; k++)
+            {
+                const T* s = source + offsets[0] + std::ptrdiff_t(k) * runStrides[0];
+                T* t = target + offsets[1] + std::ptrdiff_t(k) * runStrides[1];
+                for (size_t i = 0; i < rows; i += transpose_block_size)
+                {
+                    size_t tileRows = std::min(transpose_block_size, rows - i);
+                    for (size_t j = 0; j < cols; j += transpose_block_size)
+                    {
+                        size_t tileCols = std::min(transpose_block_size, cols - j);
+                        transpose_tile(s + std::ptrdiff_t(i) * rowStride + std::ptrdiff_t(j) * colStride, rowStride, colStride,
+                            t + std::ptrdiff_t(i) * targetRowStride + j, targetRowStride, tileRows, tileCols);
+                    }
+                }
+            }
+        });
+}
+
+/**
+  * Parallel execution of the heavier algorithms (convolution, ...).
+  *
+  * Uses std::thread (link with -pthread), can be switched off by defining
+  * G4MULTIARRAY_USE_THREADS to 0.
+  */
+#ifndef G4MULTIARRAY_USE_THREADS
+    #define G4MULTIARRAY_USE_THREADS 1
+#endif
+
+#if G4MULTIARRAY_USE_THREADS
+/** Whether the current thread runs a chunk of parallel_for (nested calls then run serially). **/
+inline bool& in_parallel_for()
+{
+    static thread_local bool inside = false;
+    return inside;
+}
+#endif
+
+/**
+  * @short Call f(begin, end) for consecutive chunks of [0, count), in parallel threads.
+  *
+  * Inside a chunk, parallel_for and thread_count() do not spawn more threads.
+  * An exception thrown by f is rethrown (the first one, by chunk order)
+  * after all the threads have been joined.
+  */
+template<typename F> void parallel_for(size_t count, F f, size_t grain = 1)
+{
+#if G4MULTIARRAY_USE_THREADS
+    size_t threads = in_parallel_for() ? 1 : std::thread::hardware_concurrency();
+    if (grain && (threads > count / grain))
+    {
+        threads = count / grain;
+    }
+    if (threads > 1)
+    {
+        size_t chunk = (count + threads - 1) / threads;
+        size_t chunks = (count + chunk - 1) / chunk;
+        std::vector<std::exception_ptr> errors(chunks);
+        auto run = [&](size_t index) {
+            in_parallel_for() = true;
+            try
+            {
+                f(index * chunk, std::min(count, (index + 1) * chunk));
+            }
+            catch (...)
+            {
+                errors[index] = std::current_exception();
+            }
+            in_parallel_for() = false;
+        };
+        std::vector<std::thread> workers;
+        for (size_t index = 1; index < chunks; index++)
+        {
+            workers.emplace_back(run, index);
+        }
+        run(0);
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        for (auto& error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+        return;
+    }
+#endif
+    f(0, count);
+}
+
+/** Number of threads parallel_for runs (1 without thread support or inside parallel_for). **/
+inline size_t thread_count()
+{
+#if G4MULTIARRAY_USE_THREADS
+    return in_parallel_for() ? 1 : std::max<size_t>(1, std::thread::hardware_concurrency());
+#else
+    return 1;
+#endif
+}
+
+/** Elements below which a scan runs in one thread. **/
+constexpr size_t scan_parallel_threshold = size_t(1) << 18;
+
+/** Addition as a scan operator (vectorized for float and double). **/
+struct scan_add
+{
+    template<typename C> void operator()(C& x, const C& y) const { x += y; }
+};
+
+/** Multiplication as a scan operator. **/
+struct scan_multiply
+{
+    template<typename C> void operator()(C& x, const C& y) const { x *= y; }
+};
+
+/** Inclusive scan of contiguous data continuing from carry: data[i] = carry = f(carry, data[i]). **/
+template<typename T, typename F> typename storage_traits<T>::compute_type scan_contiguous(T* data, size_t count,
+    typename storage_traits<T>::compute_type carry, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    transform_blocks(data, count, [&](compute_type* block, size_t blockSize, size_t) {
+        for (size_t i = 0; i < blockSize; i++)
+        {
+            f(carry, block[i]);
+            block[i] = carry;
+        }
+    });
+    return carry;
+}
+
+#if defined(__SSE2__)
+/** Prefix sums of 4 floats in a register (log-step shifts), plus the carry. **/
+inline float scan_contiguous(float* data, size_t count, float carry, scan_add)
+{
+    __m128 c = _mm_set1_ps(carry);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(data + i);
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+        x = _mm_add_ps(x, c);
+        _mm_storeu_ps(data + i, x);
+        c = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    carry = _mm_cvtss_f32(c);
+    for (; i < count; i++)
+    {
+        carry += data[i];
+        data[i] = carry;
+    }
+    return carry;
+}
+
+inline double scan_contiguous(double* data, size_t count, double carry, scan_add)
+{
+    __m128d c = _mm_set1_pd(carry);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(data + i);
+        x = _mm_add_pd(x, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8)));
+        x = _mm_add_pd(x, c);
+        _mm_storeu_pd(data + i, x);
+        c = _mm_unpackhi_pd(x, x);
+    }
+    carry = _mm_cvtsd_f64(c);
+    for (; i < count; i++)
+    {
+        carry += data[i];
+        data[i] = carry;
+    }
+    return carry;
+}
+#endif
+
+/** Inclusive scan of a strided run continuing from carry. **/
+template<typename T, typename F> typename storage_traits<T>::compute_type scan_strided(T* data, std::ptrdiff_t stride, size_t count,
+    typename storage_traits<T>::compute_type carry, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (stride == 1)
+    {
+        return scan_contiguous(data, count, carry, f);
+    }
+    for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++)
+    {
+        f(carry, compute_type(data[i * stride]));
+        data[i * stride] = T(carry);
+    }
+    return carry;
+}
+
+/** Inclusive scan of a strided run (the first element stays). **/
+template<typename T, typename F> void scan_strided(T* data, std::ptrdiff_t stride, size_t count, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (count > 1)
+    {
+        scan_strided(data + stride, stride, count - 1, compute_type(data[0]), f);
+    }
+}
+
+/**
+  * @short Inclusive scan of a long run split into chunks scanned in parallel.
+  *
+  * Two passes: totals of the chunks are computed in parallel and
+  * scanned, then each chunk is scanned continuing from the total of
+  * the preceding ones. Requires f to be associative.
+  */
+template<typename T, typename F> void scan_chunked(T* data, std::ptrdiff_t stride, size_t count, size_t chunks, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    const size_t chunk = (count + chunks - 1) / chunks;
+    chunks = (count + chunk - 1) / chunk;
+    std::vector<compute_type> totals(chunks);
+    parallel_for(chunks - 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            const T* x = data + std::ptrdiff_t(c * chunk) * stride;
+            compute_type total = compute_type(x[0]);
+            for (std::ptrdiff_t i = 1; i < std::ptrdiff_t(chunk); i++)
+            {
+                f(total, compute_type(x[i * stride]));
+            }
+            totals[c] = total;
+        }
+    });
+    for (size_t c = 1; c + 1 < chunks; c++)
+    {
+        compute_type carry = totals[c - 1];
+        f(carry, totals[c]);
+        totals[c] = carry;
+    }
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            T* x = data + std::ptrdiff_t(c * chunk) * stride;
+            const size_t n = std::min(chunk, count - c * chunk);
+            if (c == 0)
+            {
+                scan_strided(x, stride, n, f);
+            }
+            else
+            {
+                scan_strided(x, stride, n, totals[c - 1], f);
+            }
+        }
+    });
+}
+
+/** Length of the row blocks scanned together along a non-contiguous axis. **/
+constexpr size_t scan_block_size = 1024;
+
+/**
+  * @short Inclusive scan along the middle axis of a contiguous (outer, length, inner) block.
+  *
+  * Each row of inner elements is combined with the already scanned
+  * preceding one, so that the inner loop runs over contiguous elements.
+  * Blocks of rows are scanned in parallel.
+  */
+template<typename T, typename F> void scan_planes(T* data, size_t outer, size_t length, size_t inner, F f)
+{
+    const size_t blocks = (inner + scan_block_size - 1) / scan_block_size;
+    const size_t grain = std::max<size_t>(1, scan_parallel_threshold / (length * std::min(inner, scan_block_size)));
+    parallel_for(outer * blocks, [&](size_t begin, size_t end) {
+        for (size_t task = begin; task < end; task++)
+        {
+            const size_t x = (task % blocks) * scan_block_size;
+            const size_t count = std::min(scan_block_size, inner - x);
+            T* row = data + (task / blocks) * length * inner + x;
+            for (size_t i = 1; i < length; i++, row += inner)
+            {
+                T* next = row + inner;
+                for (size_t j = 0; j < count; j++)
+                {
+                    T carry = row[j];
+                    f(carry, next[j]);
+                    next[j] = carry;
+                }
+            }
+        }
+    }, grain);
+}
+
+/**
+  * @short Order-preserving map of values to unsigned keys for radix sorting.
+  *
+  * Defined for integers and IEEE floating-point types: negative floats
+  * get all bits inverted, others the sign bit set; NaN sorts last.
+  */
+template<typename T, typename Enable = void> struct sort_key_traits
+{
+    static constexpr bool radix = false;
+};
+
+template<typename T> struct sort_key_traits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static constexpr bool radix = true;
+    using key_type = typename std::make_unsigned<T>::type;
+    static constexpr key_type offset = std::is_signed<T>::value ? key_type(key_type(1) << (8 * sizeof(T) - 1)) : key_type(0);
+
+    static key_type key(T x) { return key_type(key_type(x) ^ offset); }
+    static T value(key_type k) { return T(key_type(k ^ offset)); }
+};
+
+template<typename T> struct sort_key_traits<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+    static constexpr bool radix = true;
+    using key_type = typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type;
+    static constexpr key_type sign = key_type(key_type(1) << (8 * sizeof(T) - 1));
+
+    static key_type key(T x)
+    {
+        if (x != x)
+        {
+            return key_type(~key_type(0));
+        }
+        key_type bits;
+        std::memcpy(&bits, &x, sizeof(T));
+        return (bits & sign) ? key_type(~bits) : key_type(bits | sign);
+    }
+
+    static T value(key_type k)
+    {
+        const key_type bits = (k & sign) ? key_type(k & ~sign) : key_type(~k);
+        T x;
+        std::memcpy(&x, &bits, sizeof(T));
+        return x;
+    }
+};
+
+/** Below this, lines are sorted by comparison instead of radix passes. **/
+constexpr size_t radix_sort_threshold = 256;
+
+/** Elements from which one line is sorted in parallel chunks. **/
+constexpr size_t sort_parallel_threshold = size_t(1) << 17;
+
+/**
+  * @short Stable LSD radix sort of keys (8 bits per pass) carrying optional indices.
+  *
+  * Passes in which all keys share the digit are skipped.
+  */
+template<typename K> void radix_sort(K* keys, size_t* indices, size_t count, K* keyBuffer, size_t* indexBuffer)
+{
+    K* source = keys;
+    K* target = keyBuffer;
+    size_t* sourceIndices = indices;
+    size_t* targetIndices = indexBuffer;
+    for (size_t shift = 0; shift < 8 * sizeof(K); shift += 8)
+    {
+        size_t counts[256] = {};
+        for (size_t i = 0; i < count; i++)
+        {
+            counts[(source[i] >> shift) & 0xFF]++;
+        }
+        if (counts[(source[0] >> shift) & 0xFF] == count)
+        {
+            continue;
+        }
+        size_t position = 0;
+        for (size_t d = 0; d < 256; d++)
+        {
+            const size_t n = counts[d];
+            counts[d] = position;
+            position += n;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            const size_t j = counts[(source[i] >> shift) & 0xFF]++;
+            target[j] = source[i];
+            if (indices)
+            {
+                targetIndices[j] = sourceIndices[i];
+            }
+        }
+        std::swap(source, target);
+        std::swap(sourceIndices, targetIndices);
+    }
+    if (source != keys)
+    {
+        std::copy(source, source + count, keys);
+        if (indices)
+        {
+            std::copy(sourceIndices, sourceIndices + count, indices);
+        }
+    }
+}
+
+/** Stable sort of keys (with optional indices), by comparison for short runs. **/
+template<typename K> void sort_keys(K* keys, size_t* indices, size_t count, K* keyBuffer, size_t* indexBuffer)
+{
+    if (count < 2)
+    {
+        return;
+    }
+    if (count >= radix_sort_threshold)
+    {
+        radix_sort(keys, indices, count, keyBuffer, indexBuffer);
+    }
+    else if (indices)
+    {
+        std::copy(indices, indices + count, indexBuffer);
+        std::copy(keys, keys + count, keyBuffer);
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [keyBuffer](size_t a, size_t b) { return keyBuffer[a] < keyBuffer[b]; });
+        for (size_t i = 0; i < count; i++)
+        {
+            keys[i] = keyBuffer[order[i]];
+            indices[i] = indexBuffer[order[i]];
+        }
+    }
+    else
+    {
+        std::sort(keys, keys + count);
+    }
+}
+
+/**
+  * @short Number of elements of the left run among the first k of a stable merge of two sorted runs.
+  *
+  * Binary search along the merge path (ties taken from the left run first).
+  */
+template<typename K> size_t merge_path_split(const K* left, size_t leftCount, const K* right, size_t rightCount, size_t k)
+{
+    size_t low = (k > rightCount) ? (k - rightCount) : 0;
+    size_t high = std::min(k, leftCount);
+    while (low < high)
+    {
+        const size_t i = low + (high - low) / 2;
+        if (!(right[k - i - 1] < left[i]))
+        {
+            low = i + 1;        // left[i] precedes right[k - i - 1]
+        }
+        else
+        {
+            high = i;
+        }
+    }
+    return low;
+}
+
+/**
+  * @short Sort of keys in chunks sorted in parallel, then merged pairwise.
+  *
+  * At each merge level, the output is split into one equal slice per chunk;
+  * the start of a slice in both of the merged runs is found by the merge path,
+  * so that the threads stay equally loaded also in the last levels.
+  */
+template<typename K> void sort_keys_chunked(K* keys, size_t* indices, size_t count, size_t chunks)
+{
+    std::vector<K> keyBuffer(count);
+    std::vector<size_t> indexBuffer(indices ? count : 0);
+    const size_t chunk = (count + chunks - 1) / chunks;
+    chunks = (count + chunk - 1) / chunk;
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            const size_t first = c * chunk;
+            const size_t n = std::min(chunk, count - first);
+            sort_keys(keys + first, indices ? indices + first : nullptr, n, keyBuffer.data() + first, indices ? indexBuffer.data() + first : nullptr);
+        }
+    });
+    K* source = keys;
+    K* target = keyBuffer.data();
+    size_t* sourceIndices = indices;
+    size_t* targetIndices = indices ? indexBuffer.data() : nullptr;
+    for (size_t run = chunk; run < count; run *= 2)
+    {
+        parallel_for(chunks, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++)
+            {
+                // Output slice [k, stop), possibly spanning several pairs of runs
+                size_t k = c * chunk;
+                const size_t stop = std::min(k + chunk, count);
+                while (k < stop)
+                {
+                    const size_t first = k / (2 * run) * (2 * run);
+                    const size_t middle = std::min(first + run, count);
+                    const size_t last = std::min(first + 2 * run, count);
+                    const size_t until = std::min(stop, last);
+                    size_t i = first + merge_path_split(source + first, middle - first, source + middle, last - middle, k - first);
+                    size_t j = middle + (k - i);
+                    for (; k < until; k++)
+                    {
+                        // Left first on ties (stable)
+                        const size_t from = ((j == last) || ((i < middle) && !(source[j] < source[i]))) ? i++ : j++;
+                        target[k] = source[from];
+                        if (indices)
+                        {
+                            targetIndices[k] = sourceIndices[from];
+                        }
+                    }
+                }
+            }
+        });
+        std::swap(source, target);
+        std::swap(sourceIndices, targetIndices);
+    }
+    if (source != keys)
+    {
+        std::copy(source, source + count, keys);
+        if (indices)
+        {
+            std::copy(sourceIndices, sourceIndices + count, indices);
+        }
+    }
+}
+
+/** Sort a strided run of values (indices, if given, receive the original positions). **/
+template<typename T> void sort_strided(T* data, std::ptrdiff_t stride, size_t count, size_t* indices, std::true_type)
+{
+    using traits = sort_key_traits<T>;
+    using key_type = typename traits::key_type;
+    std::vector<key_type> keys(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        keys[i] = traits::key(data[std::ptrdiff_t(i) * stride]);
+    }
+    if (indices)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            indices[i] = i;
+        }
+    }
+    const size_t threads = thread_count();
+    if ((threads > 1) && (count >= sort_parallel_threshold))
+    {
+        sort_keys_chunked(keys.data(), indices, count, threads);
+    }
+    else
+    {
+        std::vector<key_type> keyBuffer(count);
+        std::vector<size_t> indexBuffer(indices ? count : 0);
+        sort_keys(keys.data(), indices, count, keyBuffer.data(), indices ? indexBuffer.data() : nullptr);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        data[std::ptrdiff_t(i) * stride] = traits::value(keys[i]);
+    }
+}
+
+/** Sort by comparison in compute_type (types without radix keys). **/
+template<typename T> void sort_strided(T* data, std::ptrdiff_t stride, size_t count, size_t* indices, std::false_type)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    std::vector<std::pair<compute_type, size_t>> items(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        items[i] = std::make_pair(compute_type(data[std::ptrdiff_t(i) * stride]), i);
+    }
+    std::stable_sort(items.begin(), items.end(),
+        [](const std::pair<compute_type, size_t>& a, const std::pair<compute_type, size_t>& b) { return a.first < b.first; });
+    for (size_t i = 0; i < count; i++)
+    {
+        data[std::ptrdiff_t(i) * stride] = T(items[i].first);
+        if (indices)
+        {
+            indices[i] = items[i].second;
+        }
+    }
+}
+
+template<typename T> void sort_strided(T* data, std::ptrdiff_t stride, size_t count, size_t* indices = nullptr)
+{
+    sort_strided(data, stride, count, indices, std::integral_constant<bool, sort_key_traits<T>::radix>());
+}
+
+/** Ordering of values by their sort keys (NaN last). **/
+template<typename T> typename std::enable_if<sort_key_traits<T>::radix, bool>::type sort_less(const T& a, const T& b)
+{
+    return sort_key_traits<T>::key(a) < sort_key_traits<T>::key(b);
+}
+
+template<typename T> typename std::enable_if<!sort_key_traits<T>::radix, bool>::type sort_less(const T& a, const T& b)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    return compute_type(a) < compute_type(b);
+}
+
+/** Throws unless count values have a quantile q. **/
+inline void check_quantile(size_t count, double q)
+{
+    if (!count)
+    {
+        throw std::runtime_error("Quantile of an empty array.");
+    }
+    if (!(q >= 0.0) || !(q <= 1.0))
+    {
+        throw std::runtime_error("Quantile must be between 0 and 1.");
+    }
+}
+
+/**
+  * @short Quantile of values (linear interpolation between the closest ranks).
+  *
+  * Selection, no full sort: the values are reordered.
+  */
+template<typename T> double quantile_of(T* values, size_t count, double q)
+{
+    check_quantile(count, q);
+    using compute_type = typename storage_traits<T>::compute_type;
+    const double position = q * double(count - 1);
+    const size_t lower = size_t(position);
+    const double fraction = position - double(lower);
+    std::nth_element(values, values + lower, values + count, sort_less<T>);
+    const double low = double(compute_type(values[lower]));
+    if ((fraction == 0.0) || (lower + 1 >= count))
+    {
+        return low;
+    }
+    const double high = double(compute_type(*std::min_element(values + lower + 1, values + count, sort_less<T>)));
+    return low + fraction * (high - low);
+}
+
+/** Atomic compare-and-swap on a word in plain memory (relaxed ordering). **/
+#if defined(_MSC_VER)
+inline bool compare_exchange(uint16_t* target, uint16_t& expected, uint16_t desired)
+{
+    const uint16_t previous = uint16_t(_InterlockedCompareExchange16(reinterpret_cast<volatile short*>(target), short(desired), short(expected)));
+    if (previous == expected) return true;
+    expected = previous;
+    return false;
+}
+
+inline bool compare_exchange(uint32_t* target, uint32_t& expected, uint32_t desired)
+{
+    const uint32_t previous = uint32_t(_InterlockedCompareExchange(reinterpret_cast<volatile long*>(target), long(desired), long(expected)));
+    if (previous == expected) return true;
+    expected = previous;
+    return false;
+}
+
+inline bool compare_exchange(uint64_t* target, uint64_t& expected, uint64_t desired)
+{
+    const uint64_t previous = uint64_t(_InterlockedCompareExchange64(reinterpret_cast<volatile long long*>(target), (long long)desired, (long long)expected));
+    if (previous == expected) return true;
+    expected = previous;
+    return false;
+}
+
+template<typename W> W atomic_load_word(const W* address) { return *reinterpret_cast<const volatile W*>(address); }
+#else
+template<typename W> bool compare_exchange(W* target, W& expected, W desired)
+{
+    return __atomic_compare_exchange_n(target, &expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+template<typename W> W atomic_load_word(const W* address) { return __atomic_load_n(address, __ATOMIC_RELAXED); }
+#endif
+
+template<size_t Size> struct atomic_word;
+template<> struct atomic_word<2> { using type = uint16_t; };
+template<> struct atomic_word<4> { using type = uint32_t; };
+template<> struct atomic_word<8> { using type = uint64_t; };
+
+/**
+  * @short *address += value as one atomic operation.
+  *
+  * Integers use a fetch-and-add, other types (double, float, half, ...)
+  * a compare-and-swap loop on their bit pattern. Relaxed ordering: the
+  * result is complete once the adding threads have been joined.
+  */
+template<typename T> typename std::enable_if<std::is_integral<T>::value>::type atomic_add(T* address, T value)
+{
+#if defined(_MSC_VER)
+    using word = typename atomic_word<sizeof(T)>::type;
+    word* target = reinterpret_cast<word*>(address);
+    word expected = atomic_load_word(target);
+    while (!compare_exchange(target, expected, word(expected + word(value)))) { }
+#else
+    __atomic_fetch_add(address, value, __ATOMIC_RELAXED);
+#endif
+}
+
+template<typename T> typename std::enable_if<!std::is_integral<T>::value>::type atomic_add(T* address, T value)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Atomic addition needs trivially copyable elements.");
+    using word = typename atomic_word<sizeof(T)>::type;
+    using compute_type = typename storage_traits<T>::compute_type;
+    word* target = reinterpret_cast<word*>(address);
+    word expected = atomic_load_word(target);
+    while (true)
+    {
+        // Through void*: float16 and bfloat16 are trivially copyable, but not trivial (zero by default)
+        T current;
+        std::memcpy(static_cast<void*>(&current), &expected, sizeof(T));
+        const T updated = T(compute_type(current) + compute_type(value));
+        word desired;
+        std::memcpy(&desired, static_cast<const void*>(&updated), sizeof(T));
+        if (compare_exchange(target, expected, desired))
+        {
+            return;
+        }
+    }
+}
+
+/**
+  * Bounds checking of element access (At, make_index, Take, Put, ...).
+  *
+  * Enabled by default unless NDEBUG is defined (i.e. in debug builds),
+  * can be set explicitly by defining G4MULTIARRAY_CHECK_BOUNDS to 0 or 1.
+  */
+#ifndef G4MULTIARRAY_CHECK_BOUNDS
+    #ifdef NDEBUG
+        #define G4MULTIARRAY_CHECK_BOUNDS 0
+    #else
+        #define G4MULTIARRAY_CHECK_BOUNDS 1
+    #endif
+#endif
+
+constexpr bool bounds_checking = (G4MULTIARRAY_CHECK_BOUNDS != 0);
+
+/** Compile-time unrolled computations over the N components of an index. **/
+template<size_t I, size_t N> struct index_unroller
+{
+    static size_t offset(const std::array<size_t, N>& strides, const std::array<size_t, N>& index)
+    {
+        return strides[I] * index[I] + index_unroller<I + 1, N>::offset(strides, index);
+    }
+
+    // Evaluated without short-circuit, so that there is only one branch
+    static bool in_bounds(const std::array<size_t, N>& shape, const std::array<size_t, N>& index)
+    {
+        return (index[I] < shape[I]) & index_unroller<I + 1, N>::in_bounds(shape, index);
+    }
+};
+
+template<size_t N> struct index_unroller<N, N>
+{
+    static size_t offset(const std::array<size_t, N>&, const std::array<size_t, N>&) { return 0; }
+
+    static bool in_bounds(const std::array<size_t, N>&, const std::array<size_t, N>&) { return true; }
+};
+
+template<size_t N> class index_impl
+{
+public:
+    using index_type = std::array<size_t, N>;
+
+    index_impl(const index_type& shape)
+        : fShape(shape), fStrides(get_strides(shape)), fSize(get_product(shape))
+    { }
+
+    index_impl(const index_type& shape, const index_type& strides, size_t offset)
+        : fShape(shape), fStrides(strides), fSize(get_product(shape)), fOffset(offset)
+    { }
+
+    size_t Size() const { return fSize; }
+
+    const index_type& Shape() const { return fShape; }
+
+    /** Distances between neighbouring elements along each axis. **/
+    const index_type& Strides() const { return fStrides; }
+
+    /** Position of the first element in the underlying data. **/
+    size_t Offset() const { return fOffset; }
+
+    /** Whether elements are stored consecutively in C order. **/
+    bool IsContiguous() const { return fStrides == get_strides(fShape); }
+
+protected:
+    /** Position in data of the element with a flat (C-order) index. **/
+    size_t flat_offset(size_t i) const
+    {
+        size_t index = fOffset;
+        for (size_t j = N; j-- > 0;)
+        {
+            index += fStrides[j] * (i % fShape[j]);
+            i /= fShape[j];
+        }
+        return index;
+    }
+
+    /** Position in data of an element (checked according to bounds_checking). **/
+    template<bool check_index = bounds_checking> size_t make_index(const index_type& arr) const
+    {
+        if (check_index && !index_unroller<0, N>::in_bounds(fShape, arr))
+        {
+            throw std::runtime_error("Index overflow.");
+        }
+        return fOffset + index_unroller<0, N>::offset(fStrides, arr);
+    }
+
+    index_type fShape;
+
+    index_type fStrides;
+
+    size_t fSize;
+
+    size_t fOffset{ 0 };
+};
+
+template<typename T, size_t N> class array_owner_impl : public index_impl<N>
+{
+public:
+    // Type aliases
+    using data_type = std::valarray<T>;
+    using base_type = index_impl<N>;
+    using typename base_type::index_type;
+
+    array_owner_impl(const data_type& data, const index_type& shape)
+        : base_type(shape), fData(data)
+    { }
+
+    array_owner_impl(const data_type&& data, const index_type& shape)
+        : base_type(shape), fData(data)
+    { }
+
+    constexpr static bool read_write_access = true;
+
+    const std::valarray<T>& Data() const { return fData; }
+
+protected:
+    std::valarray<T>& get_data_array() { return fData; }
+
+    const T* data_pointer() const { return fData.size() ? &fData[0] : nullptr; }
+
+    T* data_pointer() { return fData.size() ? &fData[0] : nullptr; }
+
+    void set_data(const std::valarray<T>& other)
+    {
+        fData = other;
+    }
+
+    void set_data(const T& other)
+    {
+        fData = other;
+    }
+
+    data_type fData;
+};
+
+template<typename T, size_t N, bool is_const> class t_array_view_impl : public index_impl<N>
+{
+public:
+    constexpr static bool read_write_access = is_const;
+
+    // Type aliases
+    using data_type = typename std::conditional<is_const, const T*, T*>::type;  // Start of the viewed data
+    using base_type = index_impl<N>;
+    using typename base_type::index_type;
+
+    // Import base members
+    using index_impl<N>::fStrides;
+    using index_impl<N>::fShape;
+    using index_impl<N>::fSize;
+    using index_impl<N>::fOffset;
+
+    t_array_view_impl(data_type data, const index_type& shape, const index_type& strides, size_t offset)
+        : base_type(shape, strides, offset), fData(data)
+    {  }
+
+    std::valarray<T> Data() const
+    {
+        std::valarray<T> result(fSize);
+        if (fSize)
+        {
+            copy_to_contiguous(fData + fOffset, fShape, fStrides, &result[0]);
+        }
+        return result;
+    }
+
+protected:
+    data_type fData;
+
+    data_type data_pointer() const { return fData; }
+
+    void set_data(const std::valarray<T>& other)
+    {
+        if (fSize)
+        {
+            T* target = fData;
+            const T* source = &other[0];
+            make_nditer(fShape, fStrides, fOffset, get_strides(fShape), 0).ForEach(
+                [source, target](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                    copy_strided(source + offsets[1], strides[1], target + offsets[0], strides[0], count);
+                });
+        }
+    }
+
+    void set_data(const T& other)
+    {
+        T* target = fData;
+        nditer<N, 1>(fShape, {{ fStrides }}, {{ fOffset }}).ForEach(
+            [target, &other](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                fill_strided(target + offsets[0], strides[0], count, other);
+            });
+    }
+};
+
+template<typename T, size_t N> using array_view_impl = t_array_view_impl<T, N, false>;
+
+template<typename T, size_t N> using array_const_view_impl = t_array_view_impl<T, N, true>;
+
+template<typename T, size_t N> class array_accessor_impl
+{
+public:
+    using const_item_type = multi_array_view_const<T, N-1>;
+    using item_type = multi_array_view<T, N-1>;
+
+    template<template<typename, size_t> class data_policy> static const_item_type get_const_item(const multi_array_base<T, N, data_policy>& array, size_t i)
+    {
+        return const_item_type(array, i);
+    }
+
+    template<template<typename, size_t> class data_policy> static item_type get_item(multi_array_base<T, N, data_policy>& array, size_t i)
+    {
+        return item_type(array, i);
+    }
+};
+
+template<typename T> class array_accessor_impl<T, 1>
+{
+public:
+    using const_item_type = const T&;
+    using item_type = T&;
+
+    template<template<typename, size_t> class data_policy> static const_item_type get_const_item(const multi_array_base<T, 1, data_policy>& array, size_t i)
+    {
+        return array.At(std::array<size_t, 1>{i});
+    }
+
+    template<template<typename, size_t> class data_policy> static item_type get_item(multi_array_base<T, 1, data_policy>& array, size_t i)
+    {
+        return array.At(std::array<size_t, 1>{i});
+    }
+};
+
+/**
+  * @short multi_array-like object
+  *
+  * Can be either an array itself, or any of its views.
+  */
+template<typename T, size_t N, template<typename, size_t> class data_policy> class multi_array_base
+    : public data_policy<T, N>
+{
+public:
+    // Type aliases
+    constexpr static size_t Dim = N;
+    using base_type = data_policy<T, N>;
+    using typename base_type::index_type;
+    using const_item_type = typename std::conditional<N == 1, const T&, multi_array_view_const<T, N-1>>::type;
+    using item_type = typename std::conditional<N == 1, T&, multi_array_view<T, N-1>>::type;
+    using accessor_type = array_accessor_impl<T, N>;
+    using compute_type = typename storage_traits<T>::compute_type;
+    using view_type = typename std::conditional<std::is_same<base_type, array_const_view_impl<T, N>>::value,
+        multi_array_view_const<T, N>, multi_array_view<T, N>>::type;     // Read-only for read-only views
+
+    // Friends
+    template<typename, size_t> friend class array_accessor_impl;
+    template<typename, size_t, template<typename, size_t> class> friend class multi_array_base;
+    template<typename, size_t> friend class multi_array;
+    template<typename, size_t> friend class multi_array_view;
+    template<typename, size_t> friend class multi_array_view_const;
+    template<typename, size_t> friend class multi_array_masked_view;
+    // template<typename, size_t> friend std::ostream& operator << (std::ostream&, const multi_array_base&);
+
+    // Import members
+    using base_type::Data;
+    using index_impl<N>::IsContiguous;
+
+protected:
+    // Import members
+    using index_impl<N>::fStrides;
+    using index_impl<N>::fShape;
+    using index_impl<N>::fSize;
+    using index_impl<N>::fOffset;
+    using base_type::fData;
+
+    using index_impl<N>::make_index;
+    using index_impl<N>::flat_offset;
+    // using base_type::get_data_array;
+    using base_type::set_data;
+    using base_type::data_pointer;
+
+    using base_type::base_type;
+
+    multi_array_base& operator=(const T& value)
+    {
+        set_data(value);
+        return *this;
+    }
+
+    /* multi_array_base& operator=(const multi_array_base&) = delete;
+    multi_array_base& operator=(const multi_array_base&&) = delete;*/
+
+    template<template <typename, size_t> class data_policy2> multi_array_base& operator=(const multi_array_base<T, N, data_policy2>& other)
+    {
+        if (other.fShape != fShape)
+        {
+            throw std::runtime_error("Cannot assign data of different shapes.");
+        }
+        set_data(other.Data());
+        return *this;
+    }
+
+    /** Call f(data, stride, count) for runs of elements (in C order). **/
+    template<typename F> void for_each_run(F f) const
+    {
+        const T* data = DataPointer();
+        nditer<N, 1>(fShape, {{ fStrides }}, {{ 0 }}).ForEach(
+            [data, &f](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                f(data + offsets[0], strides[0], count);
+            });
+    }
+
+    template<typename F> void for_each_run(F f)
+    {
+        T* data = DataPointer();
+        nditer<N, 1>(fShape, {{ fStrides }}, {{ 0 }}).ForEach(
+            [data, &f](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                f(data + offsets[0], strides[0], count);
+            });
+    }
+
+    /** Call f(data, stride, otherData, otherStride, count) for runs of corresponding elements. **/
+    template<typename U, template<typename, size_t> class data_policy2, typename F>
+        void for_each_run_with(const multi_array_base<U, N, data_policy2>& other, F f) const
+    {
+        const T* data = DataPointer();
+        const U* otherData = other.DataPointer();
+        make_nditer(fShape, fStrides, 0, other.fStrides, 0).ForEach(
+            [data, otherData, &f](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                f(data + offsets[0], strides[0], otherData + offsets[1], strides[1], count);
+            });
+    }
+
+    template<typename U, template<typename, size_t> class data_policy2, typename F>
+        void for_each_run_with(const multi_array_base<U, N, data_policy2>& other, F f)
+    {
+        T* data = DataPointer();
+        const U* otherData = other.DataPointer();
+        make_nditer(fShape, fStrides, 0, other.fStrides, 0).ForEach(
+            [data, otherData, &f](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                f(data + offsets[0], strides[0], otherData + offsets[1], strides[1], count);
+            });
+    }
+
+    /** Whether other views the same data differently (in-place operations then need a copy). **/
+    template<typename U, template<typename, size_t> class data_policy2> bool overlaps(const multi_array_base<U, N, data_policy2>& other) const
+    {
+        return (static_cast<const void*>(data_pointer()) == static_cast<const void*>(other.data_pointer()))
+            && ((fOffset != other.fOffset) || (fStrides != other.fStrides));
+    }
+
+    /** Apply f(compute_type&) to all elements in place. **/
+    template<typename F> void transform(F f)
+    {
+        for_each_run([&f](T* data, std::ptrdiff_t stride, size_t count) {
+            transform_strided(data, stride, count, f);
+        });
+    }
+
+    /** Apply f(compute_type&, const compute_type&) to pairs of corresponding elements in place. **/
+    template<template<typename, size_t> class data_policy2, typename F> void transform_with(const multi_array_base<T, N, data_policy2>& other, F f)
+    {
+        if (overlaps(other))
+        {
+            transform_with(other.Copy(), f);
+            return;
+        }
+        for_each_run_with(other, [&f](T* data, std::ptrdiff_t stride, const T* otherData, std::ptrdiff_t otherStride, size_t count) {
+            transform_strided(data, stride, otherData, otherStride, count, f);
+        });
+    }
+
+public:
+    /** Pointer to the first element (others are at multiples of Strides()). **/
+    const T* DataPointer() const { return data_pointer() + fOffset; }
+
+    auto DataPointer() -> decltype(this->data_pointer()) { return data_pointer() + fOffset; }
+
+    template<size_t I, class... Ts>
+        typename std::enable_if<
+            (slicer<sizeof...(Ts)>::new_dim(N) != 0),
+            multi_array_view<T, slicer<sizeof...(Ts)>::new_dim(N)>
+        >::type
+    slice(Ts... slicerArguments)
+    {
+        static_assert(I < N, "TODO: write something intelligent.");
+        slicer<sizeof...(Ts)> theSlicer = make_slicer(slicerArguments...);
+        auto triple = theSlicer.apply(fOffset, fShape, fStrides, I);
+        return multi_array_view<T, slicer<sizeof...(Ts)>::new_dim(N)>(*this, std::get<1>(triple), std::get<2>(triple), std::get<0>(triple));
+    }
+
+    template<size_t I, class... Ts>
+        typename std::enable_if<
+            (slicer<sizeof...(Ts)>::new_dim(N) == 0),
+            const T&
+        >::type
+    slice(Ts... slicerArguments)
+    {
+        static_assert(I < N, "TODO: write something intelligent.");
+        std::array<int, 1> ind = {{ int(slicerArguments)... }};
+        return (*this)[slicer<1>::index(ind[0], fShape[0])];
+    }
+
+    template<size_t I, size_t M>
+        typename std::enable_if<
+            (slicer<M>::new_dim(N) != 0),
+            multi_array_view<T, slicer<M>::new_dim(N)>
+        >::type
+    slice(const slicer<M>& theSlicer)
+    {
+        auto triple = theSlicer.apply(fOffset, fShape, fStrides, I);
+        return multi_array_view<T, slicer<M>::new_dim(N)>(*this, std::get<1>(triple), std::get<2>(triple), std::get<0>(triple));
+    }
+
+    template<size_t I, size_t M>
+        typename std::enable_if<
+            (slicer<M>::new_dim(N) == 0),
+            const T&
+        >::type
+    slice(const slicer<M>& theSlicer)
+    {
+        return (*this)[slicer<1>::index(theSlicer.fNumbers[0], fShape[0])];
+    }
+
+    template<size_t I> multi_array_view<T, N> slice(const slice_helper&)
+    {
+        return multi_array_view<T, N>(*this, fShape, fStrides, fOffset);
+    }
+
+    template<size_t I> multi_array_view<T, N> slice(const ellipsis_type&)
+    {
+        return multi_array_view<T, N>(*this, fShape, fStrides, fOffset);
+    }
+
+    /** View with a new axis of length 1 before axis I. **/
+    template<size_t I> multi_array_view<T, N + 1> slice(const newaxis_type&)
+    {
+        static_assert(I <= N, "Axis out of range.");
+        std::array<size_t, N + 1> shape;
+        std::array<size_t, N + 1> strides;
+        for (size_t i = 0, j = 0; i <= N; i++)
+        {
+            if (i == I)
+            {
+                shape[i] = 1;
+                strides[i] = 0;
+            }
+            else
+            {
+                shape[i] = fShape[j];
+                strides[i] = fStrides[j++];
+            }
+        }
+        return multi_array_view<T, N + 1>(*this, shape, strides, fOffset);
+    }
+
+protected:
+    template<int I, typename T1> auto _apply_indices(const T1& t)
+        -> decltype(slice<I>(t))
+    {
+        return slice<I>(t);
+    }
+
+    template<int I, typename T1, typename... Ts> auto _apply_indices(const T1& t, Ts... indices)
+        -> decltype(slice<I>(t).template _apply_indices<I, Ts...>(indices...))
+    {
+        // Position of the next index in the resulting array
+        // (an ellipsis covers all the axes not consumed by other indices)
+        constexpr int M = decltype(slice<I>(t))::Dim;
+        constexpr int J = std::is_same<T1, ellipsis_type>::value
+            ? (M - consumed_axes<Ts...>::value)
+            : (I + consumed_axes<T1>::value + M - N);
+        return slice<I>(t).template _apply_indices<J, Ts...>(indices...);
+    }
+
+public:
+    template<typename... Ts> auto operator()(Ts... indices)
+        -> decltype(_apply_indices<0, Ts...>(indices...))
+    {
+        return _apply_indices<0, Ts...>(indices...); // Works for 1!
+    }
+
+    // template<size_t I, class... Ts> const T&
+
+    /* template<class... Ts> multi_array_view<T, slicer_result<T, N, Ts...>::type apply_indices(Ts... indices)
+    {
+
+    }*/
+
+    // Arithmetic with a scalar or (broadcast) array
+    multi_array<T, N> operator*(const T& other) const
+    {
+        multi_array<T, N> result = Copy();
+        result *= other;
+        return result;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> multi_array<T, (N > M) ? N : M> operator*(const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return combine<T>(other, [](const T& x, const T& y) -> T { compute_type r = x; r *= compute_type(y); return T(r); });
+    }
+
+    multi_array<T, N> operator/(const T& other) const
+    {
+        multi_array<T, N> result = Copy();
+        result /= other;
+        return result;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> multi_array<T, (N > M) ? N : M> operator/(const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return combine<T>(other, [](const T& x, const T& y) -> T { compute_type r = x; r /= compute_type(y); return T(r); });
+    }
+
+    multi_array<T, N> operator+(const T& other) const
+    {
+        multi_array<T, N> result = Copy();
+        result += other;
+        return result;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> multi_array<T, (N > M) ? N : M> operator+(const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return combine<T>(other, [](const T& x, const T& y) -> T { compute_type r = x; r += compute_type(y); return T(r); });
+    }
+
+    multi_array<T, N> operator-(const T& other) const
+    {
+        multi_array<T, N> result = Copy();
+        result -= other;
+        return result;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> multi_array<T, (N > M) ? N : M> operator-(const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return combine<T>(other, [](const T& x, const T& y) -> T { compute_type r = x; r -= compute_type(y); return T(r); });
+    }
+
+    // Comparisons (element-wise, results packed in bit_array)
+    bit_array<N> operator< (const T& value) const { return Test([&value](const T& x) { return x < value; }); }
+
+    bit_array<N> operator<= (const T& value) const { return Test([&value](const T& x) { return x <= value; }); }
+
+    bit_array<N> operator> (const T& value) const { return Test([&value](const T& x) { return x > value; }); }
+
+    bit_array<N> operator>= (const T& value) const { return Test([&value](const T& x) { return x >= value; }); }
+
+    bit_array<N> operator== (const T& value) const { return Test([&value](const T& x) { return x == value; }); }
+
+    bit_array<N> operator!= (const T& value) const { return Test([&value](const T& x) { return x != value; }); }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator< (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::less<T>());
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator<= (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::less_equal<T>());
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator> (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::greater<T>());
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator>= (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::greater_equal<T>());
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator== (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::equal_to<T>());
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy2> bit_array<(N > M) ? N : M> operator!= (const multi_array_base<T, M, data_policy2>& other) const
+    {
+        return compare(other, std::not_equal_to<T>());
+    }
+
+private:
+    template<size_t M, template <typename, size_t> class data_policy2, typename F> bit_array<(N > M) ? N : M> compare(const multi_array_base<T, M, data_policy2>& other, F f) const
+    {
+        constexpr size_t R = (N > M) ? N : M;
+        std::array<size_t, R> shape = broadcast_shape(fShape, other.fShape);
+        bit_array<R> result(shape);
+        uint64_t* words = result.word_pointer();
+        size_t position = 0;
+        const T* data = DataPointer();
+        const T* otherData = other.DataPointer();
+        make_nditer(shape, broadcast_strides(fShape, fStrides, shape), 0, broadcast_strides(other.fShape, other.fStrides, shape), 0).ForEach(
+            [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                const T* x = data + offsets[0];
+                const T* y = otherData + offsets[1];
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++, position++)
+                {
+                    words[position / 64] |= uint64_t(f(x[i * strides[0]], y[i * strides[1]]) ? 1 : 0) << (position % 64);
+                }
+            });
+        return result;
+    }
+
+    /** New array with f(x, y) of corresponding elements of this and other array, broadcast to a common shape. **/
+    template<typename U, size_t M, template<typename, size_t> class data_policy2, typename F>
+        multi_array<U, (N > M) ? N : M> combine(const multi_array_base<T, M, data_policy2>& other, F f) const
+    {
+        constexpr size_t R = (N > M) ? N : M;
+        std::array<size_t, R> shape = broadcast_shape(fShape, other.fShape);
+        std::array<size_t, R> strides = get_strides(shape);
+        std::valarray<U> result(get_product(shape));
+        if (result.size())
+        {
+            const T* data = DataPointer();
+            const T* otherData = other.DataPointer();
+            U* target = &result[0];
+            nditer<R, 3>(shape, {{ broadcast_strides(fShape, fStrides, shape), broadcast_strides(other.fShape, other.fStrides, shape), strides }}, {{ 0, 0, 0 }}).ForEach(
+                [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* runStrides) {
+                    combine_strided(data + offsets[0], runStrides[0], otherData + offsets[1], runStrides[1], target + offsets[2], count, f);
+                });
+        }
+        return multi_array<U, R>(shape, std::move(result));
+    }
+
+public:
+    // Elements of read-only views stay read-only
+    auto At(const index_type& i) -> decltype(*this->data_pointer()) { return fData[make_index(i)]; }
+
+    const T& At(const index_type& i) const { return fData[make_index(i)]; }
+
+    /** Element access without bounds checking (whatever G4MULTIARRAY_CHECK_BOUNDS). **/
+    auto AtUnchecked(const index_type& i) -> decltype(*this->data_pointer()) { return fData[this->template make_index<false>(i)]; }
+
+    const T& AtUnchecked(const index_type& i) const { return fData[this->template make_index<false>(i)]; }
+
+    const_item_type operator[] (size_t i) const { return accessor_type::get_const_item(*this, i); }
+
+    item_type operator[] (size_t i) { return accessor_type::get_item(*this, i); }
+
+    // Masked indexing (assignable in place / compacted copy for const arrays)
+    multi_array_masked_view<T, N> operator[] (const bit_array<N>& mask)
+    {
+        return multi_array_masked_view<T, N>(multi_array_view<T, N>(*this, fShape, fStrides, fOffset), mask);
+    }
+
+    multi_array<T, 1> operator[] (const bit_array<N>& mask) const { return Select(mask); }
+
+    template<typename F> typename std::enable_if<is_predicate<F, T>::value, multi_array_masked_view<T, N>>::type
+        operator[] (F predicate)
+    {
+        return (*this)[Test(predicate)];
+    }
+
+    template<typename F> typename std::enable_if<is_predicate<F, T>::value, multi_array<T, 1>>::type
+        operator[] (F predicate) const
+    {
+        return Select(Test(predicate));
+    }
+
+    multi_array_masked_view<T, N> operator() (const bit_array<N>& mask) { return (*this)[mask]; }
+
+    multi_array<T, 1> operator() (const bit_array<N>& mask) const { return Select(mask); }
+
+    template<typename F> typename std::enable_if<is_predicate<F, T>::value, multi_array_masked_view<T, N>>::type
+        operator() (F predicate)
+    {
+        return (*this)[Test(predicate)];
+    }
+
+    template<typename F> typename std::enable_if<is_predicate<F, T>::value, multi_array<T, 1>>::type
+        operator() (F predicate) const
+    {
+        return Select(Test(predicate));
+    }
+
+    // Integer-array indexing
+
+    /** Elements at flat (C-order) positions. **/
+    template<template<typename, size_t> class data_policy2> multi_array<T, 1> Take(const multi_array_base<size_t, 1, data_policy2>& indices) const
+    {
+        const auto& index = indices.Data();
+        check_indices(index, fSize);
+        std::valarray<T> result(index.size());
+        if (index.size())
+        {
+            if (IsContiguous())
+            {
+                gather_elements(data_pointer() + fOffset, &index[0], index.size(), &result[0]);
+            }
+            else
+            {
+                std::valarray<size_t> offsets = flat_offsets(index);
+                gather_elements(data_pointer(), &offsets[0], index.size(), &result[0]);
+            }
+        }
+        return multi_array<T, 1>({index.size()}, std::move(result));
+    }
+
+    /** Sub-arrays at given positions along the I-th axis. **/
+    template<size_t I, template<typename, size_t> class data_policy2> multi_array<T, N> Take(const multi_array_base<size_t, 1, data_policy2>& indices) const
+    {
+        static_assert(I < N, "Axis out of range.");
+        if (!IsContiguous())
+        {
+            return Copy().template Take<I>(indices);
+        }
+        const auto& index = indices.Data();
+        check_indices(index, fShape[I]);
+        index_type shape = fShape;
+        shape[I] = index.size();
+        multi_array<T, N> result(shape);
+        if (!result.Size())
+        {
+            return result;
+        }
+
+        size_t count = index.size();
+        size_t inner = fStrides[I];
+        size_t outer = result.Size() / (count * inner);
+        const T* source = data_pointer() + fOffset;
+        T* target = result.data_pointer();
+        for (size_t o = 0; o < outer; o++)
+        {
+            const T* sourceBlock = source + o * fShape[I] * inner;
+            T* targetBlock = target + o * count * inner;
+            if (inner == 1)
+            {
+                gather_elements(sourceBlock, &index[0], count, targetBlock);
+            }
+            else
+            {
+                for (size_t j = 0; j < count; j++)
+                {
+                    std::copy(sourceBlock + index[j] * inner, sourceBlock + (index[j] + 1) * inner, targetBlock + j * inner);
+                }
+            }
+        }
+        return result;
+    }
+
+    /** Set elements at flat (C-order) positions. **/
+    template<template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3>
+        void Put(const multi_array_base<size_t, 1, data_policy2>& indices, const multi_array_base<T, 1, data_policy3>& values)
+    {
+        scatter(indices, values, scatter_elements<T>);
+    }
+
+    template<template<typename, size_t> class data_policy2> void Put(const multi_array_base<size_t, 1, data_policy2>& indices, const T& value)
+    {
+        Put(indices, multi_array<T, 1>({indices.Size()}, value));
+    }
+
+    /** Add values to elements at flat (C-order) positions, accumulating repeated ones. **/
+    template<template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3>
+        void ScatterAdd(const multi_array_base<size_t, 1, data_policy2>& indices, const multi_array_base<T, 1, data_policy3>& values)
+    {
+        scatter(indices, values, scatter_add_elements<T>);
+    }
+
+private:
+    static void check_indices(const std::valarray<size_t>& indices, size_t size)
+    {
+        if (indices.size() && (indices.max() >= size))
+        {
+            throw std::runtime_error("Index overflow.");
+        }
+    }
+
+    std::valarray<size_t> flat_offsets(const std::valarray<size_t>& indices) const
+    {
+        std::valarray<size_t> offsets(indices.size());
+        for (size_t i = 0; i < indices.size(); i++)
+        {
+            offsets[i] = flat_offset(indices[i]);
+        }
+        return offsets;
+    }
+
+    template<template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3, typename F>
+        void scatter(const multi_array_base<size_t, 1, data_policy2>& indices, const multi_array_base<T, 1, data_policy3>& values, F kernel)
+    {
+        if (indices.Size() != values.Size())
+        {
+            throw std::runtime_error("Number of indices and values differ.");
+        }
+        const auto& index = indices.Data();
+        const auto& data = values.Data();
+        check_indices(index, fSize);
+        if (!index.size())
+        {
+            return;
+        }
+        if (IsContiguous())
+        {
+            kernel(data_pointer() + fOffset, &index[0], index.size(), &data[0]);
+        }
+        else
+        {
+            std::valarray<size_t> offsets = flat_offsets(index);
+            kernel(data_pointer(), &offsets[0], index.size(), &data[0]);
+        }
+    }
+
+public:
+    /** Compacted copy of the elements selected by a mask (in C order). **/
+    multi_array<T, 1> Select(const bit_array<N>& mask) const
+    {
+        if (fShape != mask.Shape())
+        {
+            throw std::runtime_error("Incompatible shapes of array and mask.");
+        }
+        size_t count = mask.CountNonzero();
+        std::valarray<T> result(count);
+        if (count && IsContiguous())
+        {
+            compress_store(DataPointer(), &mask.Words()[0], fSize, &result[0]);
+        }
+        else if (count)
+        {
+            T* target = &result[0];
+            size_t position = 0;
+            for_each_run([&](const T* data, std::ptrdiff_t stride, size_t runSize) {
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(runSize); i++, position++)
+                {
+                    if (mask.GetFlat(position))
+                    {
+                        *(target++) = data[i * stride];
+                    }
+                }
+            });
+        }
+        return multi_array<T, 1>({count}, std::move(result));
+    }
+
+    multi_array<T, N> Copy() const { return multi_array<T, N>(*this); }
+
+    template<size_t M> multi_array<T, M> Resize(const std::array<size_t, M>& newShape) const
+    {
+        if (!get_product(fShape) == get_product(newShape))
+        {
+            throw std::runtime_error("Total size of the new array must equal to the old one.");
+        }
+        auto copy = Copy();
+        return multi_array<T, M>(newShape, copy.Data());
+    }
+
+    template<class... Ts> multi_array<T, sizeof...(Ts)> Resize(Ts... dims) const
+    {
+        std::array<size_t, sizeof...(Ts)> newShape {dims...};
+        if (!get_product(fShape) == get_product(newShape))
+        {
+            throw std::runtime_error("Total size of the new array must equal to the old one.");
+        }
+        auto copy = Copy();
+        return multi_array<T, sizeof...(Ts)>(newShape, copy.Data());
+    }
+
+    // Conversion
+    template<typename U> multi_array<U, N> As() const
+    {
+        std::valarray<U> result(fSize);
+        if (fSize)
+        {
+            U* target = &result[0];
+            for_each_run([&target](const T* data, std::ptrdiff_t stride, size_t count) {
+                convert_strided(data, stride, target, count);
+                target += count;
+            });
+        }
+        return multi_array<U, N>(fShape, std::move(result));
+    }
+
+    /**
+      * @short View with the order of axes reversed (no data copied).
+      */
+    view_type transpose()
+    {
+        index_type axes;
+        for (size_t i = 0; i < N; i++)
+        {
+            axes[i] = N - 1 - i;
+        }
+        return permute(axes);
+    }
+
+    multi_array_view_const<T, N> transpose() const
+    {
+        index_type axes;
+        for (size_t i = 0; i < N; i++)
+        {
+            axes[i] = N - 1 - i;
+        }
+        return permute(axes);
+    }
+
+    /**
+      * @short View with axes I and J interchanged (no data copied).
+      */
+    template<size_t I, size_t J> view_type swapaxes()
+    {
+        static_assert((I < N) && (J < N), "Axis out of range.");
+        index_type axes = swapped_axes(I, J);
+        return permute(axes);
+    }
+
+    template<size_t I, size_t J> multi_array_view_const<T, N> swapaxes() const
+    {
+        static_assert((I < N) && (J < N), "Axis out of range.");
+        index_type axes = swapped_axes(I, J);
+        return permute(axes);
+    }
+
+    /**
+      * @short View with permuted axes (no data copied).
+      *
+      * Axis i of the result is axis axes[i] of this array,
+      * e.g. permute(2, 1, 0) turns a (z, y, x) grid into (x, y, z).
+      */
+    view_type permute(const index_type& axes)
+    {
+        index_type shape, strides;
+        permuted(axes, shape, strides);
+        return view_type(*this, shape, strides, fOffset);
+    }
+
+    multi_array_view_const<T, N> permute(const index_type& axes) const
+    {
+        index_type shape, strides;
+        permuted(axes, shape, strides);
+        return multi_array_view_const<T, N>(*this, shape, strides, fOffset);
+    }
+
+    template<typename... Ts> view_type permute(Ts... axes)
+    {
+        static_assert(sizeof...(Ts) == N, "Permutation must list all axes.");
+        return permute(index_type{{ size_t(axes)... }});
+    }
+
+    template<typename... Ts> multi_array_view_const<T, N> permute(Ts... axes) const
+    {
+        static_assert(sizeof...(Ts) == N, "Permutation must list all axes.");
+        return permute(index_type{{ size_t(axes)... }});
+    }
+
+private:
+    static index_type swapped_axes(size_t i, size_t j)
+    {
+        index_type axes;
+        for (size_t k = 0; k < N; k++)
+        {
+            axes[k] = k;
+        }
+        std::swap(axes[i], axes[j]);
+        return axes;
+    }
+
+    void permuted(const index_type& axes, index_type& shape, index_type& strides) const
+    {
+        std::array<bool, N> used{};
+        for (size_t i = 0; i < N; i++)
+        {
+            if ((axes[i] >= N) || used[axes[i]])
+            {
+                throw std::runtime_error("Invalid permutation of axes.");
+            }
+            used[axes[i]] = true;
+            shape[i] = fShape[axes[i]];
+            strides[i] = fStrides[axes[i]];
+        }
+    }
+
+public:
+    /**
+      * @short Read-only view of all windows of shape (K...) (no data copied).
+      *
+      * The view has 2N axes: the position of the window (Shape() - K + 1 along
+      * each axis) followed by the position within the window. Windows overlap,
+      * e.g. a 3x3x3 box sum is sliding_window_view<3, 3, 3>().Sum<3, 4, 5>().
+      */
+    template<size_t... K> multi_array_view_const<T, 2 * N> sliding_window_view() const
+    {
+        static_assert(sizeof...(K) == N, "Window must have one extent per axis.");
+        index_type window {{ K... }};
+        std::array<size_t, 2 * N> shape;
+        std::array<size_t, 2 * N> strides;
+        for (size_t i = 0; i < N; i++)
+        {
+            if ((window[i] == 0) || (window[i] > fShape[i]))
+            {
+                throw std::runtime_error("Window does not fit in the array.");
+            }
+            shape[i] = fShape[i] - window[i] + 1;
+            shape[N + i] = window[i];
+            strides[i] = fStrides[i];
+            strides[N + i] = fStrides[i];
+        }
+        return multi_array_view_const<T, 2 * N>(*this, shape, strides, fOffset);
+    }
+
+    multi_array_view_const<T, N> ReadOnly() const
+    {
+        return multi_array_view_const<T, N>(*this);
+    }
+
+    multi_array<T, N> Apply(std::function<T(T)> f) const
+    {
+        return map<T>(f);
+    }
+
+    template<typename U> multi_array<U, N> Apply(std::function<U(const T&)> f) const
+    {
+        return map<U>(f);
+    }
+
+    /** Element-wise f(x, y) of this and other array (broadcast to a common shape). **/
+    template<size_t M, template<typename, size_t> class data_policy2, typename F> auto Apply(const multi_array_base<T, M, data_policy2>& other, F f) const
+        -> multi_array<decltype(f(std::declval<T>(), std::declval<T>())), (N > M) ? N : M>
+    {
+        return combine<decltype(f(std::declval<T>(), std::declval<T>()))>(other, f);
+    }
+
+    /**
+      * @short Read-only view repeating this array to a larger shape (no data copied).
+      *
+      * Follows numpy broadcasting rules: missing leading axes and axes of length 1
+      * are repeated using zero strides.
+      */
+    template<size_t M> multi_array_view_const<T, M> broadcast_to(const std::array<size_t, M>& shape) const
+    {
+        return multi_array_view_const<T, M>(*this, shape, broadcast_strides(fShape, fStrides, shape), fOffset);
+    }
+
+    /** Evaluate a predicate for all elements, packing the results into bits. **/
+    template<typename F> bit_array<N> Test(F predicate) const
+    {
+        bit_array<N> result(fShape);
+        uint64_t* words = result.word_pointer();
+        size_t position = 0;
+        for_each_run([&](const T* data, std::ptrdiff_t stride, size_t count) {
+            for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++, position++)
+            {
+                words[position / 64] |= uint64_t(predicate(data[i * stride]) ? 1 : 0) << (position % 64);
+            }
+        });
+        return result;
+    }
+
+private:
+    template<typename U, typename F> multi_array<U, N> map(F f) const
+    {
+        std::valarray<U> result(fSize);
+        if (fSize)
+        {
+            U* target = &result[0];
+            for_each_run([&](const T* data, std::ptrdiff_t stride, size_t count) {
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++)
+                {
+                    target[i] = f(data[i * stride]);
+                }
+                target += count;
+            });
+        }
+        return multi_array<U, N>(fShape, std::move(result));
+    }
+
+public:
+    // Reductions (accumulated in compute_type)
+    compute_type Sum() const
+    {
+        compute_type total = compute_type();
+        for_each_run([&total](const T* data, std::ptrdiff_t stride, size_t count) {
+            total += sum_strided(data, stride, count);
+        });
+        return total;
+    }
+
+    /** Sum of elements selected by a mask (of the same shape). **/
+    compute_type Sum(const bit_array<N>& mask) const
+    {
+        if (fShape != mask.Shape())
+        {
+            throw std::runtime_error("Incompatible shapes of array and mask.");
+        }
+        compute_type total = compute_type();
+        if (IsContiguous())
+        {
+            const T* data = DataPointer();
+            mask.for_each_set([&](size_t i) { total += compute_type(data[i]); });
+        }
+        else
+        {
+            size_t position = 0;
+            for_each_run([&](const T* data, std::ptrdiff_t stride, size_t count) {
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++, position++)
+                {
+                    if (mask.GetFlat(position))
+                    {
+                        total += compute_type(data[i * stride]);
+                    }
+                }
+            });
+        }
+        return total;
+    }
+
+    /** Sums along the given axes (the result keeps the other axes). **/
+    template<size_t... Axes> multi_array<T, N - sizeof...(Axes)> Sum() const
+    {
+        return reduce<Axes...>(compute_type(), [](compute_type& x, const compute_type& y) { x += y; });
+    }
+
+    /** Minima along the given axes (the result keeps the other axes). **/
+    template<size_t... Axes> multi_array<T, N - sizeof...(Axes)> Min() const
+    {
+        const compute_type init = std::numeric_limits<compute_type>::has_infinity
+            ? std::numeric_limits<compute_type>::infinity() : std::numeric_limits<compute_type>::max();
+        return reduce<Axes...>(init, [](compute_type& x, const compute_type& y) { if (y < x) x = y; });
+    }
+
+    /** Maxima along the given axes (the result keeps the other axes). **/
+    template<size_t... Axes> multi_array<T, N - sizeof...(Axes)> Max() const
+    {
+        const compute_type init = std::numeric_limits<compute_type>::has_infinity
+            ? -std::numeric_limits<compute_type>::infinity() : std::numeric_limits<compute_type>::lowest();
+        return reduce<Axes...>(init, [](compute_type& x, const compute_type& y) { if (y > x) x = y; });
+    }
+
+    // Scans (accumulated in compute_type)
+    /** Cumulative sums along axis I. **/
+    template<size_t I> multi_array<T, N> CumSum() const
+    {
+        return Scan<I>(scan_add());
+    }
+
+    /** Cumulative products along axis I. **/
+    template<size_t I> multi_array<T, N> CumProd() const
+    {
+        return Scan<I>(scan_multiply());
+    }
+
+    /** Inclusive scan along axis I with f(accumulator&, value) (see ScanInPlace). **/
+    template<size_t I, typename F> multi_array<T, N> Scan(F f) const
+    {
+        multi_array<T, N> result = Copy();
+        result.template ScanInPlace<I>(f);
+        return result;
+    }
+
+    /**
+      * @short Inclusive scan along axis I, replacing the elements.
+      *
+      * Lines along the axis are scanned in parallel threads; a single
+      * long line is split into chunks scanned in two passes, for which
+      * f must be associative. Along other than the last axis of a
+      * contiguous array, whole rows are scanned at once.
+      */
+    template<size_t I, typename F> void ScanInPlace(F f)
+    {
+        static_assert(I < N, "Invalid axis for scan.");
+        if (!fSize)
+        {
+            return;
+        }
+        T* data = DataPointer();
+        const size_t length = fShape[I];
+        const std::ptrdiff_t stride = std::ptrdiff_t(fStrides[I]);
+
+        const size_t threads = thread_count();
+        if ((fSize / length < threads) && (length >= scan_parallel_threshold))
+        {
+            for (std::ptrdiff_t start : axis_lines(I))
+            {
+                scan_chunked(data + start, stride, length, threads, f);
+            }
+            return;
+        }
+        if ((I + 1 < N) && IsContiguous() && std::is_same<T, typename storage_traits<T>::compute_type>::value)
+        {
+            scan_planes(data, fSize / (length * fStrides[I]), length, fStrides[I], f);
+            return;
+        }
+        const std::vector<std::ptrdiff_t> lines = axis_lines(I);
+        parallel_for(lines.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                scan_strided(data + lines[i], stride, length, f);
+            }
+        }, std::max<size_t>(1, scan_parallel_threshold / length));
+    }
+
+    // Sorting (radix sort of integers and floats, NaN last)
+    /** Copy sorted along axis I. **/
+    template<size_t I> multi_array<T, N> Sort() const
+    {
+        multi_array<T, N> result = Copy();
+        result.template SortInPlace<I>();
+        return result;
+    }
+
+    template<size_t I> void SortInPlace()
+    {
+        static_assert(I < N, "Invalid axis for sorting.");
+        T* data = DataPointer();
+        const std::vector<std::ptrdiff_t> lines = axis_lines(I);
+        const size_t length = fShape[I];
+        const std::ptrdiff_t stride = std::ptrdiff_t(fStrides[I]);
+        parallel_for(lines.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                sort_strided(data + lines[i], stride, length);
+            }
+        }, std::max<size_t>(1, sort_parallel_threshold / std::max<size_t>(1, length)));
+    }
+
+    /** Indices along axis I that sort the array (stable). **/
+    template<size_t I> multi_array<size_t, N> ArgSort() const
+    {
+        static_assert(I < N, "Invalid axis for sorting.");
+        multi_array<size_t, N> result(fShape);
+        const T* data = DataPointer();
+        size_t* output = result.DataPointer();
+        const std::vector<std::ptrdiff_t> lines = axis_lines(I);
+        const std::vector<std::ptrdiff_t> outputLines = result.axis_lines(I);
+        const size_t length = fShape[I];
+        const std::ptrdiff_t stride = std::ptrdiff_t(fStrides[I]);
+        const std::ptrdiff_t outputStride = std::ptrdiff_t(result.Strides()[I]);
+        parallel_for(lines.size(), [&](size_t begin, size_t end) {
+            std::vector<T> values(length);
+            std::vector<size_t> indices(length);
+            for (size_t i = begin; i < end; i++)
+            {
+                copy_strided(data + lines[i], stride, values.data(), 1, length);
+                sort_strided(values.data(), 1, length, indices.data());
+                copy_strided(indices.data(), 1, output + outputLines[i], outputStride, length);
+            }
+        }, std::max<size_t>(1, sort_parallel_threshold / std::max<size_t>(1, length)));
+        return result;
+    }
+
+    /**
+      * @short Copy partitioned along axis I around the element of rank kth.
+      *
+      * That element is where a sort would put it, smaller ones before it
+      * and larger ones after it (in no particular order).
+      */
+    template<size_t I> multi_array<T, N> Partition(size_t kth) const
+    {
+        static_assert(I < N, "Invalid axis for partitioning.");
+        if (kth >= fShape[I])
+        {
+            throw std::runtime_error("Index out of range.");
+        }
+        multi_array<T, N> result = Copy();
+        T* data = result.DataPointer();
+        const std::vector<std::ptrdiff_t> lines = result.axis_lines(I);
+        const size_t length = fShape[I];
+        const std::ptrdiff_t stride = std::ptrdiff_t(result.Strides()[I]);
+        parallel_for(lines.size(), [&](size_t begin, size_t end) {
+            std::vector<T> values(length);
+            for (size_t i = begin; i < end; i++)
+            {
+                copy_strided(data + lines[i], stride, values.data(), 1, length);
+                std::nth_element(values.begin(), values.begin() + kth, values.end(), sort_less<T>);
+                copy_strided(values.data(), 1, data + lines[i], stride, length);
+            }
+        }, std::max<size_t>(1, sort_parallel_threshold / length));
+        return result;
+    }
+
+    /** Quantile (q in [0, 1]) of all elements, interpolated linearly (by selection, no full sort). **/
+    double Quantile(double q) const
+    {
+        std::valarray<T> values = Data();
+        return quantile_of(fSize ? &values[0] : nullptr, fSize, q);
+    }
+
+    /** Quantiles along axis I. **/
+    template<size_t I> typename std::enable_if<(N > 1) && (I < N), multi_array<double, (N > 1) ? N - 1 : 1>>::type Quantile(double q) const
+    {
+        static_assert(I < N, "Invalid axis for quantiles.");
+        std::array<size_t, (N > 1) ? N - 1 : 1> shape;
+        for (size_t i = 0, j = 0; i < N; i++)
+        {
+            if (i != I)
+            {
+                shape[j++] = fShape[i];
+            }
+        }
+        multi_array<double, (N > 1) ? N - 1 : 1> result(shape);
+        const T* data = DataPointer();
+        double* output = result.DataPointer();
+        const size_t length = fShape[I];
+        check_quantile(length, q);      // Once, before the lines are dispatched to threads
+        const std::vector<std::ptrdiff_t> lines = axis_lines(I);
+        const std::ptrdiff_t stride = std::ptrdiff_t(fStrides[I]);
+        parallel_for(lines.size(), [&](size_t begin, size_t end) {
+            std::vector<T> values(length);
+            for (size_t i = begin; i < end; i++)
+            {
+                copy_strided(data + lines[i], stride, values.data(), 1, length);
+                output[i] = quantile_of(values.data(), length, q);
+            }
+        }, std::max<size_t>(1, sort_parallel_threshold / std::max<size_t>(1, length)));
+        return result;
+    }
+
+    /** Percentile (p in [0, 100]) of all elements. **/
+    double Percentile(double p) const
+    {
+        return Quantile(p / 100.0);
+    }
+
+    template<size_t I> typename std::enable_if<(N > 1) && (I < N), multi_array<double, (N > 1) ? N - 1 : 1>>::type Percentile(double p) const
+    {
+        return Quantile<I>(p / 100.0);
+    }
+
+private:
+    /** Offsets of the first elements of all lines along an axis (in C order of the other axes). **/
+    std::vector<std::ptrdiff_t> axis_lines(size_t axis) const
+    {
+        std::vector<std::ptrdiff_t> lines;
+        if (!fSize)
+        {
+            return lines;
+        }
+        lines.reserve(fSize / fShape[axis]);
+        index_type index{};
+        while (true)
+        {
+            std::ptrdiff_t offset = 0;
+            for (size_t i = 0; i < N; i++)
+            {
+                offset += std::ptrdiff_t(index[i] * fStrides[i]);
+            }
+            lines.push_back(offset);
+            size_t i = N;
+            while (i-- > 0)
+            {
+                if ((i != axis) && (++index[i] < fShape[i]))
+                {
+                    break;
+                }
+                if (i != axis)
+                {
+                    index[i] = 0;
+                }
+            }
+            if (i == size_t(-1))
+            {
+                return lines;
+            }
+        }
+    }
+
+    /**
+      * @short Reduction along axes with f(accumulator&, value).
+      *
+      * Runs as a single pass over the elements, the output is addressed
+      * with zero strides along the reduced axes.
+      */
+    template<size_t... Axes, typename F> multi_array<T, N - sizeof...(Axes)> reduce(const compute_type& init, F f) const
+    {
+        static_assert((sizeof...(Axes) > 0) && (sizeof...(Axes) < N), "Reduce along at least one axis, but not all.");
+        constexpr size_t R = N - sizeof...(Axes);
+        index_type axes {{ Axes... }};
+        std::array<bool, N> reduced{};
+        for (size_t i = 0; i < sizeof...(Axes); i++)
+        {
+            if ((axes[i] >= N) || reduced[axes[i]])
+            {
+                throw std::runtime_error("Invalid axes for reduction.");
+            }
+            reduced[axes[i]] = true;
+        }
+        std::array<size_t, R> shape;
+        for (size_t i = 0, j = 0; i < N; i++)
+        {
+            if (!reduced[i])
+            {
+                shape[j++] = fShape[i];
+            }
+        }
+        std::array<size_t, R> resultStrides = get_strides(shape);
+        index_type outputStrides{};
+        for (size_t i = 0, j = 0; i < N; i++)
+        {
+            if (!reduced[i])
+            {
+                outputStrides[i] = resultStrides[j++];
+            }
+        }
+
+        std::valarray<compute_type> accumulators(init, get_product(shape));
+        if (fSize)
+        {
+            const T* data = DataPointer();
+            compute_type* output = &accumulators[0];
+            make_nditer(fShape, fStrides, 0, outputStrides, 0).ForEach(
+                [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                    const T* x = data + offsets[0];
+                    compute_type* y = output + offsets[1];
+                    if (strides[1] == 0)
+                    {
+                        compute_type value = *y;
+                        for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++)
+                        {
+                            f(value, compute_type(x[i * strides[0]]));
+                        }
+                        *y = value;
+                    }
+                    else
+                    {
+                        for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++)
+                        {
+                            f(y[i * strides[1]], compute_type(x[i * strides[0]]));
+                        }
+                    }
+                });
+        }
+        std::valarray<T> result(accumulators.size());
+        for (size_t i = 0; i < result.size(); i++)
+        {
+            result[i] = T(accumulators[i]);
+        }
+        return multi_array<T, R>(shape, std::move(result));
+    }
+};
+
+/**
+  * @short Multi-dimensional array, owning its data.
+  */
+template<typename T, size_t N> class multi_array : public multi_array_base<T, N, array_owner_impl>
+{
+public:
+    // Type aliases
+    #ifdef __GNUC__
+        using base_type = multi_array_base<T, N, array_owner_impl>;
+    #else
+        using base_type = multi_array_base;
+    #endif
+    using typename base_type::index_type;
+    using typename base_type::data_type;    // std::valarray<T>
+    using typename base_type::compute_type;
+
+protected:
+    // Import members
+    using index_impl<N>::fStrides;
+    using index_impl<N>::fShape;
+    using index_impl<N>::fSize;
+    using index_impl<N>::fOffset;
     using base_type::fData;
     using base_type::get_data_array;
+    using base_type::transform;
+    using base_type::transform_with;
+
+public:
+    using base_type::operator=;
+
+    explicit multi_array(const index_type& shape)
+        : base_type(
+            data_type(get_product(shape)),
+            shape)
+    { }
+
+    multi_array(const index_type& shape, const std::valarray<T>& data)
+        : base_type(
+            data,
+            shape)
+    {}
+
+    multi_array(const index_type& shape, const T& value)
+        : base_type(
+            data_type(value, get_product(shape)),
+            shape)
+    { }
+
+    multi_array(const index_type& shape, const T* data)
+        : base_type(
+            data_type(data, get_product(shape)),
+            shape)
+    { }
+
+    template<template <typename, size_t> class data_policy> multi_array(const multi_array_base<T, N, data_policy>& other)
+        : base_type(
+            other.Data(),
+            other.Shape()
+        )
+    { }
+
+    // Operators
+    template<size_t M, template <typename, size_t> class data_policy> multi_array& operator*= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x *= y; });
+        return *this;
+    }
+
+    multi_array& operator*= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x *= value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array& operator/= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x /= y; });
+        return *this;
+    }
+
+    multi_array& operator/= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x /= value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array& operator+= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x += y; });
+        return *this;
+    }
+
+    multi_array& operator+= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x += value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array& operator-= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x -= y; });
+        return *this;
+    }
+
+    multi_array& operator-= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x -= value; });
+        return *this;
+    }
+
+
+    void Write(std::ostream& os) const; // TODO: Generalize
+};
+
+template<typename T, size_t N> class multi_array_view : public multi_array_base<T, N, array_view_impl>
+{
+public:
+    // Type aliases
+    #ifdef __GNUC__
+        using base_type = multi_array_base<T, N, array_view_impl>;
+    #else
+        using base_type = multi_array_base;
+    #endif
+    using typename base_type::index_type;
+    using typename base_type::data_type;    // T*
+    using typename base_type::compute_type;
+
+    template<typename, size_t, template<typename, size_t> typename> friend class multi_array_base;
+    template<typename, size_t> friend class multi_array_masked_view;
+
+    // Import members
+    using base_type::operator=;
+
+    // Constructor for selecting items
+    template<template<typename, size_t> class data_policy> multi_array_view(multi_array_base<T, N+1, data_policy>& upper, size_t i)
+        : base_type(
+            upper.data_pointer(),
+            get_shape(upper, i),
+            get_strides(upper, i),
+            get_offset(upper, i)
+        )
+    { }
+
+    /** View of external data (no copy, not owned). **/
+    multi_array_view(T* data, const index_type& shape, const index_type& strides)
+        : base_type(data, shape, strides, 0)
+    { }
+
+    multi_array_view(T* data, const index_type& shape)
+        : base_type(data, shape, ::get_strides(shape), 0)
+    { }
+
+protected:
+    // Import members
+    using base_type::fShape;
+    using base_type::fSize;
+    // using base_type::get_data_array;
+    using base_type::Data;
+    using base_type::set_data;
+    using base_type::transform;
+    using base_type::transform_with;
+
+    // TODO: Add constructor for selecting items in any axis
+    // TODO: Add constructor for selecting slices...
+
+    // Constructor for reshaping of existing arrays
+    template<size_t M, template<typename, size_t> class data_policy> multi_array_view(multi_array_base<T, M, data_policy>& upper, const index_type& shape, const index_type& strides, size_t offset = 0)
+        : base_type(
+            upper.data_pointer(),
+            shape,
+            strides,
+            offset
+        )
+    {   }
+
+public:
+    template<size_t M, template <typename, size_t> class data_policy> multi_array_view& operator*= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x *= y; });
+        return *this;
+    }
+
+    multi_array_view& operator*= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x *= value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array_view& operator/= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x /= y; });
+        return *this;
+    }
+
+    multi_array_view& operator/= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x /= value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array_view& operator+= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x += y; });
+        return *this;
+    }
+
+    multi_array_view& operator+= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x += value; });
+        return *this;
+    }
+
+    template<size_t M, template <typename, size_t> class data_policy> multi_array_view& operator-= (const multi_array_base<T, M, data_policy>& other)
+    {
+        transform_with(other.broadcast_to(fShape), [](compute_type& x, const compute_type& y) { x -= y; });
+        return *this;
+    }
+
+    multi_array_view& operator-= (const T& other)
+    {
+        compute_type value = other;
+        transform([value](compute_type& x) { x -= value; });
+        return *this;
+    }
+
+private:
+    template<template<typename, size_t> class data_policy> static index_type get_shape(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    {
+        index_type shape;
+        for (size_t i = 0; i < N; i++)
+        {
+            shape[i] = upper.fShape[i + 1];
+        }
+        return shape;
+    }
+
+    template<template<typename, size_t> class data_policy> static index_type get_strides(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    {
+        index_type strides;
+        for (size_t i = 0; i < N; i++)
+        {
+            strides[i] = upper.fStrides[i + 1];
+        }
+        return strides;
+    }
+
+    template<template<typename, size_t> class data_policy> static size_t get_offset(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    {
+        return upper.fOffset + i * upper.fStrides[0];
+    }
+
+};
+
+template<typename T, size_t N> class multi_array_view_const : public multi_array_base<T, N, array_const_view_impl>
+{
+public:
+    // Type aliases
+    #ifdef __GNUC__
+        using base_type = multi_array_base<T, N, array_const_view_impl>;
+    #else
+        using base_type = multi_array_base;
+    #endif
+    using typename base_type::index_type;
+    using typename base_type::data_type;    // const T*
+
+    // Import members
+    using index_impl<N>::fStrides;
+    using index_impl<N>::fShape;
+    using index_impl<N>::fSize;
+    using index_impl<N>::fOffset;
+    using base_type::fData;
+
+    // Read-only view with the same properties
+    template<template<typename, size_t> class data_policy> multi_array_view_const(const multi_array_base<T, N, data_policy>& other)
+        : base_type(
+            other.data_pointer(),
+            other.fShape,
+            other.fStrides,
+            other.fOffset
+        )
+    {   }
+
+    template<size_t M, template<typename, size_t> class data_policy> multi_array_view_const(const multi_array_base<T, M, data_policy>& upper, const index_type& shape, const index_type& strides, size_t offset = 0)
+        : base_type(
+            upper.data_pointer(),
+            shape,
+            strides,
+            offset
+        )
+    {   }
+    /** View of external data (no copy, not owned). **/
+    multi_array_view_const(const T* data, const index_type& shape, const index_type& strides)
+        : base_type(data, shape, strides, 0)
+    {   }
+
+    multi_array_view_const(const T* data, const index_type& shape)
+        : base_type(data, shape, ::get_strides(shape), 0)
+    {   }
+};
+
+/**
+  * @short Packed array of booleans, one bit per element.
+  *
+  * Result of comparisons and vectorized predicates. Elements are stored
+  * in C order in 64-bit words, the unused bits of the last word are kept zero,
+  * so that logical operations and counting can work on whole words.
+  */
+template<size_t N> class bit_array : public index_impl<N>
+{
+public:
+    // Type aliases
+    constexpr static size_t Dim = N;
+    using word_type = uint64_t;
+    using data_type = std::valarray<word_type>;
+    using base_type = index_impl<N>;
+    using typename base_type::index_type;
+
+    constexpr static size_t word_bits = 64;
+
+    // Friends
+    template<typename, size_t, template<typename, size_t> class> friend class multi_array_base;
+
+    explicit bit_array(const index_type& shape, bool value = false)
+        : base_type(shape),
+          fWords(value ? ~word_type(0) : word_type(0), (get_product(shape) + word_bits - 1) / word_bits)
+    {
+        clear_tail();
+    }
+
+    template<template<typename, size_t> class data_policy> explicit bit_array(const multi_array_base<bool, N, data_policy>& other)
+        : bit_array(other.Test([](const bool& value) { return value; }))
+    { }
+
+    // Element access
+    bool At(const index_type& i) const { return GetFlat(make_index(i)); }
+
+    void Set(const index_type& i, bool value = true) { SetFlat(make_index(i), value); }
+
+    bool GetFlat(size_t i) const { return (fWords[i / word_bits] >> (i % word_bits)) & 1; }
+
+    void SetFlat(size_t i, bool value = true)
+    {
+        word_type bit = word_type(1) << (i % word_bits);
+        if (value)
+        {
+            fWords[i / word_bits] |= bit;
+        }
+        else
+        {
+            fWords[i / word_bits] &= ~bit;
+        }
+    }
+
+    const data_type& Words() const { return fWords; }
+
+    // Reductions
+    size_t CountNonzero() const
+    {
+        size_t total = 0;
+        for (size_t w = 0; w < fWords.size(); w++)
+        {
+            total += bit_popcount(fWords[w]);
+        }
+        return total;
+    }
+
+    bool Any() const
+    {
+        for (size_t w = 0; w < fWords.size(); w++)
+        {
+            if (fWords[w]) { return true; }
+        }
+        return false;
+    }
+
+    bool All() const { return CountNonzero() == fSize; }
+
+    // Conversion
+    template<typename U = bool> multi_array<U, N> As() const
+    {
+        std::valarray<U> result(fSize);
+        for_each_set([&](size_t i) { result[i] = U(1); });
+        return multi_array<U, N>(fShape, std::move(result));
+    }
+
+    // Logical operators
+    bit_array operator~() const
+    {
+        bit_array result(*this);
+        result.fWords = ~fWords;
+        result.clear_tail();
+        return result;
+    }
+
+    bit_array& operator&= (const bit_array& other)
+    {
+        check_shape(other);
+        fWords &= other.fWords;
+        return *this;
+    }
+
+    bit_array& operator|= (const bit_array& other)
+    {
+        check_shape(other);
+        fWords |= other.fWords;
+        return *this;
+    }
+
+    bit_array& operator^= (const bit_array& other)
+    {
+        check_shape(other);
+        fWords ^= other.fWords;
+        return *this;
+    }
+
+    bit_array operator& (const bit_array& other) const { return bit_array(*this) &= other; }
+
+    bit_array operator| (const bit_array& other) const { return bit_array(*this) |= other; }
+
+    bit_array operator^ (const bit_array& other) const { return bit_array(*this) ^= other; }
+
+    /** Call f(i) for flat index of each set bit (in increasing order). **/
+    template<typename F> void for_each_set(F f) const
+    {
+        for (size_t w = 0; w < fWords.size(); w++)
+        {
+            word_type word = fWords[w];
+            while (word)
+            {
+                f(w * word_bits + bit_ctz(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+protected:
+    // Import members
+    using index_impl<N>::fShape;
+    using index_impl<N>::fSize;
+    using index_impl<N>::make_index;
+
+    word_type* word_pointer() { return fWords.size() ? &fWords[0] : nullptr; }
+
+    void clear_tail()
+    {
+        if (fSize % word_bits)
+        {
+            fWords[fWords.size() - 1] &= (word_type(1) << (fSize % word_bits)) - 1;
+        }
+    }
+
+    void check_shape(const bit_array& other) const
+    {
+        if (fShape != other.fShape)
+        {
+            throw std::runtime_error("Incompatible shapes for logical operation.");
+        }
+    }
+
+    data_type fWords;
+};
+
+template<size_t N> size_t count_nonzero(const bit_array<N>& mask)
+{
+    return mask.CountNonzero();
+}
+
+/** Contiguous elements of an array (copied only if needed). **/
+template<typename T, size_t N, template<typename, size_t> class data_policy> const T* contiguous_data(const multi_array_base<T, N, data_policy>& array,
+    std::valarray<T>& buffer)
+{
+    if (array.IsContiguous() || !array.Size())
+    {
+        return array.DataPointer();
+    }
+    buffer = array.Data();
+    return &buffer[0];
+}
+
+/** Number of elements from which nonzero elements are searched in parallel chunks. **/
+constexpr size_t nonzero_parallel_threshold = 1 << 18;
+
+/** Number of nonzero elements among size ones. **/
+template<typename T> size_t count_nonzero_elements(const T* data, size_t size)
+{
+    size_t total = 0;
+    for (size_t first = 0; first < size; first += 64)
+    {
+        total += bit_popcount(nonzero_word(data + first, std::min<size_t>(64, size - first)));
+    }
+    return total;
+}
+
+/** Flat indices of nonzero elements among [begin, end) (begin a multiple of 64). **/
+template<typename T> size_t* nonzero_positions(const T* data, size_t begin, size_t end, size_t* output)
+{
+    for (size_t first = begin; first < end; first += 64)
+    {
+        uint64_t word = nonzero_word(data + first, std::min<size_t>(64, end - first));
+        compress_positions(first, word, output);
+        output += bit_popcount(word);
+    }
+    return output;
+}
+
+/**
+  * @short Flat indices of the nonzero elements, found in chunks.
+  *
+  * Chunks are counted in parallel, the result allocated once for all
+  * of them and each chunk written at its prefix-sum offset.
+  */
+template<typename T> multi_array<size_t, 1> nonzero_chunked(const T* data, size_t size, size_t chunks)
+{
+    const size_t words = (size + 63) / 64;
+    chunks = std::max<size_t>(1, std::min(chunks, words));
+    std::vector<size_t> offsets(chunks + 1, 0);
+    auto bounds = [&](size_t chunk) { return std::min(size, words * chunk / chunks * 64); };
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++)
+        {
+            offsets[chunk + 1] = count_nonzero_elements(data + bounds(chunk), bounds(chunk + 1) - bounds(chunk));
+        }
+    });
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+    {
+        offsets[chunk + 1] += offsets[chunk];
+    }
+    multi_array<size_t, 1> result(std::array<size_t, 1>{{ offsets[chunks] }});
+    size_t* output = result.DataPointer();
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++)
+        {
+            nonzero_positions(data, bounds(chunk), bounds(chunk + 1), output + offsets[chunk]);
+        }
+    });
+    return result;
+}
+
+/** Indices along each axis of flat (C-order) indices, as rows (argwhere) or columns (nonzero). **/
+template<size_t N> multi_array<size_t, 2> unravel_indices(const multi_array<size_t, 1>& flat, const std::array<size_t, N>& shape, bool rows)
+{
+    const size_t count = flat.Size();
+    multi_array<size_t, 2> result(rows ? std::array<size_t, 2>{{ count, N }} : std::array<size_t, 2>{{ N, count }});
+    const size_t* f = flat.DataPointer();
+    size_t* output = result.DataPointer();
+    const size_t step = rows ? N : 1;
+    const size_t axisStep = rows ? 1 : count;
+    parallel_for(count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            size_t index = f[i];
+            for (size_t axis = N; axis-- > 0; )
+            {
+                output[i * step + axis * axisStep] = index % shape[axis];
+                index /= shape[axis];
+            }
+        }
+    }, storage_block_size * 16);
+    return result;
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> size_t count_nonzero(const multi_array_base<T, N, data_policy>& array)
+{
+    std::valarray<T> buffer;
+    const T* data = contiguous_data(array, buffer);
+    const size_t size = array.Size();
+    const size_t words = (size + 63) / 64;
+    const size_t chunks = (size < nonzero_parallel_threshold) ? 1 : std::min(thread_count(), words);
+    std::vector<size_t> counts(chunks, 0);
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++)
+        {
+            const size_t first = std::min(size, words * chunk / chunks * 64);
+            const size_t last = std::min(size, words * (chunk + 1) / chunks * 64);
+            counts[chunk] = count_nonzero_elements(data + first, last - first);
+        }
+    });
+    size_t total = 0;
+    for (size_t c : counts)
+    {
+        total += c;
+    }
+    return total;
+}
+
+/** Flat (C-order) indices of the nonzero elements (numpy.flatnonzero). **/
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<size_t, 1> flatnonzero(const multi_array_base<T, N, data_policy>& array)
+{
+    std::valarray<T> buffer;
+    const T* data = contiguous_data(array, buffer);
+    return nonzero_chunked(data, array.Size(), (array.Size() < nonzero_parallel_threshold) ? 1 : thread_count());
+}
+
+/** Flat indices of the set bits of a mask. **/
+template<size_t N> multi_array<size_t, 1> flatnonzero(const bit_array<N>& mask)
+{
+    multi_array<size_t, 1> result(std::array<size_t, 1>{{ mask.CountNonzero() }});
+    size_t* output = result.DataPointer();
+    const typename bit_array<N>::data_type& words = mask.Words();
+    for (size_t w = 0; w < words.size(); w++)
+    {
+        compress_positions(w * 64, words[w], output);
+        output += bit_popcount(words[w]);
+    }
+    return result;
+}
+
+/** Indices of the nonzero elements, one row (of N indices) per element (numpy.argwhere). **/
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<size_t, 2> argwhere(const multi_array_base<T, N, data_policy>& array)
+{
+    return unravel_indices(flatnonzero(array), array.Shape(), true);
+}
+
+template<size_t N> multi_array<size_t, 2> argwhere(const bit_array<N>& mask)
+{
+    return unravel_indices(flatnonzero(mask), mask.Shape(), true);
+}
+
+/** Indices of the nonzero elements, one row per axis (numpy.nonzero): nonzero(a)[i] indexes axis i. **/
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<size_t, 2> nonzero(const multi_array_base<T, N, data_policy>& array)
+{
+    return unravel_indices(flatnonzero(array), array.Shape(), false);
+}
+
+template<size_t N> multi_array<size_t, 2> nonzero(const bit_array<N>& mask)
+{
+    return unravel_indices(flatnonzero(mask), mask.Shape(), false);
+}
+
+template<size_t N> std::ostream& operator<< (std::ostream& os, const bit_array<N>& mask)
+{
+    mask.template As<bool>().Write(os);
+    return os;
+}
+
+/**
+  * @short Elements of an array selected by a mask.
+  *
+  * Result of array[mask] or array[predicate]. Assignment and compound
+  * operators modify the selected elements in place; the selection
+  * can be read as a compacted 1-D copy.
+  */
+template<typename T, size_t N> class multi_array_masked_view
+{
+public:
+    multi_array_masked_view(const multi_array_view<T, N>& view, const bit_array<N>& mask)
+        : fView(view), fMask(mask), fCount(mask.CountNonzero())
+    {
+        if (view.Shape() != mask.Shape())
+        {
+            throw std::runtime_error("Incompatible shapes of array and mask.");
+        }
+    }
+
+    /** Number of selected elements. **/
+    size_t Size() const { return fCount; }
+
+    const bit_array<N>& Mask() const { return fMask; }
+
+    multi_array<T, 1> Copy() const { return fView.Select(fMask); }
+
+    operator multi_array<T, 1>() const { return Copy(); }
+
+    multi_array_masked_view& operator= (const T& value)
+    {
+        for_each_selected([&value](T& x, size_t) { x = value; });
+        return *this;
+    }
+
+    /** Assign values (1-D, one per selected element) in order. **/
+    template<template <typename, size_t> class data_policy> multi_array_masked_view& operator= (const multi_array_base<T, 1, data_policy>& values)
+    {
+        const auto& data = check_values(values);
+        for_each_selected([&data](T& x, size_t k) { x = data[k]; });
+        return *this;
+    }
+
+    multi_array_masked_view& operator*= (const T& value)
+    {
+        for_each_selected([&value](T& x, size_t) { x *= value; });
+        return *this;
+    }
+
+    multi_array_masked_view& operator/= (const T& value)
+    {
+        for_each_selected([&value](T& x, size_t) { x /= value; });
+        return *this;
+    }
+
+    multi_array_masked_view& operator+= (const T& value)
+    {
+        for_each_selected([&value](T& x, size_t) { x += value; });
+        return *this;
+    }
+
+    multi_array_masked_view& operator-= (const T& value)
+    {
+        for_each_selected([&value](T& x, size_t) { x -= value; });
+        return *this;
+    }
+
+    template<template <typename, size_t> class data_policy> multi_array_masked_view& operator*= (const multi_array_base<T, 1, data_policy>& values)
+    {
+        const auto& data = check_values(values);
+        for_each_selected([&data](T& x, size_t k) { x *= data[k]; });
+        return *this;
+    }
+
+    template<template <typename, size_t> class data_policy> multi_array_masked_view& operator/= (const multi_array_base<T, 1, data_policy>& values)
+    {
+        const auto& data = check_values(values);
+        for_each_selected([&data](T& x, size_t k) { x /= data[k]; });
+        return *this;
+    }
+
+    template<template <typename, size_t> class data_policy> multi_array_masked_view& operator+= (const multi_array_base<T, 1, data_policy>& values)
+    {
+        const auto& data = check_values(values);
+        for_each_selected([&data](T& x, size_t k) { x += data[k]; });
+        return *this;
+    }
+
+    template<template <typename, size_t> class data_policy> multi_array_masked_view& operator-= (const multi_array_base<T, 1, data_policy>& values)
+    {
+        const auto& data = check_values(values);
+        for_each_selected([&data](T& x, size_t k) { x -= data[k]; });
+        return *this;
+    }
+
+private:
+    template<template <typename, size_t> class data_policy> auto check_values(const multi_array_base<T, 1, data_policy>& values) const
+        -> decltype(values.Data())
+    {
+        if (values.Size() != fCount)
+        {
+            throw std::runtime_error("Number of values does not match the number of selected elements.");
+        }
+        return values.Data();
+    }
+
+    /** Call f(T& element, size_t k) for k-th selected element, in place. **/
+    template<typename F> void for_each_selected(F f)
+    {
+        if (!fCount) { return; }
+        if (fView.IsContiguous())
+        {
+            for_each_selected(fView.DataPointer(), f);
+        }
+        else
+        {
+            size_t position = 0;
+            size_t k = 0;
+            fView.for_each_run([&](T* data, std::ptrdiff_t stride, size_t count) {
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++, position++)
+                {
+                    if (fMask.GetFlat(position))
+                    {
+                        f(data[i * stride], k++);
+                    }
+                }
+            });
+        }
+    }
+
+    template<typename F> void for_each_selected(T* data, F f)
+    {
+        const uint64_t* words = &fMask.Words()[0];
+        size_t k = 0;
+        for (size_t w = 0; w * 64 < fView.Size(); w++)
+        {
+            uint64_t word = words[w];
+            T* block = data + w * 64;
+            if (word == ~uint64_t(0))
+            {
+                for (size_t i = 0; i < 64; i++)
+                {
+                    f(block[i], k + i);
+                }
+                k += 64;
+            }
+            else
+            {
+                for (; word; word &= word - 1)
+                {
+                    f(block[bit_ctz(word)], k++);
+                }
+            }
+        }
+    }
+
+    multi_array_view<T, N> fView;
+
+    bit_array<N> fMask;
+
+    size_t fCount;
+};
+
+template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array_masked_view<T, N>& view)
+{
+    view.Copy().Write(os);
+    return os;
+}
+
+/**
+  * @short Single-pass, branch-free selection kernel for where.
+  *
+  * Scalars are passed as operands with zero strides.
+  */
+template<typename T, size_t N> multi_array<T, N> _where(const bit_array<N>& mask,
+    const T* a, const std::array<size_t, N>& aStrides, const T* b, const std::array<size_t, N>& bStrides)
+{
+    std::valarray<T> result(mask.Size());
+    if (!mask.Size())
+    {
+        return multi_array<T, N>(mask.Shape(), std::move(result));
+    }
+    T* target = &result[0];
+    const uint64_t* words = &mask.Words()[0];
+    size_t position = 0;
+    make_nditer(mask.Shape(), aStrides, 0, bStrides, 0).ForEach(
+        [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+            const T* x = a + offsets[0];
+            const T* y = b + offsets[1];
+            for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++, position++)
+            {
+                target[position] = ((words[position / 64] >> (position % 64)) & 1) ? x[i * strides[0]] : y[i * strides[1]];
+            }
+        });
+    return multi_array<T, N>(mask.Shape(), std::move(result));
+}
+
+/** Select elementwise from a where mask is set, from b elsewhere. **/
+template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, N> where(const bit_array<N>& mask, const multi_array_base<T, N, data_policy1>& a, const multi_array_base<T, N, data_policy2>& b)
+{
+    if ((mask.Shape() != a.Shape()) || (mask.Shape() != b.Shape()))
+    {
+        throw std::runtime_error("Incompatible shapes for where.");
+    }
+    return _where(mask, a.DataPointer(), a.Strides(), b.DataPointer(), b.Strides());
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy>
+    multi_array<T, N> where(const bit_array<N>& mask, const multi_array_base<T, N, data_policy>& a, const T& b)
+{
+    if (mask.Shape() != a.Shape())
+    {
+        throw std::runtime_error("Incompatible shapes for where.");
+    }
+    return _where(mask, a.DataPointer(), a.Strides(), &b, std::array<size_t, N>{});
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy>
+    multi_array<T, N> where(const bit_array<N>& mask, const T& a, const multi_array_base<T, N, data_policy>& b)
+{
+    if (mask.Shape() != b.Shape())
+    {
+        throw std::runtime_error("Incompatible shapes for where.");
+    }
+    return _where(mask, &a, std::array<size_t, N>{}, b.DataPointer(), b.Strides());
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator* (const T& x, const multi_array_base<T, N, data_policy>& y)
+{
+    return y * x;
+}
+
+/*template<typename U, typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator/ (const U& x, const multi_array_base<T, N, data_policy>& y)
+{
+    return y * x;
+}*/
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator+ (const T& x, const multi_array_base<T, N, data_policy>& y)
+{
+    return y + x;
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator- (const T& x, const multi_array_base<T, N, data_policy>& y)
+{
+    return -y + x;
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator- (const multi_array_base<T, N, data_policy>& x)
+{
+    return T(-1) * x;
+}
+
+template<typename T, size_t N> void multi_array<T, N>::Write(std::ostream& os) const
+{
+    os << "{";
+    size_t i = 0;
+    while (i < fSize)
+    {
+        if (i == 0)
+        {
+            for (size_t j = 0; j < N; j++)
+            {
+                os << "[";
+            }
+        }
+        else
+        {
+            for (size_t j = 0; j + 1 < N; j++)
+            {
+                if (i % fStrides[j] == 0)
+                {
+                    for (size_t k = j; k + 1 < N; k++)
+                    {
+                        os << "\n";
+                    }
+                    os << "  ";
+                    for (size_t k = 0; k < j; k++)
+                    {
+                        os << " ";
+                    }
+                    for (size_t k = j; k + 1 < N; k++)
+                    {
+                        os << "[";
+                    }
+                    break;
+                }
+            }
+        }
+
+        os << fData[fOffset + i];
+        i++;
+
+        size_t j = 0;
+        // size_t k = 0;
+        for (; j + 1 < N; j++)
+        {
+            if (i % fStrides[j] == 0)
+            {
+                break;
+            }
+        }
+        for (size_t k = j; k + 1 < N; k++)
+        {
+            os << "]";
+        }
+        if (i != fSize)
+        {
+            os << ", ";
+        }
+    }
+    os << "]}";
+}
+
+template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array<T, N>& array)
+{
+    array.Write(os);
+    return os;
+}
+
+template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array_view<T, N>& array)
+{
+    array.Copy().Write(os);
+    return os;
+}
+
+template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array_view_const<T, N>& array)
+{
+    array.Copy().Write(os);
+    return os;
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> abs(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::abs);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> exp(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::exp);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> log(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::log);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> log10(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::log10);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy, typename U>
+    typename std::enable_if<std::is_arithmetic<U>::value, multi_array<T, N>>::type pow(const multi_array_base<T, N, data_policy>& arr, const U& exponential)
+{
+    T e(exponential);
+    return arr.Apply(std::function<T(T)>([e](T x) -> T { return std::pow(x, e); }));
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy, typename U>
+    typename std::enable_if<std::is_arithmetic<U>::value, multi_array<T, N>>::type pow(const U& base, const multi_array_base<T, N, data_policy>& arr)
+{
+    T b(base);
+    return arr.Apply(std::function<T(T)>([b](T x) -> T { return std::pow(b, x); }));
+}
+
+template<typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, (N > M) ? N : M> pow(const multi_array_base<T, N, data_policy1>& arr1, const multi_array_base<T, M, data_policy2>& arr2)
+{
+    return arr1.Apply(arr2, [](T x, T y) -> T { return std::pow(x, y); });
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sqrt(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::sqrt);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sin(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::sin);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> cos(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::cos);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> tan(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::tan);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> asin(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::asin);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> acos(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::acos);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> atan(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::atan);
+}
+
+template<typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, (N > M) ? N : M> atan2(const multi_array_base<T, N, data_policy1>& arr1, const multi_array_base<T, M, data_policy2>& arr2)
+{
+    return arr1.Apply(arr2, [](T x, T y) -> T { return std::atan2(x, y); });
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sinh(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::sinh);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> cosh(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::cosh);
+}
+
+template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> tanh(const multi_array_base<T, N, data_policy>& arr)
+{
+    return arr.Apply((double(*)(double))&std::tanh);
+}
+
+template<typename T> multi_array<T, 1> linspace(const T& start, const T& stop, size_t num, bool endpoint = true)
+{
+    std::valarray<T> data(num);
+    T step = (stop - start) / (endpoint ? (num - 1) : num);
+    for (size_t i = 0; i < num; i++)
+    {
+        data[i] = start + i * step;
+    }
+    if (endpoint) { data[num-1] = stop; } // To make the endpoint precise
+    return { { num }, std::move(data) };
+}
+
+template<typename T> multi_array<T, 1> logspace(const T& start, const T& stop, size_t num, bool endpoint = true)
+{
+    return exp(log(10) * linspace((double)start, (double)stop, num, endpoint)).As<T>();
+}
+
+template<typename T> multi_array<T, 1> geomspace(const T& start, const T& stop, size_t num, bool endpoint = true)
+{
+    return logspace(log10((double)start), log10((double)stop), num, endpoint).As<T>();
+}
+
+template<typename T> multi_array<T, 1> arange(const T& start, const T& stop, const T& step)
+{
+    int nSteps = (stop - start) / step;
+    if ((nSteps * step + start) >= stop)
+    {
+        nSteps--;
+    }
+    return linspace(start, start + nSteps * step, nSteps+1);
+}
+
+template<typename T> multi_array<T, 1> arange(const T& start, const T& stop)
+{
+    T one { 1 };
+    return arange(start, stop, one);
+}
+
+template<typename T> multi_array<T, 1> arange(const T& stop)
+{
+    T zero { 0 };
+    T one { 1 };
+    return arange(zero, stop, one);
+}
+
+template<typename T> multi_array<T, 1> asarray(const std::vector<T>& data)
+{
+    std::valarray<T> d(data.data(), data.size());
+    return multi_array<T, 1>({data.size()}, d);
+}
+
+template<typename T, size_t N> multi_array<T, 1> asarray(const std::array<T, N>& data)
+{
+    std::valarray<T> d(N);
+    for (int i = 0; i < N; i++)
+    {
+        d[i] = data[i];
+    }
+    return multi_array<T, 1>({N}, d);
+}
+
+template<typename U, typename... Ts> multi_array<U, sizeof...(Ts)> zeros(Ts... args)
+{
+    std::array<size_t, sizeof...(Ts)> shape { args... };
+    return multi_array<U, sizeof...(Ts)>(shape);
+}
+
+template<typename T, int N, template<typename, size_t> typename data_policy> multi_array<T, N> zeroslike(const multi_array_base<T, N, data_policy>& other)
+{
+    return multi_array<T, N>(other.Shape());
+}
+
+template<typename U, typename... Ts> multi_array<U, sizeof...(Ts)> ones(Ts... args)
+{
+    return zeros<U>(args...) + U(1);
+}
+
+/**
+  * @short (n, 3) view of an array of 3-vector structs (no copy).
+  *
+  * V must store its three components as consecutive T's at its start
+  * (e.g. G4ThreeVector / CLHEP::Hep3Vector with T = double).
+  */
+template<typename T = double, typename V> multi_array_view<T, 2> as_vectors(V* vectors, size_t count)
+{
+    static_assert(std::is_standard_layout<V>::value && (sizeof(V) >= 3 * sizeof(T)) && (sizeof(V) % sizeof(T) == 0),
+        "Vector type must start with three components of type T.");
+    return multi_array_view<T, 2>(reinterpret_cast<T*>(vectors), {{ count, 3 }}, {{ sizeof(V) / sizeof(T), 1 }});
+}
+
+template<typename T = double, typename V> multi_array_view_const<T, 2> as_vectors(const V* vectors, size_t count)
+{
+    static_assert(std::is_standard_layout<V>::value && (sizeof(V) >= 3 * sizeof(T)) && (sizeof(V) % sizeof(T) == 0),
+        "Vector type must start with three components of type T.");
+    return multi_array_view_const<T, 2>(reinterpret_cast<const T*>(vectors), {{ count, 3 }}, {{ sizeof(V) / sizeof(T), 1 }});
+}
+
+/** Copy components of vectors [begin, begin + count) of a (n, 3) array to separate buffers. **/
+template<typename T, template<typename, size_t> class data_policy, typename C> void load_vector_block(const multi_array_base<T, 2, data_policy>& vectors,
+    size_t begin, size_t count, C* x, C* y, C* z)
+{
+    const std::ptrdiff_t stride = vectors.Strides()[0];
+    const std::ptrdiff_t component = vectors.Strides()[1];
+    const T* source = vectors.DataPointer() + std::ptrdiff_t(begin) * stride;
+    copy_strided(source, stride, x, 1, count);
+    copy_strided(source + component, stride, y, 1, count);
+    copy_strided(source + 2 * component, stride, z, 1, count);
+}
+
+/**
+  * @short Call f(x, y, z, count, begin) for blocks of vectors of a (n, 3) array.
+  *
+  * Components are split into separate compute_type buffers, so that the
+  * loops of f run over consecutive vectors (and are vectorized).
+  */
+template<typename T, template<typename, size_t> class data_policy, typename F> void for_each_vector_block(const multi_array_base<T, 2, data_policy>& vectors, F f)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (vectors.Shape()[1] != 3)
+    {
+        throw std::runtime_error("Array of vectors must have shape (n, 3).");
+    }
+    compute_type x[storage_block_size], y[storage_block_size], z[storage_block_size];
+    for (size_t begin = 0; begin < vectors.Shape()[0]; begin += storage_block_size)
+    {
+        const size_t count = std::min(storage_block_size, vectors.Shape()[0] - begin);
+        load_vector_block(vectors, begin, count, x, y, z);
+        f(x, y, z, count, begin);
+    }
+}
+
+/** Write blocks of components to consecutive vectors of a C-order (n, 3) array. **/
+template<typename T, typename C> void store_vector_block(T* target, const C* x, const C* y, const C* z, size_t count)
+{
+    copy_strided(x, 1, target, 3, count);
+    copy_strided(y, 1, target + 1, 3, count);
+    copy_strided(z, 1, target + 2, 3, count);
+}
+
+/** R v + t for each vector v of a (n, 3) array (e.g. local to global coordinates). **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 2> affine_transform(const multi_array_base<T, 2, data_policy1>& rotation, const std::array<T, 3>& translation, const multi_array_base<T, 2, data_policy2>& vectors)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if ((rotation.Shape()[0] != 3) || (rotation.Shape()[1] != 3))
+    {
+        throw std::runtime_error("Rotation must be a 3 x 3 matrix.");
+    }
+    compute_type r[3][3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        for (size_t j = 0; j < 3; j++)
+        {
+            r[i][j] = compute_type(rotation.At({ i, j }));
+        }
+    }
+    const compute_type t[3] = { compute_type(translation[0]), compute_type(translation[1]), compute_type(translation[2]) };
+    multi_array<T, 2> result(std::array<size_t, 2>{{ vectors.Shape()[0], 3 }});
+    T* output = result.DataPointer();
+    for_each_vector_block(vectors, [&](const compute_type* x, const compute_type* y, const compute_type* z, size_t count, size_t begin) {
+        compute_type u[storage_block_size], v[storage_block_size], w[storage_block_size];
+        for (size_t i = 0; i < count; i++)
+        {
+            u[i] = r[0][0] * x[i] + r[0][1] * y[i] + r[0][2] * z[i] + t[0];
+            v[i] = r[1][0] * x[i] + r[1][1] * y[i] + r[1][2] * z[i] + t[1];
+            w[i] = r[2][0] * x[i] + r[2][1] * y[i] + r[2][2] * z[i] + t[2];
+        }
+        store_vector_block(output + 3 * begin, u, v, w, count);
+    });
+    return result;
+}
+
+/** R v for each vector v of a (n, 3) array (R is 3 x 3, e.g. from a G4RotationMatrix). **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 2> rotate(const multi_array_base<T, 2, data_policy1>& rotation, const multi_array_base<T, 2, data_policy2>& vectors)
+{
+    return affine_transform(rotation, std::array<T, 3>{{ T(), T(), T() }}, vectors);
+}
+
+/** Cross products of corresponding vectors of two (n, 3) arrays. **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 2> cross(const multi_array_base<T, 2, data_policy1>& a, const multi_array_base<T, 2, data_policy2>& b)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (a.Shape() != b.Shape())
+    {
+        throw std::runtime_error("Arrays of vectors must have the same shape.");
+    }
+    multi_array<T, 2> result(a.Shape());
+    T* output = result.DataPointer();
+    for_each_vector_block(a, [&](const compute_type* x, const compute_type* y, const compute_type* z, size_t count, size_t begin) {
+        compute_type p[storage_block_size], q[storage_block_size], r[storage_block_size];
+        load_vector_block(b, begin, count, p, q, r);
+        compute_type u[storage_block_size], v[storage_block_size], w[storage_block_size];
+        for (size_t i = 0; i < count; i++)
+        {
+            u[i] = y[i] * r[i] - z[i] * q[i];
+            v[i] = z[i] * p[i] - x[i] * r[i];
+            w[i] = x[i] * q[i] - y[i] * p[i];
+        }
+        store_vector_block(output + 3 * begin, u, v, w, count);
+    });
+    return result;
+}
+
+/** Dot products of corresponding vectors of two (n, 3) arrays. **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 1> vector_dot(const multi_array_base<T, 2, data_policy1>& a, const multi_array_base<T, 2, data_policy2>& b)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (a.Shape() != b.Shape())
+    {
+        throw std::runtime_error("Arrays of vectors must have the same shape.");
+    }
+    multi_array<T, 1> result(std::array<size_t, 1>{{ a.Shape()[0] }});
+    T* output = result.DataPointer();
+    for_each_vector_block(a, [&](const compute_type* x, const compute_type* y, const compute_type* z, size_t count, size_t begin) {
+        compute_type p[storage_block_size], q[storage_block_size], r[storage_block_size];
+        load_vector_block(b, begin, count, p, q, r);
+        compute_type d[storage_block_size];
+        for (size_t i = 0; i < count; i++)
+        {
+            d[i] = x[i] * p[i] + y[i] * q[i] + z[i] * r[i];
+        }
+        copy_strided(d, 1, output + begin, 1, count);
+    });
+    return result;
+}
+
+/** Lengths of the vectors of a (n, 3) array. **/
+template<typename T, template<typename, size_t> class data_policy> multi_array<T, 1> vector_norm(const multi_array_base<T, 2, data_policy>& vectors)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    multi_array<T, 1> result(std::array<size_t, 1>{{ vectors.Shape()[0] }});
+    T* output = result.DataPointer();
+    for_each_vector_block(vectors, [&](const compute_type* x, const compute_type* y, const compute_type* z, size_t count, size_t begin) {
+        compute_type d[storage_block_size];
+        for (size_t i = 0; i < count; i++)
+        {
+            d[i] = std::sqrt(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+        }
+        copy_strided(d, 1, output + begin, 1, count);
+    });
+    return result;
+}
+
+/** Unit vectors in the directions of the vectors of a (n, 3) array (zero vectors are kept). **/
+template<typename T, template<typename, size_t> class data_policy> multi_array<T, 2> normalize(const multi_array_base<T, 2, data_policy>& vectors)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    multi_array<T, 2> result(vectors.Shape());
+    T* output = result.DataPointer();
+    for_each_vector_block(vectors, [&](const compute_type* x, const compute_type* y, const compute_type* z, size_t count, size_t begin) {
+        compute_type u[storage_block_size], v[storage_block_size], w[storage_block_size];
+        for (size_t i = 0; i < count; i++)
+        {
+            const compute_type length = std::sqrt(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+            const compute_type scale = (length > compute_type()) ? compute_type(1) / length : compute_type();
+            u[i] = x[i] * scale;
+            v[i] = y[i] * scale;
+            w[i] = z[i] * scale;
+        }
+        store_vector_block(output + 3 * begin, u, v, w, count);
+    });
+    return result;
+}
+
+/**
+  * Matrix multiplication (matmul, dot, tensordot).
+  *
+  * Blocked GEMM: panels of the operands (converted to compute_type) are
+  * packed into contiguous buffers that stay in cache, and multiplied by
+  * a micro-kernel keeping a gemm_mr x gemm_nr tile of the result in
+  * registers. Row blocks run in parallel threads for large products.
+  * With G4MULTIARRAY_USE_CBLAS defined to 1 (link with a BLAS library),
+  * float and double products go to cblas_sgemm / cblas_dgemm instead.
+  */
+constexpr size_t gemm_mr = 4;
+constexpr size_t gemm_nr = 8;
+constexpr size_t gemm_mc = 128;
+constexpr size_t gemm_kc = 256;
+constexpr size_t gemm_nc = 2048;
+constexpr size_t gemm_parallel_threshold = size_t(1) << 20;     // Multiply-adds
+
+/** c (rows x cols of a gemm_mr x gemm_nr tile) += packed a * packed b. **/
+template<typename C> void gemm_micro_kernel(size_t kc, const C* a, const C* b, C* c, size_t ldc, size_t rows, size_t cols)
+{
+    C tile[gemm_mr][gemm_nr] = {};
+    for (size_t p = 0; p < kc; p++)
+    {
+        for (size_t i = 0; i < gemm_mr; i++)
+        {
+            const C x = a[p * gemm_mr + i];
+            for (size_t j = 0; j < gemm_nr; j++)
+            {
+                tile[i][j] += x * b[p * gemm_nr + j];
+            }
+        }
+    }
+    for (size_t i = 0; i < rows; i++)
+    {
+        for (size_t j = 0; j < cols; j++)
+        {
+            c[i * ldc + j] += tile[i][j];
+        }
+    }
+}
+
+/** Pack a (mc x kc) block of a into panels of gemm_mr rows (zero-padded). **/
+template<typename T, typename C> void gemm_pack_a(const T* a, std::ptrdiff_t rowStride, std::ptrdiff_t colStride, size_t mc, size_t kc, C* packed)
+{
+    for (size_t ir = 0; ir < mc; ir += gemm_mr)
+    {
+        const size_t rows = std::min(gemm_mr, mc - ir);
+        for (size_t p = 0; p < kc; p++)
+        {
+            for (size_t i = 0; i < gemm_mr; i++)
+            {
+                *packed++ = (i < rows) ? C(a[std::ptrdiff_t(ir + i) * rowStride + std::ptrdiff_t(p) * colStride]) : C();
+            }
+        }
+    }
+}
+
+/** Pack a (kc x nc) block of b into panels of gemm_nr columns (zero-padded). **/
+template<typename T, typename C> void gemm_pack_b(const T* b, std::ptrdiff_t rowStride, std::ptrdiff_t colStride, size_t kc, size_t nc, C* packed)
+{
+    for (size_t jr = 0; jr < nc; jr += gemm_nr)
+    {
+        const size_t cols = std::min(gemm_nr, nc - jr);
+        for (size_t p = 0; p < kc; p++)
+        {
+            for (size_t j = 0; j < gemm_nr; j++)
+            {
+                *packed++ = (j < cols) ? C(b[std::ptrdiff_t(p) * rowStride + std::ptrdiff_t(jr + j) * colStride]) : C();
+            }
+        }
+    }
+}
+
+/** BLAS is used only where available (see the overloads below). **/
+template<typename T, typename C> bool blas_gemm(size_t, size_t, size_t, const T*, std::ptrdiff_t, std::ptrdiff_t,
+    const T*, std::ptrdiff_t, std::ptrdiff_t, C*, size_t)
+{
+    return false;
+}
+
+#if defined(G4MULTIARRAY_USE_CBLAS) && G4MULTIARRAY_USE_CBLAS
+/** Transposition flag and leading dimension of a strided matrix, false if BLAS cannot use it. **/
+inline bool blas_layout(size_t rows, size_t cols, std::ptrdiff_t rowStride, std::ptrdiff_t colStride, cblas::CBLAS_TRANSPOSE& transpose, int& ld)
+{
+    if ((colStride == 1) && (rowStride >= std::ptrdiff_t(std::max<size_t>(cols, 1))))
+    {
+        transpose = cblas::CblasNoTrans;
+        ld = int(rowStride);
+        return true;
+    }
+    if ((rowStride == 1) && (colStride >= std::ptrdiff_t(std::max<size_t>(rows, 1))))
+    {
+        transpose = cblas::CblasTrans;
+        ld = int(colStride);
+        return true;
+    }
+    return false;
+}
+
+inline bool blas_gemm(size_t m, size_t n, size_t k, const double* a, std::ptrdiff_t aRowStride, std::ptrdiff_t aColStride,
+    const double* b, std::ptrdiff_t bRowStride, std::ptrdiff_t bColStride, double* c, size_t ldc)
+{
+    cblas::CBLAS_TRANSPOSE ta, tb;
+    int lda, ldb;
+    if (!blas_layout(m, k, aRowStride, aColStride, ta, lda) || !blas_layout(k, n, bRowStride, bColStride, tb, ldb))
+    {
+        return false;
+    }
+    cblas::cblas_dgemm(cblas::CblasRowMajor, ta, tb, int(m), int(n), int(k), 1.0, a, lda, b, ldb, 1.0, c, int(ldc));
+    return true;
+}
+
+inline bool blas_gemm(size_t m, size_t n, size_t k, const float* a, std::ptrdiff_t aRowStride, std::ptrdiff_t aColStride,
+    const float* b, std::ptrdiff_t bRowStride, std::ptrdiff_t bColStride, float* c, size_t ldc)
+{
+    cblas::CBLAS_TRANSPOSE ta, tb;
+    int lda, ldb;
+    if (!blas_layout(m, k, aRowStride, aColStride, ta, lda) || !blas_layout(k, n, bRowStride, bColStride, tb, ldb))
+    {
+        return false;
+    }
+    cblas::cblas_sgemm(cblas::CblasRowMajor, ta, tb, int(m), int(n), int(k), 1.0f, a, lda, b, ldb, 1.0f, c, int(ldc));
+    return true;
+}
+#endif
+
+/** Independent partial sums in strided_dot (so that additions overlap and vectorize). **/
+constexpr size_t dot_lanes = 8;
+
+/** Sum of a[p * aStride] * b[p * bStride] over p < k, in compute type C. **/
+template<typename C, typename T> C strided_dot(size_t k, const T* a, std::ptrdiff_t aStride, const T* b, std::ptrdiff_t bStride)
+{
+    C partial[dot_lanes] = {};
+    size_t p = 0;
+    if ((aStride == 1) && (bStride == 1))
+    {
+        for (; p + dot_lanes <= k; p += dot_lanes)
+        {
+            for (size_t j = 0; j < dot_lanes; j++)
+            {
+                partial[j] += C(a[p + j]) * C(b[p + j]);
+            }
+        }
+    }
+    else
+    {
+        for (; p + dot_lanes <= k; p += dot_lanes)
+        {
+            for (size_t j = 0; j < dot_lanes; j++)
+            {
+                partial[j] += C(a[std::ptrdiff_t(p + j) * aStride]) * C(b[std::ptrdiff_t(p + j) * bStride]);
+            }
+        }
+    }
+    for (; p < k; p++)
+    {
+        partial[0] += C(a[std::ptrdiff_t(p) * aStride]) * C(b[std::ptrdiff_t(p) * bStride]);
+    }
+    return ((partial[0] + partial[4]) + (partial[1] + partial[5])) + ((partial[2] + partial[6]) + (partial[3] + partial[7]));
+}
+
+/**
+  * @short y (m, stride yStride) += a (m x k) * x (k, stride xStride).
+  *
+  * Matrix-vector products skip the packing of gemm: rows of a are
+  * multiplied with x as dot products, or, if a is stored by columns,
+  * its columns are added to y scaled by elements of x (in blocks of y
+  * that stay in cache). Blocks of rows run in parallel threads.
+  */
+template<typename T, typename C> void gemv(size_t m, size_t k, const T* a, std::ptrdiff_t rowStride, std::ptrdiff_t colStride,
+    const T* x, std::ptrdiff_t xStride, C* y, std::ptrdiff_t yStride, bool parallel = true)
+{
+    const bool byRows = std::abs(colStride) <= std::abs(rowStride);
+    const size_t block = byRows ? gemm_mc : gemm_nc;
+    const size_t blocks = (m + block - 1) / block;
+    const bool threads = parallel && (double(m) * double(k) >= double(gemm_parallel_threshold));
+    parallel_for(blocks, [&](size_t begin, size_t end) {
+        for (size_t first = begin * block; first < std::min(m, end * block); first += block)
+        {
+            const size_t last = std::min(m, first + block);
+            if (byRows)
+            {
+                for (size_t i = first; i < last; i++)
+                {
+                    y[std::ptrdiff_t(i) * yStride] += strided_dot<C>(k, a + std::ptrdiff_t(i) * rowStride, colStride, x, xStride);
+                }
+                continue;
+            }
+            for (size_t p = 0; p < k; p++)
+            {
+                const C scale = C(x[std::ptrdiff_t(p) * xStride]);
+                const T* column = a + std::ptrdiff_t(p) * colStride;
+                if ((rowStride == 1) && (yStride == 1))
+                {
+                    for (size_t i = first; i < last; i++)
+                    {
+                        y[i] += scale * C(column[i]);
+                    }
+                }
+                else
+                {
+                    for (size_t i = first; i < last; i++)
+                    {
+                        y[std::ptrdiff_t(i) * yStride] += scale * C(column[std::ptrdiff_t(i) * rowStride]);
+                    }
+                }
+            }
+        }
+    }, threads ? 1 : blocks);
+}
+
+/**
+  * @short c (m x n, row stride ldc) += a (m x k) * b (k x n).
+  *
+  * a and b can have any strides (e.g. transposed views).
+  */
+template<typename T, typename C> void gemm(size_t m, size_t n, size_t k,
+    const T* a, std::ptrdiff_t aRowStride, std::ptrdiff_t aColStride,
+    const T* b, std::ptrdiff_t bRowStride, std::ptrdiff_t bColStride, C* c, size_t ldc, bool parallel = true)
+{
+    if (!m || !n || !k || blas_gemm(m, n, k, a, aRowStride, aColStride, b, bRowStride, bColStride, c, ldc))
+    {
+        return;
+    }
+    if (n == 1)
+    {
+        gemv(m, k, a, aRowStride, aColStride, b, bRowStride, c, std::ptrdiff_t(ldc), parallel);
+        return;
+    }
+    if (m == 1)
+    {
+        gemv(n, k, b, bColStride, bRowStride, a, aColStride, c, 1, parallel);
+        return;
+    }
+    const size_t blocks = (m + gemm_mc - 1) / gemm_mc;
+    const bool threads = parallel && (double(m) * double(n) * double(k) >= double(gemm_parallel_threshold));
+    std::vector<C> packedB(gemm_kc * ((std::min(n, gemm_nc) + gemm_nr - 1) / gemm_nr * gemm_nr));
+    for (size_t jc = 0; jc < n; jc += gemm_nc)
+    {
+        const size_t nc = std::min(gemm_nc, n - jc);
+        for (size_t pc = 0; pc < k; pc += gemm_kc)
+        {
+            const size_t kc = std::min(gemm_kc, k - pc);
+            gemm_pack_b(b + std::ptrdiff_t(pc) * bRowStride + std::ptrdiff_t(jc) * bColStride, bRowStride, bColStride, kc, nc, packedB.data());
+            parallel_for(blocks, [&](size_t begin, size_t end) {
+                std::vector<C> packedA(gemm_mc * kc);
+                for (size_t block = begin; block < end; block++)
+                {
+                    const size_t ic = block * gemm_mc;
+                    const size_t mc = std::min(gemm_mc, m - ic);
+                    gemm_pack_a(a + std::ptrdiff_t(ic) * aRowStride + std::ptrdiff_t(pc) * aColStride, aRowStride, aColStride, mc, kc, packedA.data());
+                    for (size_t jr = 0; jr < nc; jr += gemm_nr)
+                    {
+                        for (size_t ir = 0; ir < mc; ir += gemm_mr)
+                        {
+                            gemm_micro_kernel(kc, packedA.data() + ir * kc, packedB.data() + jr * kc,
+                                c + (ic + ir) * ldc + jc + jr, ldc, std::min(gemm_mr, mc - ir), std::min(gemm_nr, nc - jr));
+                        }
+                    }
+                }
+            }, threads ? 1 : blocks);
+        }
+    }
+}
+
+/** Extent and stride of axes [begin, end) merged into one, false if they are not evenly strided. **/
+template<size_t N> bool merge_axes(const std::array<size_t, N>& shape, const std::array<size_t, N>& strides, size_t begin, size_t end,
+    size_t& extent, std::ptrdiff_t& stride)
+{
+    extent = 1;
+    stride = 0;
+    for (size_t i = end; i-- > begin; )
+    {
+        if (shape[i] == 1)
+        {
+            continue;
+        }
+        if ((extent != 1) && (std::ptrdiff_t(strides[i]) != stride * std::ptrdiff_t(extent)))
+        {
+            return false;
+        }
+        if (extent == 1)
+        {
+            stride = std::ptrdiff_t(strides[i]);
+        }
+        extent *= shape[i];
+    }
+    return true;
+}
+
+/** A (rows x cols) matrix in strided memory, copied to a C-order buffer where needed. **/
+template<typename T> struct matrix_operand
+{
+    const T* data;
+    size_t rows, cols;
+    std::ptrdiff_t rowStride, colStride;
+    std::valarray<T> buffer;
+
+    /** Axes [0, split) of an array form the rows, [split, N) the columns. **/
+    template<size_t N> matrix_operand(const T* pointer, const std::array<size_t, N>& shape, const std::array<size_t, N>& strides, size_t split,
+        const std::function<std::valarray<T>()>& copy)
+        : data(pointer)
+    {
+        if (!merge_axes(shape, strides, 0, split, rows, rowStride) || !merge_axes(shape, strides, split, N, cols, colStride))
+        {
+            buffer = copy();
+            data = buffer.size() ? &buffer[0] : nullptr;
+            const std::array<size_t, N> contiguous = get_strides(shape);
+            merge_axes(shape, contiguous, 0, split, rows, rowStride);
+            merge_axes(shape, contiguous, split, N, cols, colStride);
+        }
+    }
+};
+
+/** c = a * b into a new C-order buffer converted to T. **/
+template<typename T> void multiply_matrices(const matrix_operand<T>& a, const matrix_operand<T>& b, T* output, bool parallel = true)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (a.cols != b.rows)
+    {
+        throw std::runtime_error("Matrix dimensions do not match.");
+    }
+    if (!storage_traits<T>::is_converted)
+    {
+        std::fill(output, output + a.rows * b.cols, T());
+        gemm(a.rows, b.cols, a.cols, a.data, a.rowStride, a.colStride, b.data, b.rowStride, b.colStride,
+            reinterpret_cast<compute_type*>(output), b.cols, parallel);
+        return;
+    }
+    std::vector<compute_type> result(a.rows * b.cols);
+    gemm(a.rows, b.cols, a.cols, a.data, a.rowStride, a.colStride, b.data, b.rowStride, b.colStride, result.data(), b.cols, parallel);
+    copy_strided(result.data(), 1, output, 1, result.size());
+}
+
+constexpr size_t tensordot_rank(size_t N, size_t M, size_t K)
+{
+    return (N + M > 2 * K) ? N + M - 2 * K : 1;
+}
+
+/**
+  * @short Sum of products over axes axesA of a and axesB of b (numpy.tensordot).
+  *
+  * The result has the remaining axes of a followed by those of b.
+  */
+template<size_t K, typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, tensordot_rank(N, M, K)> tensordot(const multi_array_base<T, N, data_policy1>& a, const multi_array_base<T, M, data_policy2>& b,
+        const std::array<size_t, K>& axesA, const std::array<size_t, K>& axesB)
+{
+    static_assert((K <= N) && (K <= M), "Too many axes to sum over.");
+    static_assert(N + M > 2 * K, "Use dot() for the full contraction of two arrays.");
+    constexpr size_t R = tensordot_rank(N, M, K);
+
+    // Summed axes go last in a and first in b
+    std::array<size_t, N> orderA;
+    std::array<size_t, M> orderB;
+    std::array<bool, N> summedA{};
+    std::array<bool, M> summedB{};
+    for (size_t i = 0; i < K; i++)
+    {
+        if ((axesA[i] >= N) || (axesB[i] >= M) || summedA[axesA[i]] || summedB[axesB[i]])
+        {
+            throw std::runtime_error("Invalid axes to sum over.");
+        }
+        if (a.Shape()[axesA[i]] != b.Shape()[axesB[i]])
+        {
+            throw std::runtime_error("Summed axes must have the same length.");
+        }
+        summedA[axesA[i]] = summedB[axesB[i]] = true;
+        orderA[N - K + i] = axesA[i];
+        orderB[i] = axesB[i];
+    }
+    std::array<size_t, R> shape{};
+    for (size_t i = 0, j = 0; i < N; i++)
+    {
+        if (!summedA[i])
+        {
+            orderA[j] = i;
+            shape[j++] = a.Shape()[i];
+        }
+    }
+    for (size_t i = 0, j = K; i < M; i++)
+    {
+        if (!summedB[i])
+        {
+            orderB[j] = i;
+            shape[N - K + j - K] = b.Shape()[i];
+            j++;
+        }
+    }
+
+    const multi_array_view_const<T, N> pa = a.permute(orderA);
+    const multi_array_view_const<T, M> pb = b.permute(orderB);
+    const matrix_operand<T> ma(pa.DataPointer(), pa.Shape(), pa.Strides(), N - K, [&pa]() { return pa.Data(); });
+    const matrix_operand<T> mb(pb.DataPointer(), pb.Shape(), pb.Strides(), K, [&pb]() { return pb.Data(); });
+    multi_array<T, R> result(shape);
+    multiply_matrices(ma, mb, result.DataPointer());
+    return result;
+}
+
+/** Sum over the last K axes of a and the first K axes of b. **/
+template<size_t K, typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, tensordot_rank(N, M, K)> tensordot(const multi_array_base<T, N, data_policy1>& a, const multi_array_base<T, M, data_policy2>& b)
+{
+    std::array<size_t, K> axesA, axesB;
+    for (size_t i = 0; i < K; i++)
+    {
+        axesA[i] = N - K + i;
+        axesB[i] = i;
+    }
+    return tensordot<K>(a, b, axesA, axesB);
+}
+
+/** Inner product of two vectors. **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    typename storage_traits<T>::compute_type dot(const multi_array_base<T, 1, data_policy1>& a, const multi_array_base<T, 1, data_policy2>& b)
+{
+    using compute_type = typename storage_traits<T>::compute_type;
+    if (a.Size() != b.Size())
+    {
+        throw std::runtime_error("Matrix dimensions do not match.");
+    }
+    return strided_dot<compute_type>(a.Size(), a.DataPointer(), std::ptrdiff_t(a.Strides()[0]), b.DataPointer(), std::ptrdiff_t(b.Strides()[0]));
+}
+
+/**
+  * @short Product of arrays (numpy.dot).
+  *
+  * Sums over the last axis of a and the second-to-last axis of b
+  * (the only axis if b is a vector).
+  */
+template<typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    typename std::enable_if<(N > 1) || (M > 1), multi_array<T, tensordot_rank(N, M, 1)>>::type
+        dot(const multi_array_base<T, N, data_policy1>& a, const multi_array_base<T, M, data_policy2>& b)
+{
+    return tensordot<1>(a, b, {{ N - 1 }}, {{ (M > 1) ? M - 2 : 0 }});
+}
+
+constexpr size_t matmul_rank(size_t N, size_t M)
+{
+    return (N == 1) ? ((M > 1) ? M - 1 : 1) : ((M == 1) ? N - 1 : ((N > M) ? N : M));
+}
+
+/**
+  * @short Matrix product, batched over leading axes (numpy.matmul).
+  *
+  * The last two axes are matrices; the leading axes are broadcast against
+  * each other. A 1-D a is a row vector, a 1-D b a column vector (the
+  * corresponding axis is removed from the result).
+  */
+template<typename T, size_t N, size_t M, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, matmul_rank(N, M)> matmul(const multi_array_base<T, N, data_policy1>& a, const multi_array_base<T, M, data_policy2>& b)
+{
+    static_assert((N > 1) || (M > 1), "Use dot() for the product of two vectors.");
+    constexpr size_t PA = (N > 1) ? N : 2;
+    constexpr size_t PB = (M > 1) ? M : 2;
+    constexpr size_t P = (PA > PB) ? PA : PB;
+
+    // Vectors as (1, n) or (n, 1) matrices
+    std::array<size_t, PA> shapeA, stridesA;
+    std::array<size_t, PB> shapeB, stridesB;
+    std::copy(a.Shape().begin(), a.Shape().end(), shapeA.end() - N);
+    std::copy(a.Strides().begin(), a.Strides().end(), stridesA.end() - N);
+    std::copy(b.Shape().begin(), b.Shape().end(), shapeB.begin());
+    std::copy(b.Strides().begin(), b.Strides().end(), stridesB.begin());
+    if (N == 1)
+    {
+        shapeA[0] = 1;
+        stridesA[0] = 0;
+    }
+    if (M == 1)
+    {
+        shapeB[1] = 1;
+        stridesB[1] = 0;
+    }
+    const size_t rows = shapeA[PA - 2], inner = shapeA[PA - 1], cols = shapeB[PB - 1];
+    if (shapeB[PB - 2] != inner)
+    {
+        throw std::runtime_error("Matrix dimensions do not match.");
+    }
+
+    // Broadcast leading (batch) axes
+    std::array<size_t, PA - 2> batchShapeA, batchStridesA;
+    std::array<size_t, PB - 2> batchShapeB, batchStridesB;
+    std::copy(shapeA.begin(), shapeA.end() - 2, batchShapeA.begin());
+    std::copy(stridesA.begin(), stridesA.end() - 2, batchStridesA.begin());
+    std::copy(shapeB.begin(), shapeB.end() - 2, batchShapeB.begin());
+    std::copy(stridesB.begin(), stridesB.end() - 2, batchStridesB.begin());
+    const std::array<size_t, P - 2> batchShape = broadcast_shape(batchShapeA, batchShapeB);
+    const std::array<size_t, P - 2> batchA = broadcast_strides(batchShapeA, batchStridesA, batchShape);
+    const std::array<size_t, P - 2> batchB = broadcast_strides(batchShapeB, batchStridesB, batchShape);
+    const size_t batches = get_product(batchShape);
+
+    // Same layout as (batches..., rows, cols) with the axes of vectors removed
+    constexpr size_t R = matmul_rank(N, M);
+    std::array<size_t, R> shape;
+    std::copy(batchShape.begin(), batchShape.end(), shape.begin());
+    if (N > 1)
+    {
+        shape[P - 2] = rows;
+    }
+    if (M > 1)
+    {
+        shape[R - 1] = cols;
+    }
+    multi_array<T, R> result(shape);
+    T* output = result.DataPointer();
+    const T* dataA = a.DataPointer();
+    const T* dataB = b.DataPointer();
+    const std::ptrdiff_t rsA = stridesA[PA - 2], csA = stridesA[PA - 1], rsB = stridesB[PB - 2], csB = stridesB[PB - 1];
+
+    // Many small products in parallel, or large ones one by one (in parallel inside)
+    const double work = std::max(1.0, double(rows) * double(cols) * double(inner));
+    const bool small = work < double(gemm_parallel_threshold);
+    const size_t grain = small ? size_t(std::ceil(double(gemm_parallel_threshold) / work)) : batches;
+    parallel_for(batches, [&](size_t begin, size_t end) {
+        for (size_t batch = begin; batch < end; batch++)
+        {
+            std::ptrdiff_t offsetA = 0, offsetB = 0;
+            for (size_t i = P - 2, rest = batch; i-- > 0; )
+            {
+                const size_t index = rest % batchShape[i];
+                rest /= batchShape[i];
+                offsetA += std::ptrdiff_t(index * batchA[i]);
+                offsetB += std::ptrdiff_t(index * batchB[i]);
+            }
+            matrix_operand<T> ma(dataA + offsetA, std::array<size_t, 2>{{ rows, inner }}, std::array<size_t, 2>{{ size_t(rsA), size_t(csA) }}, 1, nullptr);
+            matrix_operand<T> mb(dataB + offsetB, std::array<size_t, 2>{{ inner, cols }}, std::array<size_t, 2>{{ size_t(rsB), size_t(csB) }}, 1, nullptr);
+            multiply_matrices(ma, mb, output + batch * rows * cols, !small);
+        }
+    }, grain);
+    return result;
+}
+
+/** Treatment of points outside the grid in convolutions. **/
+enum class edge_mode
+{
+    constant,       // Fixed value: (k k k k | a b c d | k k k k)
+    reflect,        // Mirrored about the edge: (d c b a | a b c d | d c b a)
+    nearest         // Repeated edge value: (a a a a | a b c d | d d d d)
+};
+
+/** Position inside [0, n) taking the place of i, or -1 for the constant value. **/
+inline std::ptrdiff_t edge_index(std::ptrdiff_t i, std::ptrdiff_t n, edge_mode mode)
+{
+    if ((i >= 0) && (i < n))
+    {
+        return i;
+    }
+    switch (mode)
+    {
+    case edge_mode::constant:
+        return -1;
+    case edge_mode::nearest:
+        return (i < 0) ? 0 : (n - 1);
+    default:
+        {
+            std::ptrdiff_t period = 2 * n;
+            i %= period;
+            if (i < 0)
+            {
+                i += period;
+            }
+            return (i < n) ? i : (period - 1 - i);
+        }
+    }
+}
+
+/** Length of the row blocks in convolutions (kept in L1 cache while kernel weights are applied). **/
+constexpr size_t convolution_block_size = 1024;
+
+/** Type used to compute convolutions of T (floating point even for integer grids). **/
+template<typename T> using convolution_type = typename std::conditional<
+    std::is_floating_point<typename storage_traits<T>::compute_type>::value,
+    typename storage_traits<T>::compute_type, double>::type;
+
+/** out[i] += w * in[i] for a row (the inner loop of all convolutions). **/
+template<typename C> void add_scaled_row(C* out, const C* in, C w, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] += w * in[i];
+    }
+}
+
+/**
+  * @short 1-D convolution along one axis of a contiguous 3-D buffer.
+  *
+  * Rows along the last (contiguous) axis are always processed as a whole,
+  * so that the inner loop vectorizes. Slabs along the first axis run in parallel.
+  */
+template<typename C> void convolve_axis(const C* source, C* target, const std::array<size_t, 3>& shape, size_t axis,
+    const std::vector<C>& weights, edge_mode mode, C cval)
+{
+    const size_t ny = shape[1];
+    const size_t nx = shape[2];
+    const std::ptrdiff_t n = shape[axis];
+    const std::ptrdiff_t size = weights.size();
+    const std::ptrdiff_t origin = size / 2;
+    const std::vector<C> w(weights.rbegin(), weights.rend());    // Convolution = correlation with reversed kernel
+    const size_t grain = 1 + (1 << 16) / (ny * nx * size + 1);
+
+    parallel_for(shape[0], [&](size_t begin, size_t end) {
+        std::vector<C> line(axis == 2 ? (nx + size - 1) : 0);
+        for (size_t z = begin; z < end; z++)
+        {
+            for (size_t y = 0; y < ny; y++)
+            {
+                C* out = target + (z * ny + y) * nx;
+                std::fill(out, out + nx, C());
+                if (axis == 2)
+                {
+                    // Padded copy of the row
+                    const C* in = source + (z * ny + y) * nx;
+                    for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(line.size()); i++)
+                    {
+                        std::ptrdiff_t j = edge_index(i - origin, n, mode);
+                        line[i] = (j < 0) ? cval : in[j];
+                    }
+                    for (std::ptrdiff_t k = 0; k < size; k++)
+                    {
+                        add_scaled_row(out, line.data() + k, w[k], nx);
+                    }
+                }
+                else
+                {
+                    // Weighted sum of whole rows, in blocks
+                    const std::ptrdiff_t position = (axis == 0) ? z : y;
+                    for (size_t x = 0; x < nx; x += convolution_block_size)
+                    {
+                        size_t count = std::min(convolution_block_size, nx - x);
+                        for (std::ptrdiff_t k = 0; k < size; k++)
+                        {
+                            std::ptrdiff_t j = edge_index(position + k - origin, n, mode);
+                            if (j < 0)
+                            {
+                                const C value = w[k] * cval;
+                                for (size_t i = 0; i < count; i++)
+                                {
+                                    out[x + i] += value;
+                                }
+                                continue;
+                            }
+                            const C* in = source + ((axis == 0) ? (j * ny + y) : (z * ny + j)) * nx;
+                            add_scaled_row(out + x, in + x, w[k], count);
+                        }
+                    }
+                }
+            }
+        }
+    }, grain);
+}
+
+/** Contiguous copy of a 3-D grid (or kernel) in convolution_type. **/
+template<typename C, typename T, template<typename, size_t> class data_policy>
+    std::vector<C> convolution_input(const multi_array_base<T, 3, data_policy>& grid)
+{
+    std::vector<C> result(grid.Size());
+    const T* source = grid.DataPointer();
+    C* target = result.data();
+    make_nditer(grid.Shape(), grid.Strides(), 0, get_strides(grid.Shape()), 0).ForEach(
+        [source, target](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+            copy_strided(source + offsets[0], strides[0], target + offsets[1], strides[1], count);
+        });
+    return result;
+}
+
+template<typename T, typename C> multi_array<T, 3> convolution_output(const std::array<size_t, 3>& shape, const std::vector<C>& data)
+{
+    std::valarray<T> result(data.size());
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        result[i] = T(data[i]);
+    }
+    return multi_array<T, 3>(shape, std::move(result));
+}
+
+/**
+  * @short Separable 3-D convolution (one 1-D kernel per axis).
+  *
+  * The result has the same shape as the grid, kernels are centred
+  * at their middle element (size / 2). The axes are convolved one
+  * after another (as in scipy.ndimage), edge_mode::constant thus
+  * pads with cval in each of the passes.
+  */
+template<typename T, typename K, template<typename, size_t> class data_policy, template<typename, size_t> class data_policy0,
+    template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 3> convolve_separable(const multi_array_base<T, 3, data_policy>& grid,
+        const multi_array_base<K, 1, data_policy0>& kernel0, const multi_array_base<K, 1, data_policy1>& kernel1,
+        const multi_array_base<K, 1, data_policy2>& kernel2, edge_mode mode = edge_mode::reflect, const T& cval = T())
+{
+    using C = convolution_type<T>;
+    std::vector<C> weights[3];
+    auto copy_weights = [](std::vector<C>& w, const K* data, size_t stride, size_t size) {
+        for (size_t i = 0; i < size; i++)
+        {
+            w.push_back(C(data[std::ptrdiff_t(i) * std::ptrdiff_t(stride)]));
+        }
+    };
+    copy_weights(weights[0], kernel0.DataPointer(), kernel0.Strides()[0], kernel0.Size());
+    copy_weights(weights[1], kernel1.DataPointer(), kernel1.Strides()[0], kernel1.Size());
+    copy_weights(weights[2], kernel2.DataPointer(), kernel2.Strides()[0], kernel2.Size());
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        if (weights[axis].empty())
+        {
+            throw std::runtime_error("Empty convolution kernel.");
+        }
+    }
+
+    std::vector<C> data = convolution_input<C>(grid);
+    std::vector<C> buffer(data.size());
+    if (data.size())
+    {
+        // Contiguous axis first, so that the other passes read freshly written rows
+        for (size_t axis = 3; axis-- > 0; )
+        {
+            if ((weights[axis].size() == 1) && (weights[axis][0] == C(1)))
+            {
+                continue;
+            }
+            convolve_axis(data.data(), buffer.data(), grid.Shape(), axis, weights[axis], mode, C(cval));
+            data.swap(buffer);
+        }
+    }
+    return convolution_output<T>(grid.Shape(), data);
+}
+
+/**
+  * @short General 3-D convolution.
+  *
+  * The result has the same shape as the grid, the kernel is centred
+  * at its middle element (Shape() / 2).
+  */
+template<typename T, typename K, template<typename, size_t> class data_policy, template<typename, size_t> class data_policy2>
+    multi_array<T, 3> convolve(const multi_array_base<T, 3, data_policy>& grid, const multi_array_base<K, 3, data_policy2>& kernel,
+        edge_mode mode = edge_mode::reflect, const T& cval = T())
+{
+    using C = convolution_type<T>;
+    const std::array<size_t, 3> shape = grid.Shape();
+    const std::array<size_t, 3> kshape = kernel.Shape();
+    if (!kernel.Size())
+    {
+        throw std::runtime_error("Empty convolution kernel.");
+    }
+    std::vector<C> weights = convolution_input<C>(kernel);
+    std::reverse(weights.begin(), weights.end());      // Convolution = correlation with reversed kernel
+    std::vector<C> data = convolution_input<C>(grid);
+    std::vector<C> result(data.size());
+    if (data.empty())
+    {
+        return convolution_output<T>(shape, result);
+    }
+
+    // Copy with margins filled according to the edge mode
+    std::array<size_t, 3> padded;
+    std::array<std::ptrdiff_t, 3> origin;
+    for (size_t i = 0; i < 3; i++)
+    {
+        padded[i] = shape[i] + kshape[i] - 1;
+        origin[i] = kshape[i] / 2;
+    }
+    std::vector<C> source(get_product(padded));
+    parallel_for(padded[0], [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++)
+        {
+            std::ptrdiff_t z = edge_index(std::ptrdiff_t(p) - origin[0], shape[0], mode);
+            for (size_t q = 0; q < padded[1]; q++)
+            {
+                std::ptrdiff_t y = edge_index(std::ptrdiff_t(q) - origin[1], shape[1], mode);
+                C* row = source.data() + (p * padded[1] + q) * padded[2];
+                if ((z < 0) || (y < 0))
+                {
+                    std::fill(row, row + padded[2], C(cval));
+                    continue;
+                }
+                const C* in = data.data() + (z * shape[1] + y) * shape[2];
+                for (size_t r = 0; r < padded[2]; r++)
+                {
+                    std::ptrdiff_t x = edge_index(std::ptrdiff_t(r) - origin[2], shape[2], mode);
+                    row[r] = (x < 0) ? C(cval) : in[x];
+                }
+            }
+        }
+    });
+
+    const size_t grain = 1 + (1 << 16) / (shape[1] * shape[2] * weights.size() + 1);
+    parallel_for(shape[0], [&](size_t begin, size_t end) {
+        for (size_t z = begin; z < end; z++)
+        {
+            for (size_t y = 0; y < shape[1]; y++)
+            {
+                C* out = result.data() + (z * shape[1] + y) * shape[2];
+                for (size_t x = 0; x < shape[2]; x += convolution_block_size)
+                {
+                    size_t count = std::min(convolution_block_size, shape[2] - x);
+                    const C* w = weights.data();
+                    for (size_t a = 0; a < kshape[0]; a++)
+                    {
+                        for (size_t b = 0; b < kshape[1]; b++)
+                        {
+                            const C* in = source.data() + ((z + a) * padded[1] + y + b) * padded[2] + x;
+                            for (size_t c = 0; c < kshape[2]; c++, w++)
+                            {
+                                if (*w != C())
+                                {
+                                    add_scaled_row(out + x, in + c, *w, count);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }, grain);
+    return convolution_output<T>(shape, result);
+}
+
+/** Normalized 1-D Gaussian kernel (sigma in grid units, cut at truncate * sigma). **/
+inline multi_array<double, 1> gaussian_kernel(double sigma, double truncate = 4.0)
+{
+    if (sigma < 0)
+    {
+        throw std::runtime_error("Gaussian sigma must not be negative.");
+    }
+    size_t radius = size_t(truncate * sigma + 0.5);
+    std::valarray<double> weights(2 * radius + 1);
+    for (size_t i = 0; i < weights.size(); i++)
+    {
+        double x = double(i) - double(radius);
+        weights[i] = (radius > 0) ? std::exp(-0.5 * x * x / (sigma * sigma)) : 1.0;
+    }
+    weights /= weights.sum();
+    return multi_array<double, 1>({{ weights.size() }}, std::move(weights));
+}
+
+/** Gaussian smoothing of a 3-D grid (sigma in grid units along each axis). **/
+template<typename T, template<typename, size_t> class data_policy>
+    multi_array<T, 3> gaussian_filter(const multi_array_base<T, 3, data_policy>& grid, const std::array<double, 3>& sigma,
+        edge_mode mode = edge_mode::reflect, double truncate = 4.0)
+{
+    return convolve_separable(grid, gaussian_kernel(sigma[0], truncate), gaussian_kernel(sigma[1], truncate),
+        gaussian_kernel(sigma[2], truncate), mode);
+}
+
+template<typename T, template<typename, size_t> class data_policy>
+    multi_array<T, 3> gaussian_filter(const multi_array_base<T, 3, data_policy>& grid, double sigma,
+        edge_mode mode = edge_mode::reflect, double truncate = 4.0)
+{
+    return gaussian_filter(grid, std::array<double, 3>{{ sigma, sigma, sigma }}, mode, truncate);
+}
+
+/** Box (moving average) smoothing of a 3-D grid with size^3 boxes. **/
+template<typename T, template<typename, size_t> class data_policy>
+    multi_array<T, 3> uniform_filter(const multi_array_base<T, 3, data_policy>& grid, size_t size, edge_mode mode = edge_mode::reflect)
+{
+    if (!size)
+    {
+        throw std::runtime_error("Empty convolution kernel.");
+    }
+    multi_array<double, 1> kernel = ones<double>(size) / double(size);
+    return convolve_separable(grid, kernel, kernel, kernel, mode);
+}
+
+/** Interpolation schemes of grid_interpolator. **/
+enum class interpolation_mode
+{
+    linear,         // Trilinear, from the 2x2x2 corners of the cell
+    cubic           // Tricubic (Catmull-Rom), from the 4x4x4 neighbourhood of the cell
+};
+
+/**
+  * @short Interpolation of (vector) fields given on a regular 3-D grid.
+  *
+  * Values are stored as a contiguous (n0, n1, n2, M) array, i.e. with the M
+  * components of each grid point next to each other, so that one query reads
+  * a few cache lines. The cell containing a point is computed directly
+  * from the origin and spacing of the grid. Points outside the grid
+  * are moved to its nearest boundary.
+  */
+template<typename T, size_t M = 1> class grid_interpolator
+{
+public:
+    using point_type = std::array<T, 3>;
+    using value_type = std::array<T, M>;
+
+    static_assert(std::is_floating_point<T>::value, "Interpolation needs a floating-point type.");
+
+    /** Values at grid points (last axis = components), position of the first point and distances between points. **/
+    template<template<typename, size_t> class data_policy> grid_interpolator(const multi_array_base<T, 4, data_policy>& values,
+        const point_type& origin, const point_type& spacing, interpolation_mode mode = interpolation_mode::linear)
+        : fValues(values), fOrigin(origin), fSpacing(spacing), fMode(mode)
+    {
+        if (values.Shape()[3] != M)
+        {
+            throw std::runtime_error("Number of field components does not match.");
+        }
+        for (size_t i = 0; i < 3; i++)
+        {
+            if ((values.Shape()[i] < 2) || !(spacing[i] > 0))
+            {
+                throw std::runtime_error("Interpolation needs at least two points along each axis and positive spacing.");
+            }
+            fShape[i] = values.Shape()[i];
+            fInverseSpacing[i] = T(1) / spacing[i];
+        }
+        fStrides = {{ fShape[1] * fShape[2] * M, fShape[2] * M, M }};
+    }
+
+    const std::array<size_t, 3>& Shape() const { return fShape; }
+
+    const multi_array<T, 4>& Values() const { return fValues; }
+
+    interpolation_mode Mode() const { return fMode; }
+
+    /** Field at a point. **/
+    value_type operator()(const point_type& point) const
+    {
+        value_type result;
+        interpolate(point.data(), result.data());
+        return result;
+    }
+
+    /** Field at a batch of points (n, 3), result is (n, M). **/
+    template<template<typename, size_t> class data_policy> multi_array<T, 2> Interpolate(const multi_array_base<T, 2, data_policy>& points) const
+    {
+        if (points.Shape()[1] != 3)
+        {
+            throw std::runtime_error("Points must have three coordinates.");
+        }
+        std::valarray<T> buffer;
+        const T* source = contiguous_data(points, buffer);
+        const size_t count = points.Shape()[0];
+        std::valarray<T> result(count * M);
+        if (count)
+        {
+            T* target = &result[0];
+            parallel_for(count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    interpolate(source + 3 * i, target + M * i);
+                }
+            }, 1 << 14);
+        }
+        return multi_array<T, 2>({{ count, M }}, std::move(result));
+    }
+
+private:
+    multi_array<T, 4> fValues;
+
+    point_type fOrigin;
+
+    point_type fSpacing;
+
+    point_type fInverseSpacing;
+
+    std::array<size_t, 3> fShape;
+
+    std::array<size_t, 3> fStrides;
+
+    interpolation_mode fMode;
+
+    /** Cell index (clamped to the grid) and position inside it along an axis. **/
+    void locate(T x, size_t axis, size_t& cell, T& t) const
+    {
+        T u = (x - fOrigin[axis]) * fInverseSpacing[axis];
+        const T last = T(fShape[axis] - 1);
+        if (!(u > T(0)))
+        {
+            u = T(0);       // Also NaN
+        }
+        else if (u > last)
+        {
+            u = last;
+        }
+        cell = std::min(size_t(u), fShape[axis] - 2);
+        t = u - T(cell);
+    }
+
+    void interpolate(const T* point, T* result) const
+    {
+        std::array<size_t, 3> cell;
+        std::array<T, 3> t;
+        for (size_t i = 0; i < 3; i++)
+        {
+            locate(point[i], i, cell[i], t[i]);
+        }
+        for (size_t m = 0; m < M; m++)
+        {
+            result[m] = T(0);
+        }
+        const T* data = fValues.DataPointer();
+        if (fMode == interpolation_mode::linear)
+        {
+            const T* base = data + cell[0] * fStrides[0] + cell[1] * fStrides[1] + cell[2] * fStrides[2];
+            for (size_t corner = 0; corner < 8; corner++)
+            {
+                const size_t a = corner >> 2, b = (corner >> 1) & 1, c = corner & 1;
+                const T w = (a ? t[0] : T(1) - t[0]) * (b ? t[1] : T(1) - t[1]) * (c ? t[2] : T(1) - t[2]);
+                const T* value = base + a * fStrides[0] + b * fStrides[1] + c * fStrides[2];
+                for (size_t m = 0; m < M; m++)
+                {
+                    result[m] += w * value[m];
+                }
+            }
+        }
+        else
+        {
+            // Catmull-Rom weights and (edge-clamped) offsets of the four points along each axis
+            T weights[3][4];
+            size_t offsets[3][4];
+            for (size_t i = 0; i < 3; i++)
+            {
+                const T s = t[i], s2 = s * s, s3 = s2 * s;
+                weights[i][0] = T(0.5) * (-s3 + T(2) * s2 - s);
+                weights[i][1] = T(0.5) * (T(3) * s3 - T(5) * s2 + T(2));
+                weights[i][2] = T(0.5) * (T(-3) * s3 + T(4) * s2 + s);
+                weights[i][3] = T(0.5) * (s3 - s2);
+                for (size_t k = 0; k < 4; k++)
+                {
+                    std::ptrdiff_t j = std::ptrdiff_t(cell[i]) + std::ptrdiff_t(k) - 1;
+                    j = std::max(std::ptrdiff_t(0), std::min(j, std::ptrdiff_t(fShape[i]) - 1));
+                    offsets[i][k] = size_t(j) * fStrides[i];
+                }
+            }
+            for (size_t a = 0; a < 4; a++)
+            {
+                for (size_t b = 0; b < 4; b++)
+                {
+                    const T wab = weights[0][a] * weights[1][b];
+                    const T* row = data + offsets[0][a] + offsets[1][b];
+                    for (size_t c = 0; c < 4; c++)
+                    {
+                        const T w = wab * weights[2][c];
+                        const T* value = row + offsets[2][c];
+                        for (size_t m = 0; m < M; m++)
+                        {
+                            result[m] += w * value[m];
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+/**
+  * @short Sorted axis of points with fast location of values.
+  *
+  * Uniform (linspace-like) and log-uniform (logspace / geomspace-like)
+  * axes are detected on construction and values are located in O(1)
+  * (with a correction of the rounding against the actual points).
+  * Other axes are searched in the Eytzinger (breadth-first) layout,
+  * where the first levels of the search share a few cache lines.
+  */
+template<typename T> class table_axis
+{
+public:
+    static_assert(std::is_floating_point<T>::value, "Axis needs a floating-point type.");
+
+    template<template<typename, size_t> class data_policy> explicit table_axis(const multi_array_base<T, 1, data_policy>& points)
+        : fPoints(points), fSize(points.Size()), fScale(scale::irregular), fExact(false), fDepth(0)
+    {
+        if (fSize < 2)
+        {
+            throw std::runtime_error("Axis needs at least two points.");
+        }
+        const T* p = fPoints.DataPointer();
+        for (size_t i = 1; i < fSize; i++)
+        {
+            if (!(p[i] > p[i - 1]))
+            {
+                throw std::runtime_error("Axis points must be increasing.");
+            }
+        }
+        fFirst = p[0];
+        fLast = p[fSize - 1];
+        const T tolerance = T(1e-6);
+        const bool finite = std::isfinite(fFirst) && std::isfinite(fLast);     // Infinite edges need the search
+        if (finite && is_uniform([](T x) { return x; }, tolerance))
+        {
+            fScale = scale::uniform;
+            fInverseStep = T(fSize - 1) / (fLast - fFirst);
+            fExact = exact_steps();
+        }
+        else if (finite && (fFirst > 0) && is_uniform([](T x) { return std::log(x); }, tolerance))
+        {
+            fScale = scale::log_uniform;
+            fInverseStep = T(fSize - 1) / std::log(fLast / fFirst);
+        }
+        else
+        {
+            fTree.resize(fSize + 1);
+            fIndex.resize(fSize + 1);
+            size_t position = 0;
+            build_tree(position, 1);
+            for (fDepth = 0; (size_t(1) << fDepth) <= fSize; fDepth++) { }
+        }
+    }
+
+    size_t Size() const { return fSize; }
+
+    const multi_array<T, 1>& Points() const { return fPoints; }
+
+    bool IsUniform() const { return fScale == scale::uniform; }
+
+    bool IsLogUniform() const { return fScale == scale::log_uniform; }
+
+    /** Uniform axis whose scaled coordinates need no correction by the points (as built by uniform_axis). **/
+    bool IsExact() const { return fExact; }
+
+    /** First point and the number of intervals per unit length of a uniform axis. **/
+    T First() const { return fFirst; }
+
+    T InverseStep() const { return fInverseStep; }
+
+    /** Index i of the interval [points[i], points[i + 1]) containing x, -1 below (or NaN) and Size() - 1 above. **/
+    std::ptrdiff_t Locate(T x) const
+    {
+        if (!(x >= fFirst))
+        {
+            return -1;
+        }
+        if (x >= fLast)
+        {
+            return fSize - 1;
+        }
+        if (fScale == scale::irregular)
+        {
+            return search(x);
+        }
+        return fExact ? std::ptrdiff_t(guess(scaled(x))) : correct(x, guess(scaled(x)));
+    }
+
+    /** Locate values in a batch. **/
+    void Locate(const T* x, std::ptrdiff_t* result, size_t count) const
+    {
+        if (fScale == scale::irregular)
+        {
+            // Interleaved searches of several values hide the memory latency
+            constexpr size_t lanes = 8;
+            size_t i = 0;
+            for (; i + lanes <= count; i += lanes)
+            {
+                size_t k[lanes];
+                for (size_t j = 0; j < lanes; j++)
+                {
+                    k[j] = 1;
+                }
+                for (size_t level = 0; level < fDepth; level++)
+                {
+                    for (size_t j = 0; j < lanes; j++)
+                    {
+                        k[j] = (k[j] <= fSize) ? (2 * k[j] + (fTree[k[j]] <= x[i + j])) : k[j];
+                    }
+                }
+                for (size_t j = 0; j < lanes; j++)
+                {
+                    result[i + j] = from_tree(k[j]);
+                }
+            }
+            for (; i < count; i++)
+            {
+                result[i] = Locate(x[i]);
+            }
+            return;
+        }
+        // Scaled coordinates first (a vectorizable loop), then the rounding corrections
+        T u[storage_block_size];
+        for (size_t begin = 0; begin < count; begin += storage_block_size)
+        {
+            const size_t size = std::min(storage_block_size, count - begin);
+            const T* xs = x + begin;
+            if (fScale == scale::uniform)
+            {
+                for (size_t i = 0; i < size; i++)
+                {
+                    u[i] = (xs[i] - fFirst) * fInverseStep;
+                }
+            }
+            else
+            {
+                for (size_t i = 0; i < size; i++)
+                {
+                    u[i] = std::log(xs[i] / fFirst) * fInverseStep;
+                }
+            }
+            for (size_t i = 0; i < size; i++)
+            {
+                const T value = xs[i];
+                const std::ptrdiff_t k = fExact ? std::ptrdiff_t(guess(u[i])) : correct(value, guess(u[i]));
+                result[begin + i] = !(value >= fFirst) ? -1 : ((value >= fLast) ? std::ptrdiff_t(fSize - 1) : k);
+            }
+        }
+    }
+
+    /** Index of the interval used to interpolate at x (values outside the axis use the first / last interval). **/
+    size_t Interval(T x) const
+    {
+        std::ptrdiff_t i = Locate(x);
+        return (i < 0) ? 0 : std::min(size_t(i), fSize - 2);
+    }
+
+private:
+    enum class scale { uniform, log_uniform, irregular };
+
+    multi_array<T, 1> fPoints;
+
+    size_t fSize;
+
+    scale fScale;
+
+    T fFirst;
+
+    T fLast;
+
+    T fInverseStep;
+
+    bool fExact;
+
+    std::vector<T> fTree;           // Eytzinger layout, 1-based
+
+    std::vector<size_t> fIndex;     // Positions of the tree nodes in the points
+
+    size_t fDepth;                  // Number of levels of the tree
+
+    template<typename F> bool is_uniform(F f, T tolerance) const
+    {
+        const T* p = fPoints.DataPointer();
+        const T first = f(fFirst);
+        const T step = (f(fLast) - first) / T(fSize - 1);
+        for (size_t i = 1; i < fSize - 1; i++)
+        {
+            if (!(std::abs(f(p[i]) - (first + step * T(i))) <= tolerance * step))
+            {
+                return false;       // Also if NaN
+            }
+        }
+        return true;
+    }
+
+    /** Whether the values from each point up to the next one are scaled into its interval. **/
+    bool exact_steps() const
+    {
+        const T* p = fPoints.DataPointer();
+        for (size_t i = 1; i < fSize - 1; i++)
+        {
+            if (!(scaled(p[i]) >= T(i)) || !(scaled(std::nextafter(p[i], fFirst)) < T(i)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void build_tree(size_t& position, size_t k)
+    {
+        if (k <= fSize)
+        {
+            build_tree(position, 2 * k);
+            fTree[k] = fPoints.DataPointer()[position];
+            fIndex[k] = position++;
+            build_tree(position, 2 * k + 1);
+        }
+    }
+
+    T scaled(T x) const
+    {
+        return (fScale == scale::uniform) ? ((x - fFirst) * fInverseStep) : (std::log(x / fFirst) * fInverseStep);
+    }
+
+    size_t guess(T u) const
+    {
+        return (u > T(0)) ? std::min(size_t(u), fSize - 2) : 0;
+    }
+
+    // Moves the guess to the right interval if rounding put it into a neighbouring one
+    std::ptrdiff_t correct(T x, size_t i) const
+    {
+        const T* p = fPoints.DataPointer();
+        if (x < p[i])
+        {
+            return i - 1;
+        }
+        if (x >= p[i + 1])
+        {
+            return i + 1;
+        }
+        return i;
+    }
+
+    // Upper bound in the tree, then one interval down
+    std::ptrdiff_t search(T x) const
+    {
+        size_t k = 1;
+        while (k <= fSize)
+        {
+            prefetch_read(fTree.data() + std::min(16 * k, fSize));
+            k = 2 * k + (fTree[k] <= x);
+        }
+        return from_tree(k);
+    }
+
+    std::ptrdiff_t from_tree(size_t k) const
+    {
+        k >>= bit_ctz(~uint64_t(k)) + 1;
+        return std::ptrdiff_t(k ? fIndex[k] : fSize) - 1;
+    }
+};
+
+/** Which position searchsorted() gives to values equal to an edge. **/
+enum class search_side
+{
+    left,       // edges[i - 1] < x <= edges[i]
+    right       // edges[i - 1] <= x < edges[i]
+};
+
+/** Number of edges below x (left) or not above x (right), by a binary search without branches. **/
+template<typename T> size_t branchless_search(const T* edges, size_t n, const T& x, search_side side)
+{
+    if (!n)
+    {
+        return 0;
+    }
+    const T* base = edges;
+    size_t length = n;
+    if (side == search_side::left)
+    {
+        while (length > 1)
+        {
+            const size_t half = length / 2;
+            base = (base[half - 1] < x) ? base + half : base;
+            length -= half;
+        }
+        return size_t(base - edges) + (*base < x);
+    }
+    while (length > 1)
+    {
+        const size_t half = length / 2;
+        base = !(x < base[half - 1]) ? base + half : base;
+        length -= half;
+    }
+    return size_t(base - edges) + !(x < *base);
+}
+
+/**
+  * @short Positions where values would be inserted into the points of an axis to keep them sorted.
+  *
+  * Values are located in blocks by table_axis (directly for uniform
+  * and log-uniform points, by Eytzinger search otherwise). NaN goes last.
+  */
+template<typename T, size_t N, template<typename, size_t> class data_policy>
+    multi_array<size_t, N> searchsorted(const table_axis<T>& axis, const multi_array_base<T, N, data_policy>& values, search_side side = search_side::left)
+{
+    multi_array<size_t, N> result(values.Shape());
+    std::valarray<T> buffer;
+    const T* x = contiguous_data(values, buffer);
+    const T* points = axis.Points().DataPointer();
+    const size_t n = axis.Size();
+    size_t* output = result.DataPointer();
+    const size_t blocks = (result.Size() + storage_block_size - 1) / storage_block_size;
+    parallel_for(blocks, [&](size_t begin, size_t end) {
+        std::ptrdiff_t located[storage_block_size];
+        for (size_t block = begin; block < end; block++)
+        {
+            const size_t first = block * storage_block_size;
+            const size_t count = std::min(storage_block_size, result.Size() - first);
+            axis.Locate(x + first, located, count);
+            for (size_t i = 0; i < count; i++)
+            {
+                const T value = x[first + i];
+                const std::ptrdiff_t k = located[i];
+                const bool equal = (side == search_side::left) && (k >= 0) && (points[k] == value);
+                output[first + i] = (value != value) ? n : size_t(k + 1 - equal);
+            }
+        }
+    }, 64);
+    return result;
+}
+
+/** Positions for floating-point edges: strictly increasing ones through table_axis. **/
+template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<size_t, N> searchsorted_edges(const multi_array_base<T, 1, data_policy1>& edges, const multi_array_base<T, N, data_policy2>& values,
+        search_side side, std::true_type)
+{
+    bool increasing = edges.Size() > 1;
+    for (size_t i = 1; increasing && (i < edges.Size()); i++)
+    {
+        increasing = edges.At({ i }) > edges.At({ i - 1 });
+    }
+    if (increasing)
+    {
+        return searchsorted(table_axis<T>(edges.Copy()), values, side);
+    }
+    return searchsorted_edges(edges, values, side, std::false_type());
+}
+
+/** Positions for any sorted edges (repeated ones too) by binary search. **/
+template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<size_t, N> searchsorted_edges(const multi_array_base<T, 1, data_policy1>& edges, const multi_array_base<T, N, data_policy2>& values,
+        search_side side, std::false_type)
+{
+    const multi_array<T, 1> e = edges.Copy();
+    const T* points = e.DataPointer();
+    const size_t n = e.Size();
+    for (size_t i = 1; i < n; i++)
+    {
+        if (points[i] < points[i - 1])
+        {
+            throw std::runtime_error("Edges must be sorted.");
+        }
+    }
+    multi_array<size_t, N> result(values.Shape());
+    std::valarray<T> buffer;
+    const T* x = contiguous_data(values, buffer);
+    size_t* output = result.DataPointer();
+    parallel_for(result.Size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            output[i] = (x[i] != x[i]) ? n : branchless_search(points, n, x[i], side);
+        }
+    }, storage_block_size * 64);
+    return result;
+}
+
+/** Positions where values would be inserted into sorted edges to keep them sorted (numpy.searchsorted). **/
+template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<size_t, N> searchsorted(const multi_array_base<T, 1, data_policy1>& edges, const multi_array_base<T, N, data_policy2>& values,
+        search_side side = search_side::left)
+{
+    return searchsorted_edges(edges, values, side, std::is_floating_point<T>());
+}
+
+/**
+  * @short Indices of the bins containing values (numpy.digitize).
+  *
+  * 0 below the first edge, edges.Size() above the last one; with right,
+  * bins include their upper edge instead of the lower one.
+  */
+template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<size_t, N> digitize(const multi_array_base<T, N, data_policy1>& values, const multi_array_base<T, 1, data_policy2>& edges, bool right = false)
+{
+    return searchsorted(edges, values, right ? search_side::left : search_side::right);
+}
+
+/** Interpolation between the points of lookup_table. **/
+enum class table_interpolation
+{
+    linear,         // Linear in x and y
+    log_log         // Linear in log(x) and log(y) (power law in each interval)
+};
+
+/**
+  * @short Tabulated function of one variable (cross sections, stopping powers, ...).
+  *
+  * Pairs a table_axis with values at its points. Outside the axis,
+  * the values at its ends are returned.
+  */
+template<typename T> class lookup_table
+{
+public:
+    template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+        lookup_table(const multi_array_base<T, 1, data_policy1>& points, const multi_array_base<T, 1, data_policy2>& values,
+            table_interpolation mode = table_interpolation::linear)
+        : fAxis(points), fValues(values), fMode(mode)
+    {
+        if (values.Size() != points.Size())
+        {
+            throw std::runtime_error("Table needs one value per axis point.");
+        }
+        const T* x = fAxis.Points().DataPointer();
+        const T* y = fValues.DataPointer();
+        const size_t n = fAxis.Size();
+        fSlopes.resize(n - 1);
+        fLogSlopes.resize(n - 1);
+        for (size_t i = 0; i + 1 < n; i++)
+        {
+            fSlopes[i] = (y[i + 1] - y[i]) / (x[i + 1] - x[i]);
+            // Not usable for log-log (non-positive values) -> linear interpolation in the interval
+            bool positive = (x[i] > 0) && (y[i] > 0) && (y[i + 1] > 0);
+            fLogSlopes[i] = positive ? (std::log(y[i + 1] / y[i]) / std::log(x[i + 1] / x[i])) : std::numeric_limits<T>::quiet_NaN();
+        }
+    }
+
+    const table_axis<T>& Axis() const { return fAxis; }
+
+    const multi_array<T, 1>& Values() const { return fValues; }
+
+    table_interpolation Mode() const { return fMode; }
+
+    T operator()(T x) const
+    {
+        return evaluate(x, fAxis.Locate(x));
+    }
+
+    /** Values at a batch of points. **/
+    template<template<typename, size_t> class data_policy> multi_array<T, 1> operator()(const multi_array_base<T, 1, data_policy>& xs) const
+    {
+        const multi_array<T, 1> x = xs.Copy();
+        const size_t count = x.Size();
+        std::valarray<T> result(count);
+        if (count)
+        {
+            const T* source = x.DataPointer();
+            std::vector<std::ptrdiff_t> intervals(count);
+            fAxis.Locate(source, intervals.data(), count);
+            for (size_t i = 0; i < count; i++)
+            {
+                result[i] = evaluate(source[i], intervals[i]);
+            }
+        }
+        return multi_array<T, 1>({{ count }}, result);
+    }
+
+private:
+    table_axis<T> fAxis;
+
+    multi_array<T, 1> fValues;
+
+    table_interpolation fMode;
+
+    std::vector<T> fSlopes;
+
+    std::vector<T> fLogSlopes;
+
+    T evaluate(T x, std::ptrdiff_t i) const
+    {
+        const T* y = fValues.DataPointer();
+        const size_t n = fAxis.Size();
+        if (i < 0)
+        {
+            return y[0];
+        }
+        if (size_t(i) >= n - 1)
+        {
+            return y[n - 1];
+        }
+        const T x0 = fAxis.Points().DataPointer()[i];
+        if ((fMode == table_interpolation::log_log) && (fLogSlopes[i] == fLogSlopes[i]))
+        {
+            return y[i] * std::exp(fLogSlopes[i] * std::log(x / x0));
+        }
+        return y[i] + (x - x0) * fSlopes[i];
+    }
+};
+
+/**
+  * @short Axis of n equal bins between low and high (for histograms).
+  *
+  * The inner edges are moved (by an ulp or so) from linspace() to the first
+  * values whose scaled coordinate reaches them, so that the axis is exact.
+  */
+inline table_axis<double> uniform_axis(size_t bins, double low, double high)
+{
+    multi_array<double, 1> edges = linspace(low, high, bins + 1);
+    double* p = edges.DataPointer();
+    const double inverseStep = double(bins) / (high - low);
+    if ((high > low) && std::isfinite(inverseStep))
+    {
+        for (size_t i = 1; i < bins; i++)
+        {
+            while ((p[i] > low) && ((std::nextafter(p[i], low) - low) * inverseStep >= double(i)))
+            {
+                p[i] = std::nextafter(p[i], low);
+            }
+            while ((p[i] - low) * inverseStep < double(i))
+            {
+                p[i] = std::nextafter(p[i], high);
+            }
+        }
+    }
+    return table_axis<double>(edges);
+}
+
+/**
+  * @short N-dimensional histogram with underflow and overflow bins.
+  *
+  * Bin edges along each axis are given by a table_axis (uniform axes locate
+  * values in O(1), variable ones by search). The contents are stored in
+  * a multi_array with bins + 2 entries along each axis, the first and last
+  * of which collect values below and above the axis (or NaN, as underflow).
+  */
+template<size_t N, typename T = double> class histogram
+{
+public:
+    using axes_type = std::array<table_axis<double>, N>;
+    using point_type = std::array<double, N>;
+
+    explicit histogram(const axes_type& axes)
+        : fAxes(axes), fContents(contents_shape(axes))
+    {
+        fStrides = fContents.Strides();
+    }
+
+    /** One axis per dimension. **/
+    template<typename... Ts> explicit histogram(const table_axis<double>& axis, const Ts&... axes)
+        : histogram(axes_type{{ axis, axes... }})
+    {
+        static_assert(sizeof...(Ts) + 1 == N, "Histogram needs one axis per dimension.");
+    }
+
+    const table_axis<double>& Axis(size_t i) const { return fAxes[i]; }
+
+    /** All bins including underflow and overflow. **/
+    const multi_array<T, N>& Contents() const { return fContents; }
+
+    /** Regular bins only (a view). **/
+    multi_array_view_const<T, N> Values() const
+    {
+        std::array<size_t, N> shape;
+        size_t offset = 0;
+        for (size_t i = 0; i < N; i++)
+        {
+            shape[i] = fAxes[i].Size() - 1;
+            offset += fStrides[i];
+        }
+        return multi_array_view_const<T, N>(fContents, shape, fStrides, offset);
+    }
+
+    /** Index of the bin (in Contents()) containing a point. **/
+    std::array<size_t, N> Bin(const point_type& x) const
+    {
+        std::array<size_t, N> result;
+        for (size_t i = 0; i < N; i++)
+        {
+            result[i] = size_t(fAxes[i].Locate(x[i]) + 1);
+        }
+        return result;
+    }
+
+    void Fill(const point_type& x, const T& weight = T(1))
+    {
+        std::array<size_t, N> bin = Bin(x);
+        fContents.DataPointer()[index_unroller<0, N>::offset(fStrides, bin)] += weight;
+    }
+
+    /** Fill a batch of points (n, N). **/
+    template<template<typename, size_t> class data_policy> void Fill(const multi_array_base<double, 2, data_policy>& points)
+    {
+        fill_batch(points.DataPointer(), points.Shape(), points.Strides(), nullptr);
+    }
+
+    template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+        void Fill(const multi_array_base<double, 2, data_policy1>& points, const multi_array_base<T, 1, data_policy2>& weights)
+    {
+        if (weights.Size() != points.Shape()[0])
+        {
+            throw std::runtime_error("Histogram needs one weight per point.");
+        }
+        const multi_array<T, 1> w = weights.Copy();
+        fill_batch(points.DataPointer(), points.Shape(), points.Strides(), w.DataPointer());
+    }
+
+    /** Fill a batch of values (1-D histograms only). **/
+    template<template<typename, size_t> class data_policy> void Fill(const multi_array_base<double, 1, data_policy>& values)
+    {
+        static_assert(N == 1, "Use (n, N) arrays of points for N-dimensional histograms.");
+        fill_batch(values.DataPointer(), {{ values.Size(), 1 }}, {{ values.Strides()[0], 1 }}, nullptr);
+    }
+
+    template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+        void Fill(const multi_array_base<double, 1, data_policy1>& values, const multi_array_base<T, 1, data_policy2>& weights)
+    {
+        static_assert(N == 1, "Use (n, N) arrays of points for N-dimensional histograms.");
+        if (weights.Size() != values.Size())
+        {
+            throw std::runtime_error("Histogram needs one weight per point.");
+        }
+        const multi_array<T, 1> w = weights.Copy();
+        fill_batch(values.DataPointer(), {{ values.Size(), 1 }}, {{ values.Strides()[0], 1 }}, w.DataPointer());
+    }
+
+    void Reset()
+    {
+        fContents = T();
+    }
+
+private:
+    axes_type fAxes;
+
+    multi_array<T, N> fContents;
+
+    std::array<size_t, N> fStrides;
+
+    static std::array<size_t, N> contents_shape(const axes_type& axes)
+    {
+        std::array<size_t, N> shape;
+        for (size_t i = 0; i < N; i++)
+        {
+            shape[i] = axes[i].Size() + 1;      // Size() - 1 bins, underflow, overflow
+        }
+        return shape;
+    }
 
-public:
-    using base_type::operator=;
+    /** Bins computed for blocks of points axis by axis, then accumulated with scatter-add. **/
+    void fill_batch(const double* points, const std::array<size_t, 2>& shape, const std::array<size_t, 2>& strides, const T* weights)
+    {
+        if (shape[1] != N)
+        {
+            throw std::runtime_error("Points must have one coordinate per histogram axis.");
+        }
+        T* data = fContents.DataPointer();
+        double column[storage_block_size];
+        std::ptrdiff_t bins[storage_block_size];
+        size_t indices[storage_block_size];
+        for (size_t begin = 0; begin < shape[0]; begin += storage_block_size)
+        {
+            const size_t count = std::min(storage_block_size, shape[0] - begin);
+            std::fill(indices, indices + count, size_t(0));
+            for (size_t axis = 0; axis < N; axis++)
+            {
+                const double* source = points + std::ptrdiff_t(begin * strides[0] + axis * strides[1]);
+                copy_strided(source, std::ptrdiff_t(strides[0]), column, 1, count);
+                fAxes[axis].Locate(column, bins, count);
+                for (size_t i = 0; i < count; i++)
+                {
+                    indices[i] += size_t(bins[i] + 1) * fStrides[axis];
+                }
+            }
+            if (weights)
+            {
+                scatter_add_elements(data, indices, count, weights + begin);
+            }
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    data[indices[i]] += T(1);
+                }
+            }
+        }
+    }
+};
 
-    explicit multi_array(const index_type& shape)
-        : base_type(
-            data_type(get_product(shape)),
-            shape)
-    { }
+/** Counters per bin, filled in turn by consecutive entries, so that repeated bins do not wait for each other's stores. **/
+constexpr size_t histogram_copies = 4;
 
-    multi_array(const index_type& shape, const std::valarray<T>& data)
-        : base_type(
-            data,
-            shape)
-    {}
+/** Largest number of bins with histogram_copies counters each (they should stay in cache). **/
+constexpr size_t histogram_private_bins = 1 << 14;
 
-    multi_array(const index_type& shape, const T& value)
-        : base_type(
-            data_type(value, get_product(shape)),
-            shape)
-    { }
+/** Number of entries from which bins are filled in parallel threads. **/
+constexpr size_t histogram_parallel_threshold = 1 << 16;
 
-    multi_array(const index_type& shape, const T* data)
-        : base_type(
-            data_type(data, get_product(shape)),
-            shape)
-    { }
+/** Weight of every entry in unweighted counts. **/
+template<typename T> struct unit_weight
+{
+    T operator()(size_t) const { return T(1); }
+};
 
-    template<template <typename, size_t> class data_policy> multi_array(const multi_array_base<T, N, data_policy>& other)
-        : base_type(
-            other.Data(),
-            other.Shape()
-        )
-    { }
+/** Weights of entries from an array. **/
+template<typename T> struct array_weight
+{
+    const T* weights;
 
-    // Operators
-    template<template <typename, size_t> class data_policy> multi_array& operator*= (const multi_array_base<T, N, data_policy>& other)
+    T operator()(size_t i) const { return weights[i]; }
+};
+
+/** Bins of entries from an array of indices. **/
+template<typename I> struct array_bin
+{
+    const I* indices;
+
+    I operator()(size_t i) const { return indices[i]; }
+};
+
+template<typename I> bool negative_index(I index, std::true_type) { return index < I(); }
+
+template<typename I> bool negative_index(I, std::false_type) { return false; }
+
+/**
+  * @short Bins filled by one thread (in bincount and the histogram kernels).
+  *
+  * Up to histogram_private_bins, each bin has histogram_copies adjacent
+  * counters; entry i goes to counter i % histogram_copies. Beyond that,
+  * the counters are summed and each bin keeps a single one. The bins grow
+  * as entries with larger indices come (doubling, like std::vector).
+  */
+template<typename T> class bin_counters
+{
+public:
+    explicit bin_counters(size_t bins = 0) : fCopies(histogram_copies), fSize(0), fUsed(0)
     {
-        if (fShape != other.fShape)
+        Reserve(bins);
+    }
+
+    /** Add weight(i) to bin indices[i] for i < count; throws on negative indices. **/
+    template<typename I, typename F> void Add(const I* indices, F weight, size_t count)
+    {
+        AddMapped(array_bin<I>{ indices }, weight, count);
+    }
+
+    /** Add weight(i) to bin bin(i) for i < count (the bins computed on the fly). **/
+    template<typename G, typename F> void AddMapped(G bin, F weight, size_t count)
+    {
+        size_t i = 0;
+        while (i < count)
         {
-            throw std::runtime_error("Incompatible shapes for multiplication.");
+            i = (fCopies == histogram_copies) ? add_run<histogram_copies>(bin, weight, i, count) : add_run<1>(bin, weight, i, count);
         }
-        get_data_array() *= other.Data();
-        return *this;
     }
 
-    multi_array& operator*= (const T& other)
+    /** Bins holding entries (highest index + 1). **/
+    size_t Used() const { return fUsed; }
+
+    /** Sum of the counters of one bin (zero beyond the allocated bins). **/
+    T Total(size_t bin) const
     {
-        get_data_array() *= other;
-        return *this;
+        if (bin >= fSize)
+        {
+            return T();
+        }
+        T total = fCounts[bin * fCopies];
+        for (size_t j = 1; j < fCopies; j++)
+        {
+            total += fCounts[bin * fCopies + j];
+        }
+        return total;
     }
 
-    template<template <typename, size_t> class data_policy> multi_array& operator/= (const multi_array_base<T, N, data_policy>& other)
+    /** Make room for bins [0, bins). **/
+    void Reserve(size_t bins)
     {
-        if (fShape != other.fShape)
+        if (bins <= fSize)
         {
-            throw std::runtime_error("Incompatible shapes for division.");
+            return;
         }
-        get_data_array() /= other.Data();
-        return *this;
+        const size_t size = std::max(bins, 2 * fSize);
+        if ((fCopies > 1) && (size > histogram_private_bins))
+        {
+            std::vector<T> single(size, T());
+            for (size_t bin = 0; bin < fSize; bin++)
+            {
+                single[bin] = Total(bin);
+            }
+            fCounts.swap(single);
+            fCopies = 1;
+        }
+        else
+        {
+            fCounts.resize(size * fCopies, T());
+        }
+        fSize = size;
     }
 
-    multi_array& operator/= (const T& other)
+private:
+    std::vector<T> fCounts;
+
+    size_t fCopies;
+
+    size_t fSize;
+
+    size_t fUsed;
+
+    /** Add entries from i on with Copies counters per bin, until done or the bins must grow. **/
+    template<size_t Copies, typename G, typename F> size_t add_run(G bin, F weight, size_t i, size_t count)
     {
-        get_data_array() /= other;
-        return *this;
+        using index_type = decltype(bin(i));
+        T* counts = fCounts.data();
+        size_t used = fUsed;
+        for (; i + 4 <= count; i += 4)
+        {
+            const size_t a = size_t(bin(i)), b = size_t(bin(i + 1)), c = size_t(bin(i + 2)), d = size_t(bin(i + 3));
+            const size_t top = std::max(std::max(a, b), std::max(c, d));
+            if (top >= fSize)
+            {
+                break;      // Negative indices wrap around to large ones too
+            }
+            used = std::max(used, top + 1);
+            counts[a * Copies] += weight(i);
+            counts[b * Copies + 1 % Copies] += weight(i + 1);
+            counts[c * Copies + 2 % Copies] += weight(i + 2);
+            counts[d * Copies + 3 % Copies] += weight(i + 3);
+        }
+        fUsed = used;
+        for (size_t last = std::min(count, i + 4); i < last; i++)
+        {
+            const index_type index = bin(i);
+            if (negative_index(index, std::is_signed<index_type>()))
+            {
+                throw std::runtime_error("Bin indices must not be negative.");
+            }
+            if (size_t(index) >= fSize)
+            {
+                Reserve(size_t(index) + 1);
+                return i;       // The layout may have changed
+            }
+            fUsed = std::max(fUsed, size_t(index) + 1);
+            fCounts[size_t(index) * Copies + i % Copies] += weight(i);
+        }
+        return i;
     }
+};
 
-    template<template <typename, size_t> class data_policy> multi_array& operator+= (const multi_array_base<T, N, data_policy>& other)
-    {
-        if (fShape != other.fShape)
+/**
+  * @short Fill bins from count entries, in parallel threads for long inputs.
+  *
+  * fill(bins, begin, end) adds entries [begin, end) to a bin_counters of
+  * the given initial size. Each thread fills its own bins, summed into
+  * output (resized to the number of bins used, at least minlength)
+  * in parallel over ranges of bins.
+  */
+template<typename T, typename F> void fill_bins(std::vector<T>& output, size_t count, size_t bins, size_t minlength, F fill)
+{
+    const size_t chunks = std::min(thread_count(), count / histogram_parallel_threshold + 1);
+    std::vector<bin_counters<T>> partial(chunks, bin_counters<T>(bins));
+    parallel_for(chunks, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++)
         {
-            throw std::runtime_error("Incompatible shapes for addition.");
+            fill(partial[chunk], count * chunk / chunks, count * (chunk + 1) / chunks);
         }
-        get_data_array() += other.Data();
-        return *this;
+    });
+    size_t size = minlength;
+    for (const bin_counters<T>& p : partial)
+    {
+        size = std::max(size, p.Used());
     }
+    output.assign(size, T());
+    parallel_for(size, [&](size_t begin, size_t end) {
+        for (const bin_counters<T>& p : partial)
+        {
+            for (size_t j = begin; j < end; j++)
+            {
+                output[j] += p.Total(j);
+            }
+        }
+    }, storage_block_size * 16);
+}
 
-    multi_array& operator+= (const T& other)
+/** Number of occurrences of each non-negative integer in an array (numpy.bincount). **/
+template<typename I, size_t N, template<typename, size_t> class data_policy>
+    multi_array<size_t, 1> bincount(const multi_array_base<I, N, data_policy>& indices, size_t minlength = 0)
+{
+    static_assert(std::is_integral<I>::value, "Bincount needs integer indices.");
+    std::valarray<I> buffer;
+    const I* x = contiguous_data(indices, buffer);
+    std::vector<size_t> counts;
+    fill_bins(counts, indices.Size(), minlength, minlength, [x](bin_counters<size_t>& bins, size_t begin, size_t end) {
+        bins.Add(x + begin, unit_weight<size_t>(), end - begin);
+    });
+    return multi_array<size_t, 1>(std::array<size_t, 1>{{ counts.size() }}, counts.data());
+}
+
+/** Sum of the weights for each non-negative integer in an array. **/
+template<typename I, size_t N, typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 1> bincount(const multi_array_base<I, N, data_policy1>& indices, const multi_array_base<T, N, data_policy2>& weights, size_t minlength = 0)
+{
+    static_assert(std::is_integral<I>::value, "Bincount needs integer indices.");
+    if (weights.Shape() != indices.Shape())
     {
-        get_data_array() += other;
-        return *this;
+        throw std::runtime_error("Bincount needs one weight per index.");
     }
+    std::valarray<I> buffer;
+    std::valarray<T> weightBuffer;
+    const I* x = contiguous_data(indices, buffer);
+    const T* w = contiguous_data(weights, weightBuffer);
+    std::vector<T> sums;
+    fill_bins(sums, indices.Size(), minlength, minlength, [x, w](bin_counters<T>& bins, size_t begin, size_t end) {
+        bins.Add(x + begin, array_weight<T>{ w + begin }, end - begin);
+    });
+    return multi_array<T, 1>(std::array<size_t, 1>{{ sums.size() }}, sums.data());
+}
 
-    template<template <typename, size_t> class data_policy> multi_array& operator-= (const multi_array_base<T, N, data_policy>& other)
+/**
+  * @short Flat bin of entry i on uniform axes (size if outside).
+  *
+  * The scaled coordinate, corrected by the neighbouring points unless
+  * all axes are exact.
+  */
+template<size_t N, bool Exact> struct uniform_bins
+{
+    std::array<const double*, N> coordinates;
+
+    std::array<const double*, N> points;
+
+    std::array<double, N> first;
+
+    std::array<double, N> upper;
+
+    std::array<double, N> inverseStep;
+
+    std::array<size_t, N> top;      // Last bin (which includes the upper edge)
+
+    std::array<size_t, N> strides;
+
+    size_t size;
+
+    size_t operator()(size_t i) const
     {
-        if (fShape != other.fShape)
+        size_t index = 0;
+        for (size_t axis = 0; axis < N; axis++)
         {
-            throw std::runtime_error("Incompatible shapes for subtraction.");
+            const double value = coordinates[axis][i];
+            if (!((value >= first[axis]) && (value <= upper[axis])))
+            {
+                return size;
+            }
+            size_t k = size_t(std::min((value - first[axis]) * inverseStep[axis], double(top[axis])));
+            if (!Exact)
+            {
+                const double* p = points[axis];
+                k = std::min(k - size_t(value < p[k]) + size_t(value >= p[k + 1]), top[axis]);
+            }
+            index += k * strides[axis];
         }
-        get_data_array() -= other.Data();
-        return *this;
+        return index;
     }
+};
 
-    multi_array& operator-= (const T& other)
+/** Fill bins from coordinates on uniform axes, computing the bins while adding. **/
+template<typename T, size_t N, bool Exact> void fill_uniform_bins(std::vector<T>& bins, const std::array<const double*, N>& coordinates,
+    const std::array<table_axis<double>, N>& axes, const T* weights, size_t count)
+{
+    uniform_bins<N, Exact> scaled;
+    std::array<size_t, N> shape;
+    for (size_t axis = 0; axis < N; axis++)
     {
-        get_data_array() -= other;
-        return *this;
+        shape[axis] = axes[axis].Size() - 1;
+        scaled.points[axis] = axes[axis].Points().DataPointer();
+        scaled.first[axis] = axes[axis].First();
+        scaled.upper[axis] = scaled.points[axis][shape[axis]];
+        scaled.inverseStep[axis] = axes[axis].InverseStep();
+        scaled.top[axis] = shape[axis] - 1;
     }
+    scaled.strides = get_strides(shape);
+    scaled.size = get_product(shape);
+    fill_bins(bins, count, scaled.size + 1, scaled.size + 1, [&](bin_counters<T>& target, size_t first, size_t last) {
+        uniform_bins<N, Exact> bin = scaled;
+        for (size_t axis = 0; axis < N; axis++)
+        {
+            bin.coordinates[axis] = coordinates[axis] + first;
+        }
+        if (weights)
+        {
+            target.AddMapped(bin, array_weight<T>{ weights + first }, last - first);
+        }
+        else
+        {
+            target.AddMapped(bin, unit_weight<T>(), last - first);
+        }
+    });
+}
 
+/**
+  * @short Counts (or sums of weights) of coordinates in the bins of N axes.
+  *
+  * Entries outside the axes (or NaN) are left out; as in numpy, the last
+  * bin of each axis includes its upper edge. The flat index of a left-out
+  * entry is one past the last bin, in a bin dropped at the end. On uniform
+  * axes, the bins are computed while they are filled (without looking at
+  * the points if the axes are exact); otherwise, blocks of entries are
+  * located first.
+  */
+template<typename T, size_t N> multi_array<T, N> histogram_kernel(const std::array<const double*, N>& coordinates,
+    const std::array<table_axis<double>, N>& axes, const T* weights, size_t count)
+{
+    std::array<size_t, N> shape;
+    size_t size = 1;
+    bool uniform = true, exact = true;
+    for (size_t axis = 0; axis < N; axis++)
+    {
+        shape[axis] = axes[axis].Size() - 1;
+        size *= shape[axis];
+        uniform = uniform && axes[axis].IsUniform();
+        exact = exact && axes[axis].IsExact();
+    }
+    const std::array<size_t, N> strides = get_strides(shape);
+    std::vector<T> bins;
+    if (exact)
+    {
+        fill_uniform_bins<T, N, true>(bins, coordinates, axes, weights, count);
+    }
+    else if (uniform)
+    {
+        fill_uniform_bins<T, N, false>(bins, coordinates, axes, weights, count);
+    }
+    else
+    {
+        fill_bins(bins, count, size + 1, size + 1, [&](bin_counters<T>& target, size_t first, size_t last) {
+            std::ptrdiff_t located[storage_block_size];
+            size_t indices[storage_block_size];
+            for (size_t begin = first; begin < last; begin += storage_block_size)
+            {
+                const size_t n = std::min(storage_block_size, last - begin);
+                std::fill(indices, indices + n, size_t(0));
+                for (size_t axis = 0; axis < N; axis++)
+                {
+                    const double* x = coordinates[axis] + begin;
+                    const std::ptrdiff_t end = std::ptrdiff_t(shape[axis]);
+                    const double upper = axes[axis].Points().DataPointer()[end];
+                    axes[axis].Locate(x, located, n);
+                    for (size_t i = 0; i < n; i++)
+                    {
+                        const std::ptrdiff_t k = located[i] - ((located[i] == end) && (x[i] == upper));
+                        const bool inside = (k >= 0) && (k < end) && (indices[i] < size);
+                        indices[i] = inside ? indices[i] + size_t(k) * strides[axis] : size;
+                    }
+                }
+                if (weights)
+                {
+                    target.Add(indices, array_weight<T>{ weights + begin }, n);
+                }
+                else
+                {
+                    target.Add(indices, unit_weight<T>(), n);
+                }
+            }
+        });
+    }
+    multi_array<T, N> result(shape);
+    std::copy(bins.begin(), bins.end() - 1, result.DataPointer());
+    return result;
+}
 
-    void Write(std::ostream& os) const; // TODO: Generalize
-};
+/** Number of values in the bins of an axis (entries outside are left out). **/
+template<size_t N, template<typename, size_t> class data_policy>
+    multi_array<size_t, 1> histogram1d(const multi_array_base<double, N, data_policy>& values, const table_axis<double>& axis)
+{
+    std::valarray<double> buffer;
+    return histogram_kernel<size_t, 1>({{ contiguous_data(values, buffer) }}, {{ axis }}, nullptr, values.Size());
+}
 
-template<typename T, size_t N> class multi_array_view : public multi_array_base<T, N, array_view_impl>
+/** Sum of the weights of values in the bins of an axis. **/
+template<size_t N, typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 1> histogram1d(const multi_array_base<double, N, data_policy1>& values, const table_axis<double>& axis,
+        const multi_array_base<T, N, data_policy2>& weights)
 {
-public:
-    // Type aliases
-    #ifdef __GNUC__
-        using base_type = multi_array_base<T, N, array_view_impl>;
-    #else
-        using base_type = multi_array_base;
-    #endif
-    using typename base_type::index_type;
-    using typename base_type::data_type;    // std::valarray<T>
+    if (weights.Shape() != values.Shape())
+    {
+        throw std::runtime_error("Histogram needs one weight per point.");
+    }
+    std::valarray<double> buffer;
+    std::valarray<T> weightBuffer;
+    return histogram_kernel<T, 1>({{ contiguous_data(values, buffer) }}, {{ axis }}, contiguous_data(weights, weightBuffer), values.Size());
+}
 
-    template<typename, size_t, template<typename, size_t> typename> friend class multi_array_base;
+/** Number of values in n equal bins between low and high. **/
+template<size_t N, template<typename, size_t> class data_policy>
+    multi_array<size_t, 1> histogram1d(const multi_array_base<double, N, data_policy>& values, size_t bins, double low, double high)
+{
+    return histogram1d(values, uniform_axis(bins, low, high));
+}
 
-    // Import members
-    using base_type::operator=;
+template<size_t N, typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<T, 1> histogram1d(const multi_array_base<double, N, data_policy1>& values, size_t bins, double low, double high,
+        const multi_array_base<T, N, data_policy2>& weights)
+{
+    return histogram1d(values, uniform_axis(bins, low, high), weights);
+}
 
-    // Constructor for selecting items
-    template<template<typename, size_t> class data_policy> multi_array_view(multi_array_base<T, N+1, data_policy>& upper, size_t i)
-        : base_type(
-            upper.fData,
-            get_shape(upper, i),
-            get_strides(upper, i),
-            get_offset(upper, i)
-        )
-    { }
+/** Number of points (x[i], y[i]) in the bins of two axes. **/
+template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+    multi_array<size_t, 2> histogram2d(const multi_array_base<double, 1, data_policy1>& x, const multi_array_base<double, 1, data_policy2>& y,
+        const table_axis<double>& xAxis, const table_axis<double>& yAxis)
+{
+    if (y.Size() != x.Size())
+    {
+        throw std::runtime_error("Histogram needs the same number of coordinates along each axis.");
+    }
+    std::valarray<double> xBuffer, yBuffer;
+    return histogram_kernel<size_t, 2>({{ contiguous_data(x, xBuffer), contiguous_data(y, yBuffer) }}, {{ xAxis, yAxis }}, nullptr, x.Size());
+}
 
-protected:
-    // Import members
-    using base_type::fShape;
-    using base_type::fSize;
-    // using base_type::get_data_array;
-    using base_type::Data;
-    using base_type::set_data;
+/** Sum of the weights of points (x[i], y[i]) in the bins of two axes. **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3>
+    multi_array<T, 2> histogram2d(const multi_array_base<double, 1, data_policy1>& x, const multi_array_base<double, 1, data_policy2>& y,
+        const table_axis<double>& xAxis, const table_axis<double>& yAxis, const multi_array_base<T, 1, data_policy3>& weights)
+{
+    if ((y.Size() != x.Size()) || (weights.Size() != x.Size()))
+    {
+        throw std::runtime_error("Histogram needs the same number of coordinates along each axis.");
+    }
+    std::valarray<double> xBuffer, yBuffer;
+    std::valarray<T> weightBuffer;
+    return histogram_kernel<T, 2>({{ contiguous_data(x, xBuffer), contiguous_data(y, yBuffer) }}, {{ xAxis, yAxis }},
+        contiguous_data(weights, weightBuffer), x.Size());
+}
 
-    // TODO: Add constructor for selecting items in any axis
-    // TODO: Add constructor for selecting slices...
+/** Number of points (x[i], y[i], z[i]) in the bins of three axes. **/
+template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3>
+    multi_array<size_t, 3> histogram3d(const multi_array_base<double, 1, data_policy1>& x, const multi_array_base<double, 1, data_policy2>& y,
+        const multi_array_base<double, 1, data_policy3>& z, const table_axis<double>& xAxis, const table_axis<double>& yAxis, const table_axis<double>& zAxis)
+{
+    if ((y.Size() != x.Size()) || (z.Size() != x.Size()))
+    {
+        throw std::runtime_error("Histogram needs the same number of coordinates along each axis.");
+    }
+    std::valarray<double> xBuffer, yBuffer, zBuffer;
+    return histogram_kernel<size_t, 3>({{ contiguous_data(x, xBuffer), contiguous_data(y, yBuffer), contiguous_data(z, zBuffer) }},
+        {{ xAxis, yAxis, zAxis }}, nullptr, x.Size());
+}
 
-    // Constructor for reshaping of existing arrays
-    template<size_t M, template<typename, size_t> class data_policy> multi_array_view(multi_array_base<T, M, data_policy>& upper, const index_type& shape, const index_type& strides, size_t offset = 0)
-        : base_type(
-            upper.fData,
-            shape,
-            strides,
-            offset
-        )
-    {   }
+/** Sum of the weights of points (x[i], y[i], z[i]) in the bins of three axes. **/
+template<typename T, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2, template<typename, size_t> class data_policy3,
+    template<typename, size_t> class data_policy4>
+    multi_array<T, 3> histogram3d(const multi_array_base<double, 1, data_policy1>& x, const multi_array_base<double, 1, data_policy2>& y,
+        const multi_array_base<double, 1, data_policy3>& z, const table_axis<double>& xAxis, const table_axis<double>& yAxis, const table_axis<double>& zAxis,
+        const multi_array_base<T, 1, data_policy4>& weights)
+{
+    if ((y.Size() != x.Size()) || (z.Size() != x.Size()) || (weights.Size() != x.Size()))
+    {
+        throw std::runtime_error("Histogram needs the same number of coordinates along each axis.");
+    }
+    std::valarray<double> xBuffer, yBuffer, zBuffer;
+    std::valarray<T> weightBuffer;
+    return histogram_kernel<T, 3>({{ contiguous_data(x, xBuffer), contiguous_data(y, yBuffer), contiguous_data(z, zBuffer) }},
+        {{ xAxis, yAxis, zAxis }}, contiguous_data(weights, weightBuffer), x.Size());
+}
 
+/** How concurrent_accumulator serializes additions to the same element. **/
+enum class accumulation_mode
+{
+    atomic,             // Lock-free atomic add per element
+    striped_locks       // One of a fixed set of mutexes per group of elements
+};
+
+template<typename T, size_t N> class accumulation_cache;
+
+/**
+  * @short Thread-safe += into a shared array.
+  *
+  * Worker threads add to elements of one array without replicating it.
+  * The array is referenced, not owned, and must not be resized meanwhile.
+  * Threads depositing repeatedly into the same elements can add through
+  * an accumulation_cache (see MakeCache()) instead.
+  */
+template<typename T, size_t N> class concurrent_accumulator
+{
 public:
-    template<template <typename, size_t> class data_policy> multi_array_view& operator*= (const multi_array_base<T, N, data_policy>& other)
+    using index_type = std::array<size_t, N>;
+
+    explicit concurrent_accumulator(multi_array<T, N>& target, accumulation_mode mode = accumulation_mode::atomic, size_t stripes = 256)
+        : fTarget(target), fData(target.DataPointer()), fShape(target.Shape()), fStrides(target.Strides()), fMode(mode)
     {
-        if (fShape != other.fShape)
+#if G4MULTIARRAY_USE_THREADS
+        if (mode == accumulation_mode::striped_locks)
         {
-            throw std::runtime_error("Incompatible shapes for multiplication.");
+            size_t count = 1;
+            while (count < stripes)
+            {
+                count <<= 1;
+            }
+            fLocks = std::vector<std::mutex>(count);
         }
-        set_data(Data() * other.Data());
-        // Note: for other compilers, this should work:
-        //   get_data_array() *= other.Data();
-        //   See: https://gcc.gnu.org/bugzilla/show_bug.cgi?id=62119 - or other gcc bug related to gslice_array copy constructor
-        return *this;
+#else
+        fMode = accumulation_mode::atomic;
+#endif
     }
 
-    multi_array_view& operator*= (const T& other)
-    {
-        set_data(Data() * other);
-        return *this;
-    }
+    multi_array<T, N>& Target() { return fTarget; }
+
+    accumulation_mode Mode() const { return fMode; }
 
-    template<template <typename, size_t> class data_policy> multi_array_view& operator/= (const multi_array_base<T, N, data_policy>& other)
+    void Add(const index_type& index, const T& value)
     {
-        if (fShape != other.fShape)
+        if (bounds_checking && !index_unroller<0, N>::in_bounds(fShape, index))
         {
-            throw std::runtime_error("Incompatible shapes for division.");
+            throw std::runtime_error("Index overflow.");
         }
-        set_data(Data() / other.Data());
-        return *this;
+        AddFlat(index_unroller<0, N>::offset(fStrides, index), value);
     }
 
-    multi_array_view& operator/= (const T& other)
+    /** Add to the element at a position in data (C-order index). **/
+    void AddFlat(size_t offset, const T& value)
     {
-        set_data(Data() / other);
-        return *this;
+#if G4MULTIARRAY_USE_THREADS
+        if (fMode == accumulation_mode::striped_locks)
+        {
+            // Neighbouring elements (one cache line) share a lock
+            std::lock_guard<std::mutex> lock(fLocks[(offset / 8) & (fLocks.size() - 1)]);
+            fData[offset] += value;
+            return;
+        }
+#endif
+        atomic_add(fData + offset, value);
     }
 
-    template<template <typename, size_t> class data_policy> multi_array_view& operator+= (const multi_array_base<T, N, data_policy>& other)
+    /** Add a batch of values at C-order indices. **/
+    void AddFlat(const size_t* offsets, const T* values, size_t count)
     {
-        if (fShape != other.fShape)
+        for (size_t i = 0; i < count; i++)
         {
-            throw std::runtime_error("Incompatible shapes for addition.");
+            AddFlat(offsets[i], values[i]);
         }
-        set_data(Data() + other.Data());
-        return *this;
     }
 
-    multi_array_view& operator+= (const T& other)
+    /** A per-thread cache of partial sums, to be used by one thread only. **/
+    accumulation_cache<T, N> MakeCache(size_t capacity = 1024)
     {
-        set_data(Data() + other);
-        return *this;
+        return accumulation_cache<T, N>(*this, capacity);
     }
 
-    template<template <typename, size_t> class data_policy> multi_array_view& operator-= (const multi_array_base<T, N, data_policy>& other)
+private:
+    multi_array<T, N>& fTarget;
+
+    T* fData;
+
+    index_type fShape;
+
+    index_type fStrides;
+
+    accumulation_mode fMode;
+
+#if G4MULTIARRAY_USE_THREADS
+    std::vector<std::mutex> fLocks;
+#endif
+};
+
+/**
+  * @short Thread-local partial sums of the most recently hit elements.
+  *
+  * A direct-mapped table of (element, sum) slots: repeated deposits into
+  * the same "hot" elements are summed locally, a slot is written to
+  * the shared array only when another element claims it, on Flush()
+  * and on destruction.
+  */
+template<typename T, size_t N> class accumulation_cache
+{
+public:
+    using index_type = std::array<size_t, N>;
+
+    using compute_type = typename storage_traits<T>::compute_type;
+
+    accumulation_cache(concurrent_accumulator<T, N>& target, size_t capacity = 1024)
+        : fTarget(&target), fShape(target.Target().Shape()), fStrides(target.Target().Strides())
     {
-        if (fShape != other.fShape)
+        size_t count = 1;
+        while (count < capacity)
         {
-            throw std::runtime_error("Incompatible shapes for subtraction.");
+            count <<= 1;
         }
-        set_data(Data() - other.Data());
-        return *this;
+        fKeys.assign(count, empty_slot);
+        fSums.assign(count, compute_type());
     }
 
-    multi_array_view& operator-= (const T& other)
+    accumulation_cache(accumulation_cache&& other) = default;
+
+    accumulation_cache& operator=(accumulation_cache&& other)
     {
-        set_data(Data() - other);
+        Flush();
+        fTarget = other.fTarget;
+        fShape = other.fShape;
+        fStrides = other.fStrides;
+        fKeys = std::move(other.fKeys);
+        fSums = std::move(other.fSums);
         return *this;
     }
 
-private:
-    template<template<typename, size_t> class data_policy> static index_type get_shape(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    ~accumulation_cache()
     {
-        index_type shape;
-        for (size_t i = 0; i < N; i++)
+        Flush();
+    }
+
+    void Add(const index_type& index, const T& value)
+    {
+        if (bounds_checking && !index_unroller<0, N>::in_bounds(fShape, index))
         {
-            shape[i] = upper.fShape[i + 1];
+            throw std::runtime_error("Index overflow.");
         }
-        return shape;
+        AddFlat(index_unroller<0, N>::offset(fStrides, index), value);
     }
 
-    template<template<typename, size_t> class data_policy> static index_type get_strides(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    void AddFlat(size_t offset, const T& value)
     {
-        index_type strides;
-        for (size_t i = 0; i < N; i++)
+        const size_t slot = size_t((uint64_t(offset) * 0x9E3779B97F4A7C15ull) >> 32) & (fKeys.size() - 1);
+        if (fKeys[slot] == offset)
         {
-            strides[i] = upper.fStrides[i + 1];
+            fSums[slot] += compute_type(value);
+            return;
         }
-        return strides;
+        if (fKeys[slot] != empty_slot)
+        {
+            fTarget->AddFlat(fKeys[slot], T(fSums[slot]));
+        }
+        fKeys[slot] = offset;
+        fSums[slot] = compute_type(value);
     }
 
-    template<template<typename, size_t> class data_policy> static size_t get_offset(const multi_array_base<T, N+1, data_policy>& upper, size_t i)
+    /** Write all partial sums to the shared array. **/
+    void Flush()
     {
-        return upper.fOffset + i * upper.fStrides[0];
+        for (size_t slot = 0; slot < fKeys.size(); slot++)
+        {
+            if (fKeys[slot] != empty_slot)
+            {
+                fTarget->AddFlat(fKeys[slot], T(fSums[slot]));
+                fKeys[slot] = empty_slot;
+            }
+        }
     }
 
-};
+private:
+    static constexpr size_t empty_slot = std::numeric_limits<size_t>::max();
 
-template<typename T, size_t N> class multi_array_view_const : public multi_array_base<T, N, array_const_view_impl>
-{
-public:
-    // Type aliases
-    #ifdef __GNUC__
-        using base_type = multi_array_base<T, N, array_const_view_impl>;
-    #else
-        using base_type = multi_array_base;
-    #endif
-    using typename base_type::index_type;
-    using typename base_type::data_type;    // std::valarray<T>
+    concurrent_accumulator<T, N>* fTarget;
 
-    // Import members
-    using index_impl<N>::fStrides;
-    using index_impl<N>::fShape;
-    using index_impl<N>::fSize;
-    using index_impl<N>::fOffset;
-    using base_type::fData;
+    index_type fShape;
 
-    // Read-only view with the same properties
-    template<template<typename, size_t> class data_policy> multi_array_view_const(const multi_array_base<T, N, data_policy>& other)
-        : base_type(
-            other.fData,
-            other.fShape,
-            other.fStrides,
-            other.fOffset
-        )
-    {   }
+    index_type fStrides;
 
-    template<size_t M, template<typename, size_t> class data_policy> multi_array_view_const(const multi_array_base<T, M, data_policy>& upper, const index_type& shape, const index_type& strides, size_t offset = 0)
-        : base_type(
-            upper.fData,
-            shape,
-            strides,
-            offset
-        )
-    {   }
+    std::vector<size_t> fKeys;
+
+    std::vector<compute_type> fSums;
 };
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator* (const T& x, const multi_array_base<T, N, data_policy>& y)
-{
-    return y * x;
-}
+template<typename T, size_t N> constexpr size_t accumulation_cache<T, N>::empty_slot;
 
-/*template<typename U, typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator/ (const U& x, const multi_array_base<T, N, data_policy>& y)
+/** Statistics of the last thread_replicas::Merge(). **/
+struct merge_report
 {
-    return y * x;
-}*/
+    size_t replicas;        // Replicas created (= threads that called Local())
+    size_t levels;          // Levels of the pairwise merge tree
+    double seconds;         // Wall time of the merge
+    size_t bytes;           // Memory held by the replicas before the merge
+};
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator+ (const T& x, const multi_array_base<T, N, data_policy>& y)
+/**
+  * @short Lazily created per-thread copies of an array, merged by summation.
+  *
+  * Each thread gets its own zero-initialized replica on the first call
+  * of Local() (allocated and first touched by that thread, i.e. in its
+  * NUMA node). Threads that never ask have no replica and cost nothing
+  * in the merge. Keep the reference returned by Local() - the lookup
+  * takes a lock.
+  */
+template<typename T, size_t N> class thread_replicas
 {
-    return y + x;
-}
+public:
+    using shape_type = std::array<size_t, N>;
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator- (const T& x, const multi_array_base<T, N, data_policy>& y)
-{
-    return -y + x;
-}
+    explicit thread_replicas(const shape_type& shape) : fShape(shape), fReport() { }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> operator- (const multi_array_base<T, N, data_policy>& x)
-{
-    return T(-1) * x;
-}
+    const shape_type& Shape() const { return fShape; }
 
-template<typename T, size_t N> void multi_array<T, N>::Write(std::ostream& os) const
-{
-    os << "{";
-    size_t i = 0;
-    while (i < fSize)
+    /** Replica of the calling thread. **/
+    multi_array<T, N>& Local()
     {
-        if (i == 0)
+#if G4MULTIARRAY_USE_THREADS
+        const std::thread::id id = std::this_thread::get_id();
         {
-            for (size_t j = 0; j < N; j++)
+            std::lock_guard<std::mutex> lock(fLock);
+            for (size_t i = 0; i < fOwners.size(); i++)
             {
-                os << "[";
+                if (fOwners[i] == id)
+                {
+                    return *fReplicas[i];
+                }
             }
         }
-        else
+        std::unique_ptr<multi_array<T, N>> replica(new multi_array<T, N>(fShape));
+        std::lock_guard<std::mutex> lock(fLock);
+        fOwners.push_back(id);
+#else
+        if (!fReplicas.empty())
         {
-            for (size_t j = 0; j + 1 < N; j++)
+            return *fReplicas[0];
+        }
+        std::unique_ptr<multi_array<T, N>> replica(new multi_array<T, N>(fShape));
+#endif
+        fReplicas.push_back(std::move(replica));
+        return *fReplicas.back();
+    }
+
+    /** Number of replicas created so far. **/
+    size_t Count() const
+    {
+#if G4MULTIARRAY_USE_THREADS
+        std::lock_guard<std::mutex> lock(fLock);
+#endif
+        return fReplicas.size();
+    }
+
+    /**
+      * @short Sum of all replicas (which are released).
+      *
+      * Pairwise tree reduction: in level l, replica i + 2^l is added
+      * to replica i. Each thread merges one range of elements through
+      * all levels, so the replicas are read once and never locked.
+      */
+    multi_array<T, N> Merge()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const size_t count = fReplicas.size();
+        const size_t size = get_product(fShape);
+        fReport.replicas = count;
+        fReport.bytes = count * size * sizeof(T);
+        fReport.levels = 0;
+        if (count)
+        {
+            std::vector<T*> data(count);
+            for (size_t i = 0; i < count; i++)
             {
-                if (i % fStrides[j] == 0)
+                data[i] = fReplicas[i]->DataPointer();
+            }
+            for (size_t step = 1; step < count; step *= 2)
+            {
+                fReport.levels++;
+            }
+            parallel_for(size, [&](size_t begin, size_t end) {
+                for (size_t step = 1; step < count; step *= 2)
                 {
-                    for (size_t k = j; k + 1 < N; k++)
-                    {
-                        os << "\n";
-                    }
-                    os << "  ";
-                    for (size_t k = 0; k < j; k++)
+                    for (size_t i = 0; i + step < count; i += 2 * step)
                     {
-                        os << " ";
+                        transform_strided(data[i] + begin, 1, data[i + step] + begin, 1, end - begin,
+                            [](typename storage_traits<T>::compute_type& x, const typename storage_traits<T>::compute_type& y) { x += y; });
                     }
-                    for (size_t k = j; k + 1 < N; k++)
+                }
+            }, merge_grain_size);
+        }
+        multi_array<T, N> result = count ? std::move(*fReplicas[0]) : multi_array<T, N>(fShape);
+        fReplicas.clear();
+#if G4MULTIARRAY_USE_THREADS
+        fOwners.clear();
+#endif
+        fReport.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    /** Statistics of the last merge. **/
+    const merge_report& LastMerge() const { return fReport; }
+
+private:
+    static constexpr size_t merge_grain_size = 1 << 16;
+
+    shape_type fShape;
+
+    std::vector<std::unique_ptr<multi_array<T, N>>> fReplicas;
+
+#if G4MULTIARRAY_USE_THREADS
+    std::vector<std::thread::id> fOwners;
+
+    mutable std::mutex fLock;
+#endif
+
+    merge_report fReport;
+};
+
+/**
+  * @short Per-element mean and variance over events (Welford's algorithm).
+  *
+  * Each event contributes one value per element (e.g. the dose deposited
+  * in a voxel during the event). Only elements with non-zero values need
+  * to be passed: for each element, the number of events that hit it, their
+  * mean and the sum of squared deviations (M2) are updated in one step,
+  * stored next to each other; the zeros of the other events are accounted
+  * for analytically when the statistics are read.
+  */
+template<size_t N, typename T = double> class running_statistics
+{
+public:
+    static_assert(std::is_floating_point<T>::value, "Running statistics need a floating-point type.");
+
+    using index_type = std::array<size_t, N>;
+
+    explicit running_statistics(const index_type& shape)
+        : fShape(shape), fStrides(get_strides(shape)), fMoments(moments_shape(shape)), fEvents(0) { }
+
+    const index_type& Shape() const { return fShape; }
+
+    /** Number of events so far. **/
+    size_t Events() const { return fEvents; }
+
+    /** Add an event given by values of all elements. **/
+    template<template<typename, size_t> class data_policy> void Update(const multi_array_base<T, N, data_policy>& event)
+    {
+        if (event.Shape() != fShape)
+        {
+            throw std::runtime_error("Event must have the shape of the statistics.");
+        }
+        T* moments = fMoments.DataPointer();
+        std::array<size_t, N> momentStrides;
+        for (size_t i = 0; i < N; i++)
+        {
+            momentStrides[i] = 3 * fStrides[i];
+        }
+        make_nditer(fShape, event.Strides(), 0, momentStrides, 0).ForEach(
+            [&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+                const T* x = event.DataPointer() + offsets[0];
+                T* m = moments + offsets[1];
+                for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(count); i++)
+                {
+                    if (x[i * strides[0]] != T())
                     {
-                        os << "[";
+                        update(m + i * strides[1], x[i * strides[0]]);
                     }
-                    break;
                 }
+            });
+        fEvents++;
+    }
+
+    /** Add an event given by the (C-order) positions and values of the elements it hit (each at most once). **/
+    void Update(const size_t* offsets, const T* values, size_t count)
+    {
+        T* moments = fMoments.DataPointer();
+        const size_t size = get_product(fShape);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (bounds_checking && (offsets[i] >= size))
+            {
+                throw std::runtime_error("Index overflow.");
+            }
+            if (i + 8 < count)
+            {
+                prefetch_write(moments + 3 * offsets[i + 8]);
             }
+            update(moments + 3 * offsets[i], values[i]);
         }
+        fEvents++;
+    }
 
-        os << fData[fOffset + i];
-        i++;
+    template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+        void Update(const multi_array_base<size_t, 1, data_policy1>& offsets, const multi_array_base<T, 1, data_policy2>& values)
+    {
+        if (offsets.Size() != values.Size())
+        {
+            throw std::runtime_error("Event needs one value per element.");
+        }
+        const multi_array<size_t, 1> o = offsets.Copy();
+        const multi_array<T, 1> v = values.Copy();
+        Update(o.DataPointer(), v.DataPointer(), o.Size());
+    }
 
-        size_t j = 0;
-        // size_t k = 0;
-        for (; j + 1 < N; j++)
+    /**
+      * @short Add the events of other statistics (Chan et al.).
+      *
+      * Elements are combined in parallel threads.
+      */
+    void Merge(const running_statistics& other)
+    {
+        if (other.fShape != fShape)
         {
-            if (i % fStrides[j] == 0)
+            throw std::runtime_error("Merged statistics must have the same shape.");
+        }
+        T* a = fMoments.DataPointer();
+        const T* b = other.fMoments.DataPointer();
+        parallel_for(get_product(fShape), [a, b](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
             {
-                break;
+                const T hitsB = b[3 * i];
+                if (hitsB == T())
+                {
+                    continue;
+                }
+                const T hitsA = a[3 * i];
+                const T hits = hitsA + hitsB;
+                const T delta = b[3 * i + 1] - a[3 * i + 1];
+                a[3 * i] = hits;
+                a[3 * i + 1] += delta * hitsB / hits;
+                a[3 * i + 2] += b[3 * i + 2] + delta * delta * hitsA * hitsB / hits;
             }
+        }, 1 << 14);
+        fEvents += other.fEvents;
+    }
+
+    void Reset()
+    {
+        fMoments = T();
+        fEvents = 0;
+    }
+
+    /** Number of events with a non-zero value in an element. **/
+    size_t Hits(const index_type& index) const { return size_t(moments(index)[0]); }
+
+    T Mean(const index_type& index) const { return mean(moments(index)); }
+
+    /** Sample variance (n - 1 in the denominator, zero for fewer than two events). **/
+    T Variance(const index_type& index) const { return variance(moments(index)); }
+
+    /** Standard error of the mean (zero for fewer than two events). **/
+    T StandardError(const index_type& index) const { return standard_error(moments(index)); }
+
+    multi_array<T, N> Mean() const { return map([this](const T* m) { return mean(m); }); }
+
+    multi_array<T, N> Variance() const { return map([this](const T* m) { return variance(m); }); }
+
+    multi_array<T, N> StandardError() const { return map([this](const T* m) { return standard_error(m); }); }
+
+private:
+    index_type fShape;
+
+    index_type fStrides;
+
+    multi_array<T, N + 1> fMoments;     // (hits, mean, M2) of the non-zero values per element
+
+    size_t fEvents;
+
+    static std::array<size_t, N + 1> moments_shape(const index_type& shape)
+    {
+        std::array<size_t, N + 1> result;
+        std::copy(shape.begin(), shape.end(), result.begin());
+        result[N] = 3;
+        return result;
+    }
+
+    static void update(T* m, const T& x)
+    {
+        const T hits = m[0] + T(1);
+        const T delta = x - m[1];
+        m[0] = hits;
+        m[1] += delta / hits;
+        m[2] += delta * (x - m[1]);
+    }
+
+    const T* moments(const index_type& index) const
+    {
+        if (bounds_checking && !index_unroller<0, N>::in_bounds(fShape, index))
+        {
+            throw std::runtime_error("Index overflow.");
         }
-        for (size_t k = j; k + 1 < N; k++)
+        return fMoments.DataPointer() + 3 * index_unroller<0, N>::offset(fStrides, index);
+    }
+
+    // Hits combined with the (events - hits) zeros
+    T mean(const T* m) const
+    {
+        return fEvents ? m[0] * m[1] / T(fEvents) : T();
+    }
+
+    T variance(const T* m) const
+    {
+        if (fEvents < 2)
         {
-            os << "]";
+            return T();
         }
-        if (i != fSize)
+        const T events = T(fEvents);
+        return (m[2] + m[1] * m[1] * m[0] * (events - m[0]) / events) / (events - T(1));
+    }
+
+    T standard_error(const T* m) const
+    {
+        return fEvents ? std::sqrt(variance(m) / T(fEvents)) : T();
+    }
+
+    template<typename F> multi_array<T, N> map(F f) const
+    {
+        multi_array<T, N> result(fShape);
+        const T* m = fMoments.DataPointer();
+        T* output = result.DataPointer();
+        for (size_t i = 0; i < result.Size(); i++)
         {
-            os << ", ";
+            output[i] = f(m + 3 * i);
         }
+        return result;
     }
-    os << "]}";
-}
+};
 
-template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array<T, N>& array)
+/** Weights of one distribution checked and normalized to probabilities times n (for sampler tables). **/
+template<typename T> void normalize_weights(const T* weights, std::ptrdiff_t stride, size_t n, T* scaled)
 {
-    array.Write(os);
-    return os;
+    T total = T();
+    for (size_t i = 0; i < n; i++)
+    {
+        const T w = weights[std::ptrdiff_t(i) * stride];
+        if (!(w >= T()))
+        {
+            throw std::runtime_error("Weights must be non-negative.");
+        }
+        total += w;
+    }
+    if (!(total > T()))
+    {
+        throw std::runtime_error("Weights must not all be zero.");
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        scaled[i] = weights[std::ptrdiff_t(i) * stride] * T(n) / total;
+    }
 }
 
-template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array_view<T, N>& array)
+/**
+  * @short Common interface of the samplers of discrete distributions.
+  *
+  * The derived class (CRTP) provides the tables: build(row, weights, stride)
+  * fills those of one distribution and draw(u, offset) draws from the
+  * distribution whose tables start at offset = row * Size().
+  */
+template<typename T, typename Derived> class sampler_base
 {
-    array.Copy().Write(os);
-    return os;
-}
+public:
+    static_assert(std::is_floating_point<T>::value, "Samplers need floating-point weights.");
 
-template<typename T, size_t N> std::ostream& operator<< (std::ostream& os, const multi_array_view_const<T, N>& array)
-{
-    array.Copy().Write(os);
-    return os;
-}
+    /** Number of distributions. **/
+    size_t Rows() const { return fShape[0]; }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> abs(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::abs);
-}
+    /** Number of outcomes of each distribution. **/
+    size_t Size() const { return fShape[1]; }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> exp(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::exp);
-}
+    /** Index drawn with a uniform number u in [0, 1). **/
+    size_t operator()(T u, size_t row = 0) const
+    {
+        check_row(row);
+        return derived().draw(u, row * Size());
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> log(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::log);
-}
+    /** Indices drawn from one distribution, one per uniform number. **/
+    template<template<typename, size_t> class data_policy> multi_array<size_t, 1> Sample(const multi_array_base<T, 1, data_policy>& uniforms, size_t row = 0) const
+    {
+        check_row(row);
+        multi_array<size_t, 1> result(uniforms.Shape());
+        const T* u = uniforms.DataPointer();
+        const std::ptrdiff_t stride = std::ptrdiff_t(uniforms.Strides()[0]);
+        size_t* output = result.DataPointer();
+        const size_t offset = row * Size();
+        const Derived& sampler = derived();
+        parallel_for(result.Size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                output[i] = sampler.draw(u[std::ptrdiff_t(i) * stride], offset);
+            }
+        }, sampler_grain_size);
+        return result;
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> log10(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::log10);
-}
+    /** Indices drawn from distributions rows[i] with uniforms[i]. **/
+    template<template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2>
+        multi_array<size_t, 1> Sample(const multi_array_base<T, 1, data_policy1>& uniforms, const multi_array_base<size_t, 1, data_policy2>& rows) const
+    {
+        const size_t count = uniforms.Size();
+        if (rows.Size() != count)
+        {
+            throw std::runtime_error("Sampling needs one row per uniform number.");
+        }
+        std::valarray<T> uniformBuffer;
+        std::valarray<size_t> rowBuffer;
+        const T* u = contiguous_data(uniforms, uniformBuffer);
+        const size_t* r = contiguous_data(rows, rowBuffer);
+        if (count && (*std::max_element(r, r + count) >= Rows()))
+        {
+            throw std::runtime_error("Index overflow.");
+        }
+        multi_array<size_t, 1> result(uniforms.Shape());
+        size_t* output = result.DataPointer();
+        const size_t size = Size();
+        const Derived& sampler = derived();
+        parallel_for(count, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                output[i] = sampler.draw(u[i], r[i] * size);
+            }
+        }, sampler_grain_size);
+        return result;
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy, typename U> multi_array<T, N> pow(const multi_array_base<T, N, data_policy>& arr, const U& exponential)
-{
-    return multi_array<T, N>(arr.Shape(), std::move(std::pow(arr.Data(), T(exponential))));
-}
+    /** Rebuild the tables of one distribution with new weights (the others are kept). **/
+    template<template<typename, size_t> class data_policy> void Update(size_t row, const multi_array_base<T, 1, data_policy>& weights)
+    {
+        if ((row >= Rows()) || (weights.Size() != Size()))
+        {
+            throw std::runtime_error("Weights do not match the sampler.");
+        }
+        static_cast<Derived&>(*this).build(row, weights.DataPointer(), std::ptrdiff_t(weights.Strides()[0]));
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy, typename U> multi_array<T, N> pow(const U& base, const multi_array_base<T, N, data_policy>& arr)
-{
-    return multi_array<T, N>(arr.Shape(), std::move(std::pow(T(base), arr.Data())));
-}
+protected:
+    static constexpr size_t sampler_grain_size = 1 << 14;
 
-template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2> multi_array<T, N> pow(const multi_array_base<T, N, data_policy1>& arr1, const multi_array_base<T, N, data_policy1>& arr2)
-{
-    return multi_array<T, N>(arr1.Shape(), std::move(std::pow(arr1.Data(), arr2.Data())));
-}
+    explicit sampler_base(const std::array<size_t, 2>& shape) : fShape(shape)
+    {
+        if (!fShape[1])
+        {
+            throw std::runtime_error("Sampler needs at least one weight.");
+        }
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sqrt(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::sqrt);
-}
+    /** Tables of all distributions (called by the derived constructor). **/
+    template<template<typename, size_t> class data_policy> void build_all(const multi_array_base<T, 2, data_policy>& weights)
+    {
+        for (size_t row = 0; row < Rows(); row++)
+        {
+            static_cast<Derived&>(*this).build(row, weights.DataPointer() + std::ptrdiff_t(row * weights.Strides()[0]),
+                std::ptrdiff_t(weights.Strides()[1]));
+        }
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sin(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::sin);
-}
+private:
+    std::array<size_t, 2> fShape;
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> cos(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::cos);
-}
+    const Derived& derived() const { return static_cast<const Derived&>(*this); }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> tan(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::tan);
-}
+    void check_row(size_t row) const
+    {
+        if (row >= Rows())
+        {
+            throw std::runtime_error("Index overflow.");
+        }
+    }
+};
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> asin(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::asin);
-}
+template<typename T, typename Derived> constexpr size_t sampler_base<T, Derived>::sampler_grain_size;
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> acos(const multi_array_base<T, N, data_policy>& arr)
+/**
+  * @short Discrete distributions sampled in O(1) by the alias method.
+  *
+  * Built from a 1-D array of weights, or a 2-D array with one distribution
+  * per row. Each of the n columns is chosen uniformly and then either
+  * kept (with probability Probability()) or replaced by its alias.
+  * One uniform number in [0, 1) gives one index.
+  */
+template<typename T = double> class alias_sampler : public sampler_base<T, alias_sampler<T>>
 {
-    return arr.Apply((double(*)(double))&std::acos);
-}
+public:
+    template<template<typename, size_t> class data_policy> explicit alias_sampler(const multi_array_base<T, 1, data_policy>& weights)
+        : alias_sampler(weights.Resize(size_t(1), weights.Size()))
+    { }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> atan(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::atan);
-}
+    template<template<typename, size_t> class data_policy> explicit alias_sampler(const multi_array_base<T, 2, data_policy>& weights)
+        : sampler_base<T, alias_sampler<T>>(weights.Shape()), fProbability(weights.Shape()), fAlias(weights.Shape())
+    {
+        this->build_all(weights);
+    }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy1, template<typename, size_t> class data_policy2> multi_array<T, N> atan2(const multi_array_base<T, N, data_policy1>& arr1, const multi_array_base<T, N, data_policy2>& arr2)
-{
-    return multi_array<T, N>(arr1.Shape(), std::move(std::atan2(arr1.Data(), arr2.Data())));
-}
+    const multi_array<T, 2>& Probability() const { return fProbability; }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> sinh(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::sinh);
-}
+    const multi_array<size_t, 2>& Alias() const { return fAlias; }
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> cosh(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::cosh);
-}
+private:
+    friend class sampler_base<T, alias_sampler<T>>;
 
-template<typename T, size_t N, template<typename, size_t> class data_policy> multi_array<T, N> tanh(const multi_array_base<T, N, data_policy>& arr)
-{
-    return arr.Apply((double(*)(double))&std::tanh);
-}
+    multi_array<T, 2> fProbability;
 
-template<typename T> multi_array<T, 1> linspace(const T& start, const T& stop, size_t num, bool endpoint = true)
-{
-    std::valarray<T> data(num);
-    T step = (stop - start) / (endpoint ? (num - 1) : num);
-    for (size_t i = 0; i < num; i++)
+    multi_array<size_t, 2> fAlias;
+
+    size_t draw(T u, size_t offset) const
     {
-        data[i] = start + i * step;
+        const size_t n = this->Size();
+        const T x = u * T(n);
+        const size_t column = std::min(size_t(x), n - 1);
+        const size_t i = offset + column;
+        return (x - T(column) < fProbability.DataPointer()[i]) ? column : fAlias.DataPointer()[i];
     }
-    if (endpoint) { data[num-1] = stop; } // To make the endpoint precise
-    return { { num }, std::move(data) };
-}
-
-template<typename T> multi_array<T, 1> logspace(const T& start, const T& stop, size_t num, bool endpoint = true)
-{
-    return exp(log(10) * linspace((double)start, (double)stop, num, endpoint)).As<T>();
-}
-
-template<typename T> multi_array<T, 1> geomspace(const T& start, const T& stop, size_t num, bool endpoint = true)
-{
-    return logspace(log10((double)start), log10((double)stop), num, endpoint).As<T>();
-}
 
-template<typename T> multi_array<T, 1> arange(const T& start, const T& stop, const T& step)
-{
-    int nSteps = (stop - start) / step;
-    if ((nSteps * step + start) >= stop)
+    /** Vose's construction: outcomes below the average are topped up by those above. **/
+    void build(size_t row, const T* weights, std::ptrdiff_t stride)
     {
-        nSteps--;
+        const size_t n = this->Size();
+        T* probability = fProbability.DataPointer() + row * n;
+        size_t* alias = fAlias.DataPointer() + row * n;
+        std::vector<T> scaled(n);
+        normalize_weights(weights, stride, n, scaled.data());
+        std::vector<size_t> small, large;
+        for (size_t i = 0; i < n; i++)
+        {
+            (scaled[i] < T(1) ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty())
+        {
+            const size_t s = small.back();
+            const size_t l = large.back();
+            small.pop_back();
+            probability[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= T(1) - scaled[s];
+            if (scaled[l] < T(1))
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Remaining ones are 1 up to rounding
+        for (size_t i : large)
+        {
+            probability[i] = T(1);
+            alias[i] = i;
+        }
+        for (size_t i : small)
+        {
+            probability[i] = T(1);
+            alias[i] = i;
+        }
     }
-    return linspace(start, start + nSteps * step, nSteps+1);
-}
+};
 
-template<typename T> multi_array<T, 1> arange(const T& start, const T& stop)
+/**
+  * @short Discrete distributions sampled by the inverse CDF with a guide table.
+  *
+  * Built like alias_sampler. The guide table gives for each of n equal
+  * intervals of [0, 1) the first outcome whose CDF reaches it, so that
+  * a draw checks one or a few CDF values on average. Unlike the alias
+  * method, the draws are monotonic in u, and Position() gives
+  * a continuous position within the outcome's bin.
+  */
+template<typename T = double> class guide_table_sampler : public sampler_base<T, guide_table_sampler<T>>
 {
-    T one { 1 };
-    return arange(start, stop, one);
-}
+public:
+    template<template<typename, size_t> class data_policy> explicit guide_table_sampler(const multi_array_base<T, 1, data_policy>& weights)
+        : guide_table_sampler(weights.Resize(size_t(1), weights.Size()))
+    { }
 
-template<typename T> multi_array<T, 1> arange(const T& stop)
-{
-    T zero { 0 };
-    T one { 1 };
-    return arange(zero, stop, one);
-}
+    template<template<typename, size_t> class data_policy> explicit guide_table_sampler(const multi_array_base<T, 2, data_policy>& weights)
+        : sampler_base<T, guide_table_sampler<T>>(weights.Shape()), fCdf(weights.Shape()), fGuide(weights.Shape())
+    {
+        this->build_all(weights);
+    }
 
-template<typename T> multi_array<T, 1> asarray(const std::vector<T>& data)
-{
-    std::valarray<T> d(data.data(), data.size());
-    return multi_array<T, 1>({data.size()}, d);
-}
+    /** Normalized cumulative distributions (the last column is 1). **/
+    const multi_array<T, 2>& Cdf() const { return fCdf; }
 
-template<typename T, size_t N> multi_array<T, 1> asarray(const std::array<T, N>& data)
-{
-    std::valarray<T> d(N);
-    for (int i = 0; i < N; i++)
+    /** Index plus the position of u within the outcome's probability, in [0, Size()). **/
+    T Position(T u, size_t row = 0) const
     {
-        d[i] = data[i];
+        const size_t i = (*this)(u, row);
+        const T* cdf = fCdf.DataPointer() + row * this->Size();
+        const T low = i ? cdf[i - 1] : T();
+        const T fraction = (cdf[i] > low) ? (u - low) / (cdf[i] - low) : T();
+        return T(i) + std::min(std::max(fraction, T()), T(1));
     }
-    return multi_array<T, 1>({N}, d);
-}
 
-template<typename U, typename... Ts> multi_array<U, sizeof...(Ts)> zeros(Ts... args)
-{
-    std::array<size_t, sizeof...(Ts)> shape { args... };
-    return multi_array<U, sizeof...(Ts)>(shape);
-}
+private:
+    friend class sampler_base<T, guide_table_sampler<T>>;
 
-template<typename T, int N, template<typename, size_t> typename data_policy> multi_array<T, N> zeroslike(const multi_array_base<T, N, data_policy>& other)
-{
-    return multi_array<T, N>(other.Shape());
-}
+    multi_array<T, 2> fCdf;
 
-template<typename U, typename... Ts> multi_array<U, sizeof...(Ts)> ones(Ts... args)
-{
-    return zeros<U>(args...) + U(1);
-}
+    multi_array<size_t, 2> fGuide;
+
+    size_t draw(T u, size_t offset) const
+    {
+        const size_t n = this->Size();
+        const T* cdf = fCdf.DataPointer() + offset;
+        size_t i = fGuide.DataPointer()[offset + std::min(size_t(u * T(n)), n - 1)];
+        while ((i + 1 < n) && !(u < cdf[i]))
+        {
+            i++;
+        }
+        return i;
+    }
+
+    void build(size_t row, const T* weights, std::ptrdiff_t stride)
+    {
+        const size_t n = this->Size();
+        T* cdf = fCdf.DataPointer() + row * n;
+        size_t* guide = fGuide.DataPointer() + row * n;
+        normalize_weights(weights, stride, n, cdf);
+        scan_strided(cdf, 1, n, scan_add());
+        const T total = cdf[n - 1];
+        for (size_t i = 0; i < n; i++)
+        {
+            cdf[i] /= total;        // Exactly 1 from the last non-zero weight on
+        }
+        for (size_t g = 0, i = 0; g < n; g++)
+        {
+            // First outcome whose CDF exceeds g / n
+            while ((i + 1 < n) && !(T(g) / T(n) < cdf[i]))
+            {
+                i++;
+            }
+            guide[g] = i;
+        }
+    }
+};
 
 /**
   * @short Vectorized function.
@@ -1209,6 +7854,25 @@ private:
     function_type fWrapped;
 };
 
+/**
+  * @short Vectorized predicate, producing packed bit arrays.
+  */
+template<typename U> class ufunc_type<bool, U>
+{
+public:
+    using function_type = std::function<bool(const U&)>;
+
+    ufunc_type(function_type f) : fWrapped(f) { }
+
+    template<size_t N, template<typename, size_t> typename data_policy> bit_array<N> operator()(const multi_array_base<U, N, data_policy>& other)
+    {
+        return other.Test(fWrapped);
+    }
+
+private:
+    function_type fWrapped;
+};
+
 template<typename T, typename U>  ufunc_type<T, U> _make_vectorized(std::function<T(const U&)>& f)
 {
     return ufunc_type<T, U>(f);
@@ -3,6 +3,8 @@
 #include "../multi_array.hh"
 
 #include <vector>
+#include <cmath>
+#include <limits>
 
 using namespace std;
 
@@ -27,4 +29,1680 @@ TEST_CASE("Constructing using asarray")
 		REQUIRE(a.Shape() == expectedShape);
 		REQUIRE(a(4) == 5.0);
 	}
-}
\ No newline at end of file
+}
+
+TEST_CASE("Bit-packed boolean arrays")
+{
+	multi_array<int, 1> a = arange(100);
+
+	SECTION("Comparisons")
+	{
+		bit_array<1> m = a < 10;
+		REQUIRE(m.CountNonzero() == 10);
+		REQUIRE(m.At({9}));
+		REQUIRE(!m.At({10}));
+		REQUIRE(count_nonzero(a >= 90) == 10);
+		REQUIRE(count_nonzero(a == a) == 100);
+	}
+
+	SECTION("Logical operations")
+	{
+		bit_array<1> low = a < 50;
+		bit_array<1> even = a.Test([](int x) { return x % 2 == 0; });
+		REQUIRE((low & even).CountNonzero() == 25);
+		REQUIRE((low | even).CountNonzero() == 75);
+		REQUIRE((low ^ even).CountNonzero() == 50);
+		REQUIRE((~low).CountNonzero() == 50);
+		REQUIRE((~(low | ~low)).CountNonzero() == 0);
+		REQUIRE((low | ~low).All());
+	}
+
+	SECTION("Vectorized predicate")
+	{
+		std::function<bool(const int&)> f = [](const int& x) { return x < 3; };
+		auto isSmall = vectorize(f);
+		REQUIRE(count_nonzero(isSmall(a)) == 3);
+	}
+
+	SECTION("Masked sum")
+	{
+		bit_array<1> m = a < 10;
+		REQUIRE(a.Sum(m) == 45);
+		REQUIRE(a.Sum() == 4950);
+		REQUIRE(m.As<int>().Sum() == 10);
+	}
+
+	SECTION("Multi-dimensional")
+	{
+		multi_array<double, 2> b = linspace(0.0, 11.0, 12).Resize(3, 4);
+		bit_array<2> m = b > 5.5;
+		REQUIRE(m.CountNonzero() == 6);
+		REQUIRE(m.At({2, 0}));
+		REQUIRE(!m.At({1, 0}));
+		bit_array<2> n(m.As<bool>());
+		REQUIRE((n ^ m).CountNonzero() == 0);
+	}
+}
+
+TEST_CASE("Half-precision and bfloat16 storage")
+{
+	SECTION("Scalar conversions")
+	{
+		REQUIRE(float(float16(1.5f)) == 1.5f);
+		REQUIRE(float(float16(-65504.0f)) == -65504.0f);
+		REQUIRE(float(float16(1e6f)) == std::numeric_limits<float>::infinity());
+		REQUIRE(float(float16(std::ldexp(1.0f, -24))) == std::ldexp(1.0f, -24));
+		REQUIRE(float(float16(1.0f + std::ldexp(1.0f, -11))) == 1.0f);    // Tie rounds to even
+		REQUIRE(std::isnan(float(float16(std::nanf("")))));
+		REQUIRE(float(bfloat16(3.0f)) == 3.0f);
+		REQUIRE(float(bfloat16(1.0f + std::ldexp(1.0f, -8))) == 1.0f);   // Tie rounds to even
+		REQUIRE(std::isnan(float(bfloat16(std::nanf("")))));
+	}
+
+	SECTION("Arrays")
+	{
+		multi_array<float, 1> a = linspace(0.0f, 99.0f, 100);
+		multi_array<float16, 1> h = a.As<float16>();
+		multi_array<bfloat16, 1> b = a.As<bfloat16>();
+		REQUIRE(h.Sum() == 4950.0f);
+		REQUIRE(b.Sum() == 4950.0f);
+
+		h *= float16(2.0f);
+		h += h;
+		multi_array<float, 1> back = h.As<float>();
+		REQUIRE(back(99) == 396.0f);
+		REQUIRE(count_nonzero(h > float16(200.0f)) == 49);
+	}
+}
+
+TEST_CASE("Mask indexing")
+{
+	multi_array<double, 2> a = linspace(0.0, 11.0, 12).Resize(3, 4);
+
+	SECTION("Masked read")
+	{
+		multi_array<double, 1> selected = a[a >= 9.0];
+		REQUIRE(selected.Size() == 3);
+		REQUIRE(selected(0) == 9.0);
+		REQUIRE(selected(2) == 11.0);
+
+		const multi_array<double, 2>& constA = a;
+		REQUIRE(constA([](const double& x) { return x < 2; }).Size() == 2);
+	}
+
+	SECTION("Masked assignment")
+	{
+		a[a < 5.0] = 0.0;
+		REQUIRE(a.Sum() == 5 + 6 + 7 + 8 + 9 + 10 + 11);
+		auto isLarge = [](const double& x) { return x > 10; };
+		a[isLarge] *= 2.0;
+		REQUIRE(a.At({2, 3}) == 22.0);
+		a(a > 20.0) += 1.0;
+		REQUIRE(a.At({2, 3}) == 23.0);
+	}
+
+	SECTION("Masked assignment of values")
+	{
+		multi_array<double, 1> values = arange(3.0);
+		a[a > 8.5] = values;
+		REQUIRE(a.At({2, 1}) == 0.0);
+		REQUIRE(a.At({2, 3}) == 2.0);
+	}
+
+	SECTION("Masked assignment in a strided view")
+	{
+		auto column = a(_, 1);
+		column[column > 4.0] = -1.0;
+		REQUIRE(a.At({0, 1}) == 1.0);
+		REQUIRE(a.At({1, 1}) == -1.0);
+		REQUIRE(a.At({2, 1}) == -1.0);
+		REQUIRE(a.At({2, 2}) == 10.0);
+	}
+
+	SECTION("Large masks")
+	{
+		multi_array<float, 1> b = linspace(0.0f, 999.0f, 1000);
+		multi_array<float, 1> selected = b[(b >= 100.0f) & (b < 300.0f)];
+		REQUIRE(selected.Size() == 200);
+		REQUIRE(selected(0) == 100.0f);
+		REQUIRE(selected(199) == 299.0f);
+	}
+
+	SECTION("Where")
+	{
+		multi_array<double, 2> w = where(a > 5.0, a, -a);
+		REQUIRE(w.At({0, 1}) == -1.0);
+		REQUIRE(w.At({2, 0}) == 8.0);
+		REQUIRE(where(a > 5.0, 1.0, a).At({2, 0}) == 1.0);
+		REQUIRE(where(a > 5.0, a, 0.0).Sum() == 6 + 7 + 8 + 9 + 10 + 11);
+	}
+}
+
+TEST_CASE("Integer-array indexing")
+{
+	multi_array<double, 2> a = linspace(0.0, 11.0, 12).Resize(3, 4);
+	multi_array<size_t, 1> indices = asarray(vector<size_t>{ 2, 0, 2 });
+
+	SECTION("Take")
+	{
+		multi_array<double, 1> flat = a.Take(indices);
+		REQUIRE(flat.Size() == 3);
+		REQUIRE(flat(0) == 2.0);
+		REQUIRE(flat(1) == 0.0);
+
+		multi_array<double, 2> rows = a.Take<0>(indices);
+		array<size_t, 2> expectedShape{ 3, 4 };
+		REQUIRE(rows.Shape() == expectedShape);
+		REQUIRE(rows.At({0, 1}) == 9.0);
+		REQUIRE(rows.At({1, 1}) == 1.0);
+
+		multi_array<double, 2> columns = a.Take<1>(indices);
+		REQUIRE(columns.At({1, 0}) == 6.0);
+		REQUIRE(columns.At({1, 1}) == 4.0);
+
+		auto column = a(_, 1);
+		REQUIRE(column.Take(indices)(0) == 9.0);
+
+		multi_array<double, 1> large = linspace(0.0, 999.0, 1000);
+		multi_array<size_t, 1> many = arange<size_t>(0, 1000, 7);
+		REQUIRE(large.Take(many).Sum() == many.As<double>().Sum());
+
+		REQUIRE_THROWS(a.Take(asarray(vector<size_t>{ 12 })));
+	}
+
+	SECTION("Put and ScatterAdd")
+	{
+		a.Put(indices, 100.0);
+		REQUIRE(a.At({0, 2}) == 100.0);
+		REQUIRE(a.At({0, 1}) == 1.0);
+
+		multi_array<double, 1> values = ones<double>(3);
+		a.ScatterAdd(indices, values);
+		REQUIRE(a.At({0, 2}) == 102.0);
+		REQUIRE(a.At({0, 0}) == 101.0);
+
+		auto column = a(_, 3);
+		column.Put(asarray(vector<size_t>{ 1 }), -1.0);
+		REQUIRE(a.At({1, 3}) == -1.0);
+	}
+}
+
+TEST_CASE("Element access")
+{
+	multi_array<double, 3> a = linspace(0.0, 23.0, 24).Resize(2, 3, 4);
+
+	REQUIRE(a.At({1, 2, 3}) == 23.0);
+	REQUIRE(a.AtUnchecked({1, 2, 3}) == 23.0);
+	REQUIRE(a.AtUnchecked({1, 0, 2}) == 14.0);
+
+	a.AtUnchecked({0, 1, 1}) = -1.0;
+	REQUIRE(a.At({0, 1, 1}) == -1.0);
+
+	auto view = a(_, 1);
+	REQUIRE(view.AtUnchecked({1, 3}) == 19.0);
+
+	if (bounds_checking)
+	{
+		REQUIRE_THROWS(a.At({0, 3, 0}));
+		REQUIRE_THROWS(view.At({2, 0}));
+	}
+}
+
+TEST_CASE("N-dimensional iteration")
+{
+	multi_array<double, 3> a = linspace(0.0, 23.0, 24).Resize(2, 3, 4);
+
+	SECTION("Coalescing")
+	{
+		nditer<3, 1> contiguous(a.Shape(), {{ a.Strides() }}, {{ 0 }});
+		REQUIRE(contiguous.Dim() == 1);
+		REQUIRE(contiguous.InnerSize() == 24);
+
+		auto columns = a(_, _, _(0, 4, 2));
+		nditer<3, 1> strided(columns.Shape(), {{ columns.Strides() }}, {{ 0 }});
+		REQUIRE(strided.Dim() == 1);
+		REQUIRE(strided.InnerSize() == 12);
+
+		auto rows = a(_, _(0, 2));
+		nditer<3, 1> blocks(rows.Shape(), {{ rows.Strides() }}, {{ 0 }});
+		REQUIRE(blocks.Dim() == 2);
+		REQUIRE(blocks.InnerSize() == 8);
+
+		size_t visited = 0;
+		blocks.ForEach([&](const std::ptrdiff_t* offsets, size_t count, const std::ptrdiff_t* strides) {
+			REQUIRE(strides[0] == 1);
+			REQUIRE(offsets[0] == visited / 8 * 12);
+			visited += count;
+		});
+		REQUIRE(visited == 16);
+	}
+
+	SECTION("Operations on strided views")
+	{
+		auto columns = a(_, _, _(1, 4, 2));
+		REQUIRE(columns.Sum() == 1 + 3 + 5 + 7 + 9 + 11 + 13 + 15 + 17 + 19 + 21 + 23);
+		REQUIRE(columns.Copy().At({1, 2, 1}) == 23.0);
+
+		columns *= 2.0;
+		REQUIRE(a.At({1, 2, 3}) == 46.0);
+		REQUIRE(a.At({1, 2, 2}) == 22.0);
+
+		auto other = a(_, _, _(0, 4, 2));
+		columns -= other;
+		REQUIRE(a.At({1, 2, 3}) == 24.0);
+		REQUIRE(count_nonzero(columns > 10.0) == 7);
+		REQUIRE(columns.As<int>().Sum() == 156);
+	}
+
+	SECTION("Overlapping views")
+	{
+		multi_array<double, 1> b = arange(5.0);
+		auto head = b(_(0, 4));
+		auto tail = b(_(1, 5));
+		tail += head;
+		REQUIRE(b(4) == 7.0);
+		REQUIRE(b(1) == 1.0);
+	}
+
+	SECTION("Element-wise functions of two arrays")
+	{
+		multi_array<double, 3> p = pow(a, a(_, _, _) * 0.0 + 2.0);
+		REQUIRE(p.At({1, 2, 3}) == 529.0);
+		REQUIRE(a.Apply(a, [](double x, double y) { return x + y; }).At({1, 0, 0}) == 24.0);
+	}
+}
+
+TEST_CASE("Transposition", "[transpose]")
+{
+	multi_array<double, 3> a = arange(24.0).Resize(2, 3, 4);
+
+	SECTION("Views")
+	{
+		auto t = a.transpose();
+		REQUIRE(t.Shape() == (std::array<size_t, 3>{{4, 3, 2}}));
+		REQUIRE(t.At({3, 2, 1}) == a.At({1, 2, 3}));
+		REQUIRE(!t.IsContiguous());
+
+		auto s = a.swapaxes<0, 2>();
+		REQUIRE(s.Shape() == t.Shape());
+		REQUIRE(s.At({1, 0, 1}) == a.At({1, 0, 1}));
+
+		auto p = a.permute(1, 2, 0);
+		REQUIRE(p.Shape() == (std::array<size_t, 3>{{3, 4, 2}}));
+		REQUIRE(p.At({2, 3, 1}) == a.At({1, 2, 3}));
+		REQUIRE_THROWS(a.permute(0, 0, 1));
+
+		t.At({0, 0, 0}) = -1.0;
+		REQUIRE(a.At({0, 0, 0}) == -1.0);
+
+		const multi_array<double, 3>& c = a;
+		REQUIRE(c.transpose().transpose().Copy().At({1, 2, 3}) == a.At({1, 2, 3}));
+	}
+
+	SECTION("Contiguous copies")
+	{
+		multi_array<double, 2> m = arange(37.0 * 53.0).Resize(37, 53);
+		multi_array<double, 2> mt = m.transpose().Copy();
+		multi_array<float, 2> f = m.As<float>();
+		multi_array<float, 2> ft = f.transpose().Copy();
+		bool same = true;
+		for (size_t i = 0; i < 53; i++)
+		{
+			for (size_t j = 0; j < 37; j++)
+			{
+				same = same && (mt.At({i, j}) == m.At({j, i})) && (ft.At({i, j}) == f.At({j, i}));
+			}
+		}
+		REQUIRE(same);
+
+		multi_array<double, 3> q = a.permute(2, 0, 1).Copy();
+		REQUIRE(q.IsContiguous());
+		REQUIRE(q.At({3, 1, 2}) == a.At({1, 2, 3}));
+		REQUIRE(q.Sum() == a.Sum());
+	}
+}
+
+TEST_CASE("Broadcasting", "[broadcast]")
+{
+	multi_array<double, 3> grid = arange(24.0).Resize(2, 3, 4);
+	multi_array<double, 3> layers = arange(1.0, 3.0).Resize(2, 1, 1);
+	multi_array<double, 1> row = arange(4.0);
+
+	SECTION("Shapes")
+	{
+		REQUIRE(broadcast_shape(grid.Shape(), layers.Shape()) == grid.Shape());
+		REQUIRE(broadcast_shape(row.Shape(), layers.Shape()) == (std::array<size_t, 3>{{2, 1, 4}}));
+		REQUIRE_THROWS(broadcast_shape(grid.Shape(), arange(3.0).Shape()));
+
+		auto repeated = row.broadcast_to(grid.Shape());
+		REQUIRE(repeated.Shape() == grid.Shape());
+		REQUIRE(repeated.Strides() == (std::array<size_t, 3>{{0, 0, 1}}));
+		REQUIRE(repeated.Sum() == 36.0);
+	}
+
+	SECTION("Binary operators")
+	{
+		multi_array<double, 3> scaled = layers * grid;
+		REQUIRE(scaled.Shape() == grid.Shape());
+		REQUIRE(scaled.At({0, 2, 3}) == 11.0);
+		REQUIRE(scaled.At({1, 2, 3}) == 46.0);
+
+		multi_array<double, 3> shifted = grid - row;
+		REQUIRE(shifted.At({1, 2, 3}) == 20.0);
+
+		multi_array<double, 3> outer = layers + row;
+		REQUIRE(outer.Shape() == (std::array<size_t, 3>{{2, 1, 4}}));
+		REQUIRE(outer.At({1, 0, 3}) == 5.0);
+
+		REQUIRE_THROWS(grid * arange(3.0));
+		REQUIRE(count_nonzero(grid > row) == 20);
+		REQUIRE(pow(layers, row).At({1, 0, 3}) == 8.0);
+	}
+
+	SECTION("Compound operators")
+	{
+		grid *= layers;
+		REQUIRE(grid.At({0, 1, 1}) == 5.0);
+		REQUIRE(grid.At({1, 1, 1}) == 34.0);
+
+		auto plane = grid[0];
+		plane -= row;
+		REQUIRE(grid.At({0, 2, 3}) == 8.0);
+		REQUIRE_THROWS(row += arange(3.0));
+
+		multi_array<float16, 3> half = grid.As<float16>();
+		half /= layers.As<float16>();
+		REQUIRE(float(half.At({1, 1, 1})) == 17.0f);
+	}
+}
+
+TEST_CASE("Extended slicing", "[slicing]")
+{
+	multi_array<double, 3> a = arange(24.0).Resize(2, 3, 4);
+
+	SECTION("Negative steps and positions")
+	{
+		auto reversed = a(_, _, _(_, _, -1));
+		REQUIRE(reversed.Shape() == a.Shape());
+		REQUIRE(reversed.At({1, 2, 0}) == 23.0);
+		REQUIRE(reversed.At({0, 0, 3}) == 0.0);
+		REQUIRE(reversed.Sum() == a.Sum());
+		REQUIRE(reversed.Copy().At({0, 1, 1}) == 6.0);
+
+		auto every_other = a(_, _(-1, 0, -2));
+		REQUIRE(every_other.Shape() == (std::array<size_t, 3>{{2, 1, 4}}));
+		REQUIRE(every_other.At({1, 0, 0}) == 20.0);
+
+		auto tail = a(_, _, _(-2, 4));
+		REQUIRE(tail.Shape() == (std::array<size_t, 3>{{2, 3, 2}}));
+		REQUIRE(tail.At({0, 0, 0}) == 2.0);
+
+		REQUIRE(a(-1, -1, -1) == 23.0);
+		REQUIRE(a(_, _(2, 1)).Size() == 0);
+		REQUIRE(a(_, _(1, 100)).Shape()[1] == 2);
+		REQUIRE_THROWS(a(_, _(0, 3, 0)));
+		REQUIRE_THROWS(a(0, 0, -5));
+
+		reversed(0, 0) *= 2.0;
+		REQUIRE(a.At({0, 0, 3}) == 6.0);
+		multi_array<double, 3> flipped = a(_(_, _, -1), _(_, _, -1), _(_, _, -1));
+		REQUIRE(flipped.At({0, 0, 0}) == 23.0);
+		REQUIRE(flipped.At({1, 2, 0}) == 6.0);
+	}
+
+	SECTION("New axes and ellipsis")
+	{
+		multi_array<double, 1> x = arange(4.0);
+		auto column = x(_, newaxis);
+		REQUIRE(column.Shape() == (std::array<size_t, 2>{{4, 1}}));
+		auto row = x(newaxis, _);
+		REQUIRE(row.Shape() == (std::array<size_t, 2>{{1, 4}}));
+		multi_array<double, 2> table = column * row;
+		REQUIRE(table.At({3, 2}) == 6.0);
+
+		auto last = a(ellipsis, 3);
+		REQUIRE(last.Shape() == (std::array<size_t, 2>{{2, 3}}));
+		REQUIRE(last.At({1, 2}) == 23.0);
+		auto first = a(1, ellipsis);
+		REQUIRE(first.Shape() == (std::array<size_t, 2>{{3, 4}}));
+		auto middle = a(0, ellipsis, _(_, _, -1), newaxis);
+		REQUIRE(middle.Shape() == (std::array<size_t, 3>{{3, 4, 1}}));
+		REQUIRE(middle.At({2, 0, 0}) == 11.0);
+		REQUIRE(a(ellipsis).Shape() == a.Shape());
+	}
+}
+
+TEST_CASE("Sliding windows and axis reductions", "[windows]")
+{
+	multi_array<double, 3> a = arange(60.0).Resize(5, 4, 3);
+
+	SECTION("Reductions along axes")
+	{
+		multi_array<double, 2> planes = a.Sum<0>();
+		REQUIRE(planes.Shape() == (std::array<size_t, 2>{{4, 3}}));
+		REQUIRE(planes.At({0, 0}) == 0.0 + 12.0 + 24.0 + 36.0 + 48.0);
+
+		multi_array<double, 1> layers = a.Sum<1, 2>();
+		REQUIRE(layers.Shape()[0] == 5);
+		REQUIRE(layers(1) == 12.0 * 12.0 + 66.0);
+		REQUIRE(layers.Sum() == a.Sum());
+
+		REQUIRE(a.Max<2>().At({4, 3}) == 59.0);
+		REQUIRE((a.Min<0, 2>()(3) == 9.0));
+		REQUIRE(a.transpose().Max<0>().At({1, 2}) == a.At({2, 1, 2}));
+	}
+
+	SECTION("Box filter")
+	{
+		auto windows = a.sliding_window_view<3, 2, 3>();
+		REQUIRE(windows.Shape() == (std::array<size_t, 6>{{3, 3, 1, 3, 2, 3}}));
+		REQUIRE(windows.At({1, 2, 0, 2, 1, 0}) == a.At({3, 3, 0}));
+		REQUIRE(static_cast<const void*>(windows.DataPointer()) == static_cast<const void*>(a.DataPointer()));
+
+		multi_array<double, 3> box = windows.Sum<3, 4, 5>();
+		REQUIRE(box.Shape() == (std::array<size_t, 3>{{3, 3, 1}}));
+		bool same = true;
+		for (size_t i = 0; i < 3; i++)
+		{
+			for (size_t j = 0; j < 3; j++)
+			{
+				double expected = a(_(i, i + 3), _(j, j + 2), _).Sum();
+				same = same && (box.At({i, j, 0}) == expected);
+			}
+		}
+		REQUIRE(same);
+		REQUIRE_THROWS((a.sliding_window_view<6, 1, 1>()));
+	}
+}
+
+TEST_CASE("Convolution", "[convolution]")
+{
+	multi_array<double, 3> grid = arange(5.0 * 6.0 * 7.0).Resize(5, 6, 7);
+	grid = grid * grid;
+
+	SECTION("Edge modes")
+	{
+		REQUIRE(edge_index(-1, 4, edge_mode::reflect) == 0);
+		REQUIRE(edge_index(-2, 4, edge_mode::reflect) == 1);
+		REQUIRE(edge_index(5, 4, edge_mode::reflect) == 2);
+		REQUIRE(edge_index(9, 4, edge_mode::reflect) == 1);
+		REQUIRE(edge_index(-3, 4, edge_mode::nearest) == 0);
+		REQUIRE(edge_index(4, 4, edge_mode::constant) == -1);
+	}
+
+	SECTION("Separable and general convolution agree")
+	{
+		multi_array<double, 1> k0 = asarray(vector<double>{ 1, 2, 3 });
+		multi_array<double, 1> k1 = asarray(vector<double>{ 0.5, 1, 0.25, 2 });
+		multi_array<double, 1> k2 = asarray(vector<double>{ 1, -1, 4, 0.5, 2 });
+		multi_array<double, 3> kernel = k0(_, newaxis, newaxis) * k1(newaxis, _, newaxis) * k2(newaxis, newaxis, _);
+
+		for (edge_mode mode : { edge_mode::constant, edge_mode::reflect, edge_mode::nearest })
+		{
+			multi_array<double, 3> separable = convolve_separable(grid, k0, k1, k2, mode);
+			multi_array<double, 3> general = convolve(grid, kernel, mode);
+			REQUIRE(separable.Shape() == grid.Shape());
+			REQUIRE(count_nonzero(abs(separable - general) > 1e-9 * abs(general).Sum()) == 0);
+		}
+
+		// Non-zero padding value and a kernel viewed with a negative stride
+		multi_array<double, 1> unit = ones<double>(1);
+		multi_array<double, 3> padded = convolve_separable(grid, k0, unit, unit, edge_mode::constant, 7.0);
+		multi_array<double, 3> general = convolve(grid, k0(_, newaxis, newaxis).Copy(), edge_mode::constant, 7.0);
+		REQUIRE(count_nonzero(abs(padded - general) > 1e-9 * abs(general).Sum()) == 0);
+		multi_array<double, 1> flipped = k2(_(_, _, -1)).Copy();
+		REQUIRE(count_nonzero(convolve_separable(grid, k0, k1, k2(_(_, _, -1))) != convolve_separable(grid, k0, k1, flipped)) == 0);
+
+		// Direct evaluation of one element (convolution flips the kernel)
+		multi_array<double, 3> result = convolve(grid, kernel, edge_mode::constant, 0.0);
+		double expected = 0.0;
+		for (size_t a = 0; a < 3; a++)
+			for (size_t b = 0; b < 4; b++)
+				for (size_t c = 0; c < 5; c++)
+					expected += kernel.At({2 - a, 3 - b, 4 - c}) * grid.At({1 + a, 1 + b, 1 + c});
+		REQUIRE(result.At({2, 3, 3}) == Approx(expected));
+	}
+
+	SECTION("Smoothing")
+	{
+		multi_array<double, 3> flat = ones<double>(4, 5, 6) * 2.0;
+		REQUIRE(gaussian_filter(flat, 1.5).Sum() == Approx(240.0));
+		REQUIRE(uniform_filter(flat, 3, edge_mode::nearest).At({0, 0, 0}) == Approx(2.0));
+
+		multi_array<double, 3> box = uniform_filter(grid, 3);
+		multi_array<double, 3> windows = grid.sliding_window_view<3, 3, 3>().Sum<3, 4, 5>() / 27.0;
+		REQUIRE(box.At({1, 1, 1}) == Approx(windows.At({0, 0, 0})));
+		REQUIRE(box.At({3, 4, 5}) == Approx(windows.At({2, 3, 4})));
+
+		multi_array<double, 3> transposed = gaussian_filter(grid.transpose(), 1.0);
+		REQUIRE(transposed.At({6, 5, 4}) == Approx(gaussian_filter(grid, 1.0).At({4, 5, 6})));
+		multi_array<float, 3> single = gaussian_filter(grid.As<float>(), 1.0);
+		REQUIRE(single.At({2, 2, 2}) == Approx(gaussian_filter(grid, 1.0).At({2, 2, 2})).epsilon(1e-5));
+	}
+
+	SECTION("Parallel chunks")
+	{
+		vector<size_t> nested(1000, 0);
+		parallel_for(1000, [&](size_t begin, size_t end) {
+			const size_t threads = thread_count();
+			for (size_t i = begin; i < end; i++)
+			{
+				nested[i] = threads;
+			}
+		});
+		REQUIRE(std::count(nested.begin(), nested.end(), size_t(1)) == 1000);
+
+		REQUIRE_THROWS_AS(parallel_for(1000, [](size_t begin, size_t end) {
+			if ((begin <= 700) && (700 < end))
+			{
+				throw std::runtime_error("Chunk failed.");
+			}
+		}), std::runtime_error);
+	}
+}
+
+TEST_CASE("Grid interpolation", "[interpolation]")
+{
+	// Field linear in each coordinate: B = (x + 2y, 3z, x*y*z) on a 4 x 5 x 6 grid
+	const size_t n0 = 4, n1 = 5, n2 = 6;
+	multi_array<double, 4> field = zeros<double>(n0, n1, n2, size_t(3));
+	for (size_t i = 0; i < n0; i++)
+		for (size_t j = 0; j < n1; j++)
+			for (size_t k = 0; k < n2; k++)
+			{
+				double x = -1.0 + 0.5 * i, y = 2.0 * j, z = 0.25 * k;
+				field.At({i, j, k, 0}) = x + 2 * y;
+				field.At({i, j, k, 1}) = 3 * z;
+				field.At({i, j, k, 2}) = x * y * z;
+			}
+	grid_interpolator<double, 3> linear(field, {{ -1.0, 0.0, 0.0 }}, {{ 0.5, 2.0, 0.25 }});
+
+	SECTION("Single points")
+	{
+		std::array<double, 3> b = linear({{ -0.3, 3.1, 0.6 }});
+		REQUIRE(b[0] == Approx(-0.3 + 6.2));
+		REQUIRE(b[1] == Approx(1.8));
+		REQUIRE(b[2] == Approx(-0.3 * 3.1 * 0.6));
+
+		std::array<double, 3> corner = linear({{ 0.5, 8.0, 1.25 }});
+		REQUIRE(corner[2] == Approx(0.5 * 8.0 * 1.25));
+
+		std::array<double, 3> outside = linear({{ 10.0, -1.0, 0.5 }});
+		REQUIRE(outside[0] == Approx(0.5));
+		REQUIRE(outside[1] == Approx(1.5));
+	}
+
+	SECTION("Cubic")
+	{
+		grid_interpolator<double, 3> cubic(field, {{ -1.0, 0.0, 0.0 }}, {{ 0.5, 2.0, 0.25 }}, interpolation_mode::cubic);
+		std::array<double, 3> b = cubic({{ -0.3, 3.1, 0.6 }});
+		REQUIRE(b[0] == Approx(-0.3 + 6.2));
+		REQUIRE(b[2] == Approx(-0.3 * 3.1 * 0.6));
+		REQUIRE(cubic({{ 0.0, 4.0, 0.5 }})[2] == Approx(0.0).margin(1e-12));
+	}
+
+	SECTION("Batches")
+	{
+		multi_array<double, 2> points = asarray(vector<double>{ -0.3, 3.1, 0.6, 0.0, 4.0, 0.5, 0.2, 7.9, 1.2 }).Resize(3, 3);
+		multi_array<double, 2> values = linear.Interpolate(points);
+		REQUIRE(values.Shape() == (std::array<size_t, 2>{{3, 3}}));
+		for (size_t i = 0; i < 3; i++)
+		{
+			std::array<double, 3> expected = linear({{ points.At({i, 0}), points.At({i, 1}), points.At({i, 2}) }});
+			REQUIRE(values.At({i, 2}) == expected[2]);
+		}
+		REQUIRE(linear.Interpolate(points.transpose().transpose()).At({2, 0}) == values.At({2, 0}));
+		REQUIRE(linear.Interpolate(points(_(_, _, -1), _)).At({0, 1}) == values.At({2, 1}));
+		REQUIRE_THROWS((grid_interpolator<double, 2>(field, {{ 0.0, 0.0, 0.0 }}, {{ 1.0, 1.0, 1.0 }})));
+	}
+}
+
+TEST_CASE("Lookup tables", "[tables]")
+{
+	SECTION("Axis kinds")
+	{
+		table_axis<double> uniform(linspace(0.0, 10.0, 11));
+		REQUIRE(uniform.IsUniform());
+		REQUIRE(uniform.Locate(3.0) == 3);
+		REQUIRE(uniform.Locate(2.999) == 2);
+		REQUIRE(uniform.Locate(-0.1) == -1);
+		REQUIRE(uniform.Locate(10.0) == 10);
+		REQUIRE(uniform.Locate(std::numeric_limits<double>::quiet_NaN()) == -1);
+
+		table_axis<double> logarithmic(logspace(-3.0, 3.0, 61));
+		REQUIRE(logarithmic.IsLogUniform());
+		const double middle = logarithmic.Points().At({30});
+		REQUIRE(logarithmic.Locate(middle) == 30);
+		REQUIRE(logarithmic.Locate(std::nextafter(middle, 0.0)) == 29);
+		REQUIRE(logarithmic.Locate(0.99) == 29);
+
+		table_axis<double> irregular(asarray(vector<double>{ 0.0, 0.1, 0.5, 0.6, 2.0, 7.0, 7.5 }));
+		REQUIRE(!irregular.IsUniform());
+		REQUIRE(!irregular.IsLogUniform());
+		REQUIRE(irregular.Locate(0.55) == 2);
+		REQUIRE(irregular.Locate(0.6) == 3);
+		REQUIRE(irregular.Locate(7.4) == 5);
+		REQUIRE(irregular.Locate(-1.0) == -1);
+		REQUIRE(irregular.Locate(8.0) == 6);
+
+		REQUIRE_THROWS(table_axis<double>(asarray(vector<double>{ 1.0, 1.0, 2.0 })));
+	}
+
+	SECTION("Batched location")
+	{
+		multi_array<double, 1> points = geomspace(1.0, 1000.0, 50);
+		multi_array<double, 1> irregularPoints = points * points + arange(50.0);
+		multi_array<double, 1> xs = linspace(0.5, 2e6, 1001);
+		REQUIRE(!table_axis<double>(irregularPoints).IsLogUniform());
+		for (const table_axis<double>& axis : { table_axis<double>(points), table_axis<double>(irregularPoints) })
+		{
+			std::vector<std::ptrdiff_t> bins(xs.Size());
+			axis.Locate(xs.DataPointer(), bins.data(), xs.Size());
+			bool same = true;
+			for (size_t i = 0; i < xs.Size(); i++)
+			{
+				const double* begin = axis.Points().DataPointer();
+				std::ptrdiff_t expected = std::upper_bound(begin, begin + axis.Size(), xs(i)) - begin - 1;
+				same = same && (bins[i] == expected) && (axis.Locate(xs(i)) == expected);
+			}
+			REQUIRE(same);
+		}
+	}
+
+	SECTION("Interpolation")
+	{
+		multi_array<double, 1> energies = logspace(0.0, 4.0, 9);
+		multi_array<double, 1> sigma = pow(energies, -1.5) * 3.0;
+		lookup_table<double> linear(energies, sigma);
+		lookup_table<double> loglog(energies, sigma, table_interpolation::log_log);
+
+		REQUIRE(loglog(42.0) == Approx(3.0 * std::pow(42.0, -1.5)));
+		REQUIRE(linear(1.0) == Approx(3.0));
+		REQUIRE(linear(10.0) == Approx(3.0 * std::pow(10.0, -1.5)));
+		REQUIRE(linear(0.1) == 3.0);
+		REQUIRE(loglog(1e5) == sigma(8));
+
+		multi_array<double, 1> queries = asarray(vector<double>{ 0.5, 2.0, 42.0, 999.0, 2e4 });
+		multi_array<double, 1> values = loglog(queries);
+		for (size_t i = 0; i < 5; i++)
+		{
+			REQUIRE(values(i) == loglog(queries(i)));
+		}
+	}
+}
+
+TEST_CASE("Histograms", "[histogram]")
+{
+	SECTION("One dimension")
+	{
+		histogram<1> h(uniform_axis(10, 0.0, 5.0));
+		h.Fill({{ 0.25 }});
+		h.Fill({{ 4.99 }}, 2.0);
+		h.Fill({{ -1.0 }});
+		h.Fill({{ 5.0 }});
+		h.Fill({{ std::numeric_limits<double>::quiet_NaN() }});
+		REQUIRE(h.Contents().Shape()[0] == 12);
+		REQUIRE(h.Contents()[0] == 2.0);
+		REQUIRE(h.Contents()[11] == 1.0);
+		REQUIRE(h.Values().At({0}) == 1.0);
+		REQUIRE(h.Values().At({9}) == 2.0);
+		REQUIRE(h.Values().Sum() == 3.0);
+
+		multi_array<double, 1> values = linspace(-0.5, 5.5, 601);
+		h.Reset();
+		h.Fill(values);
+		REQUIRE(h.Contents().Sum() == 601.0);
+		REQUIRE(h.Values().At({3}) == 50.0);
+		h.Fill(values, ones<double>(601) * 0.5);
+		REQUIRE(h.Values().At({3}) == 75.0);
+	}
+
+	SECTION("Variable bins in two dimensions")
+	{
+		histogram<2, float> h(uniform_axis(4, 0.0, 4.0), table_axis<double>(asarray(vector<double>{ 0.0, 1.0, 10.0, 100.0 })));
+		REQUIRE(h.Bin({{ 2.5, 50.0 }}) == (std::array<size_t, 2>{{3, 3}}));
+		REQUIRE(h.Bin({{ -2.5, 500.0 }}) == (std::array<size_t, 2>{{0, 4}}));
+
+		multi_array<double, 2> points = asarray(vector<double>{ 0.5, 0.5, 0.5, 5.0, 3.5, 50.0, 3.5, 50.0, 9.0, 9.0 }).Resize(5, 2);
+		h.Fill(points);
+		REQUIRE(h.Values().At({0, 0}) == 1.0f);
+		REQUIRE(h.Values().At({0, 1}) == 1.0f);
+		REQUIRE(h.Values().At({3, 2}) == 2.0f);
+		REQUIRE(h.Contents().At({5, 2}) == 1.0f);
+
+		multi_array<float, 1> weights = asarray(vector<float>{ 1, 2, 3, 4, 5 });
+		h.Fill(points.transpose().Copy().transpose(), weights);
+		REQUIRE(h.Values().At({3, 2}) == 9.0f);
+		REQUIRE(h.Contents().Sum() == 20.0f);
+	}
+}
+
+TEST_CASE("Concurrent accumulation", "[accumulation]")
+{
+	const size_t threads = 4;
+	const size_t deposits = 20000;
+
+	SECTION("Atomic add")
+	{
+		double x = 1.5;
+		atomic_add(&x, 2.25);
+		REQUIRE(x == 3.75);
+		int n = 3;
+		atomic_add(&n, -5);
+		REQUIRE(n == -2);
+		float16 h(1.0f);
+		atomic_add(&h, float16(0.5f));
+		REQUIRE(float(h) == 1.5f);
+	}
+
+	SECTION("Atomic and striped-lock modes")
+	{
+		accumulation_mode modes[] = { accumulation_mode::atomic, accumulation_mode::striped_locks };
+		for (accumulation_mode mode : modes)
+		{
+			multi_array<double, 3> grid = zeros<double>(4, 4, 4);
+			concurrent_accumulator<double, 3> accumulator(grid, mode, 16);
+			vector<std::thread> workers;
+			for (size_t t = 0; t < threads; t++)
+			{
+				workers.emplace_back([&accumulator, t, deposits]() {
+					for (size_t i = 0; i < deposits; i++)
+					{
+						accumulator.Add({{ i % 4, (i / 4) % 4, t }}, 0.5);
+						accumulator.Add({{ 0, 0, 0 }}, 1.0);
+					}
+				});
+			}
+			for (auto& worker : workers)
+			{
+				worker.join();
+			}
+			REQUIRE(grid.At({0, 0, 0}) == threads * deposits + 0.5 * deposits / 16);
+			REQUIRE(grid.Sum() == threads * deposits * 1.5);
+		}
+	}
+
+	SECTION("Hot-voxel cache")
+	{
+		multi_array<int, 2> grid = zeros<int>(10, 10);
+		concurrent_accumulator<int, 2> accumulator(grid);
+		vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&accumulator, deposits]() {
+				accumulation_cache<int, 2> cache = accumulator.MakeCache(8);
+				for (size_t i = 0; i < deposits; i++)
+				{
+					cache.Add({{ (i / 100) % 10, 5 }}, 1);
+				}
+			});
+		}
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		REQUIRE(grid.Sum() == int(threads * deposits));
+		REQUIRE(grid.At({3, 5}) == int(threads * deposits / 10));
+		REQUIRE(grid.At({3, 4}) == 0);
+
+		{
+			accumulation_cache<int, 2> cache(accumulator, 4);
+			cache.AddFlat(7, 2);
+			cache.AddFlat(7, 3);
+			REQUIRE(grid.At({0, 7}) == 0);
+			cache.Flush();
+			REQUIRE(grid.At({0, 7}) == 5);
+			cache.AddFlat(7, 1);
+		}
+		REQUIRE(grid.At({0, 7}) == 6);
+	}
+}
+
+TEST_CASE("Per-thread replicas", "[replicas]")
+{
+	SECTION("Lazy replicas and tree merge")
+	{
+		thread_replicas<double, 2> replicas(std::array<size_t, 2>{{ 20, 30 }});
+		REQUIRE(replicas.Count() == 0);
+
+		const size_t threads = 5;
+		vector<std::thread> workers;
+		vector<char> same(threads);
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&replicas, &same, t]() {
+				multi_array<double, 2>& local = replicas.Local();
+				same[t] = (&local == &replicas.Local());
+				for (size_t i = 0; i < 20; i++)
+				{
+					local.At({i, t}) += double(i + 1);
+				}
+			});
+		}
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		REQUIRE(replicas.Count() == threads);
+		REQUIRE(std::count(same.begin(), same.end(), 1) == threads);
+
+		multi_array<double, 2> total = replicas.Merge();
+		REQUIRE(total.Shape() == (std::array<size_t, 2>{{ 20, 30 }}));
+		REQUIRE(total.Sum() == threads * 210.0);
+		REQUIRE(total.At({19, 4}) == 20.0);
+		REQUIRE(total.At({19, 5}) == 0.0);
+		REQUIRE(replicas.Count() == 0);
+		REQUIRE(replicas.LastMerge().replicas == threads);
+		REQUIRE(replicas.LastMerge().levels == 3);
+		REQUIRE(replicas.LastMerge().bytes == threads * 600 * sizeof(double));
+		REQUIRE(replicas.LastMerge().seconds >= 0.0);
+	}
+
+	SECTION("No replicas")
+	{
+		thread_replicas<int, 1> replicas(std::array<size_t, 1>{{ 8 }});
+		multi_array<int, 1> total = replicas.Merge();
+		REQUIRE(total.Size() == 8);
+		REQUIRE(total.Sum() == 0);
+		REQUIRE(replicas.LastMerge().levels == 0);
+
+		replicas.Local()[3] = 7;
+		REQUIRE(replicas.Merge()[3] == 7);
+	}
+}
+
+TEST_CASE("Running statistics", "[statistics]")
+{
+	// Event e deposits (e % 5) * 0.5 + 1 into element 1 of every second event, -e into element 2 always
+	const size_t events = 40;
+	auto deposit = [](size_t e, size_t i) -> double {
+		if (i == 1) return (e % 2) ? 0.0 : (e % 5) * 0.5 + 1.0;
+		if (i == 2) return -double(e);
+		return 0.0;
+	};
+	auto reference = [&](size_t i, size_t begin, size_t end, double& mean, double& variance) {
+		double sum = 0.0;
+		for (size_t e = begin; e < end; e++) sum += deposit(e, i);
+		mean = sum / (end - begin);
+		double squares = 0.0;
+		for (size_t e = begin; e < end; e++) squares += (deposit(e, i) - mean) * (deposit(e, i) - mean);
+		variance = squares / (end - begin - 1);
+	};
+
+	SECTION("Dense and sparse events")
+	{
+		running_statistics<1> dense(std::array<size_t, 1>{{ 4 }});
+		running_statistics<1> sparse(std::array<size_t, 1>{{ 4 }});
+		for (size_t e = 0; e < events; e++)
+		{
+			multi_array<double, 1> values = zeros<double>(size_t(4));
+			for (size_t i = 0; i < 4; i++) values[i] = deposit(e, i);
+			dense.Update(values);
+
+			vector<size_t> offsets;
+			vector<double> hits;
+			for (size_t i = 0; i < 4; i++)
+			{
+				if (values[i] != 0.0) { offsets.push_back(i); hits.push_back(values[i]); }
+			}
+			sparse.Update(offsets.data(), hits.data(), offsets.size());
+		}
+		REQUIRE(dense.Events() == events);
+		REQUIRE(sparse.Events() == events);
+		for (size_t i = 1; i < 3; i++)
+		{
+			double mean, variance;
+			reference(i, 0, events, mean, variance);
+			REQUIRE(dense.Mean({{ i }}) == Approx(mean));
+			REQUIRE(dense.Variance({{ i }}) == Approx(variance));
+			REQUIRE(sparse.Mean({{ i }}) == Approx(mean));
+			REQUIRE(sparse.Variance({{ i }}) == Approx(variance));
+			REQUIRE(sparse.StandardError({{ i }}) == Approx(std::sqrt(variance / events)));
+		}
+		REQUIRE(sparse.Hits({{ 1 }}) == events / 2);
+		REQUIRE(sparse.Mean({{ 0 }}) == 0.0);
+		REQUIRE(sparse.Variance({{ 3 }}) == 0.0);
+		REQUIRE(sparse.Mean().At({1}) == sparse.Mean({{ 1 }}));
+		REQUIRE(sparse.StandardError().At({2}) == sparse.StandardError({{ 2 }}));
+	}
+
+	SECTION("Merging")
+	{
+		running_statistics<2> first(std::array<size_t, 2>{{ 2, 2 }});
+		running_statistics<2> second(std::array<size_t, 2>{{ 2, 2 }});
+		for (size_t e = 0; e < events; e++)
+		{
+			multi_array<size_t, 1> offsets = asarray(vector<size_t>{ 1, 2 });
+			multi_array<double, 1> values = asarray(vector<double>{ deposit(e, 1), deposit(e, 2) });
+			(e < 15 ? first : second).Update(offsets, values);
+		}
+		first.Merge(second);
+		REQUIRE(first.Events() == events);
+		double mean, variance;
+		reference(2, 0, events, mean, variance);
+		REQUIRE(first.Mean({{ 1, 0 }}) == Approx(mean));
+		REQUIRE(first.Variance({{ 1, 0 }}) == Approx(variance));
+		reference(1, 0, events, mean, variance);
+		REQUIRE(first.Mean({{ 0, 1 }}) == Approx(mean));
+		REQUIRE(first.Variance({{ 0, 1 }}) == Approx(variance));
+
+		first.Reset();
+		REQUIRE(first.Events() == 0);
+		REQUIRE(first.Mean({{ 0, 1 }}) == 0.0);
+		REQUIRE(first.StandardError({{ 0, 1 }}) == 0.0);
+		REQUIRE(first.StandardError().Sum() == 0.0);
+
+		first.Update(asarray(vector<size_t>{ 1 }), asarray(vector<double>{ 2.0 }));
+		REQUIRE(first.Variance({{ 0, 1 }}) == 0.0);
+		REQUIRE(first.StandardError({{ 0, 1 }}) == 0.0);
+	}
+}
+
+namespace
+{
+	struct three_vector { double x, y, z; };
+
+	struct padded_vector { double x, y, z, w; };
+}
+
+TEST_CASE("Batched 3-vectors", "[vectors]")
+{
+	SECTION("Adopting arrays of vector structs")
+	{
+		vector<three_vector> points{ { 1, 2, 3 }, { 4, 5, 6 } };
+		multi_array_view<double, 2> view = as_vectors(points.data(), points.size());
+		REQUIRE(view.Shape() == (std::array<size_t, 2>{{ 2, 3 }}));
+		REQUIRE(view.At({1, 2}) == 6.0);
+		view.At({0, 1}) = 7.0;
+		REQUIRE(points[0].y == 7.0);
+
+		const padded_vector padded[2] = { { 1, 2, 3, -1 }, { 4, 5, 6, -1 } };
+		multi_array_view_const<double, 2> constView = as_vectors(padded, 2);
+		REQUIRE(constView.Strides()[0] == 4);
+		REQUIRE(constView.At({1, 0}) == 4.0);
+		REQUIRE(constView.Sum() == 21.0);
+
+		double raw[6] = { 1, 2, 3, 4, 5, 6 };
+		multi_array_view<double, 2> rawView(raw, {{ 3, 2 }});
+		REQUIRE(rawView.At({2, 1}) == 6.0);
+	}
+
+	SECTION("Rotation and translation")
+	{
+		multi_array<double, 2> rz = asarray(vector<double>{ 0, -1, 0, 1, 0, 0, 0, 0, 1 }).Resize(3, 3);
+		multi_array<double, 2> points = arange(3000.0).Resize(1000, 3);
+		multi_array<double, 2> rotated = rotate(rz, points);
+		REQUIRE(rotated.At({999, 0}) == -2998.0);
+		REQUIRE(rotated.At({999, 1}) == 2997.0);
+		REQUIRE(rotated.At({999, 2}) == 2999.0);
+
+		multi_array<double, 2> moved = affine_transform(rz, {{ 1.0, 2.0, 3.0 }}, points);
+		REQUIRE(moved.At({1, 0}) == -3.0);
+		REQUIRE(moved.At({1, 1}) == 5.0);
+		REQUIRE(moved.At({1, 2}) == 8.0);
+
+		// Back to the local frame with the inverse (transposed) rotation
+		multi_array<double, 2> back = rotate(rz.transpose(), rotated);
+		REQUIRE(back.At({500, 1}) == points.At({500, 1}));
+
+		vector<three_vector> structs(1000);
+		as_vectors(structs.data(), structs.size()) = points;
+		REQUIRE(rotate(rz, as_vectors(structs.data(), structs.size())).At({999, 0}) == -2998.0);
+	}
+
+	SECTION("Products and normalization")
+	{
+		multi_array<float, 2> a = asarray(vector<float>{ 1, 0, 0, 0, 3, 4 }).Resize(2, 3);
+		multi_array<float, 2> b = asarray(vector<float>{ 0, 1, 0, 0, 1, 0 }).Resize(2, 3);
+		multi_array<float, 2> c = cross(a, b);
+		REQUIRE(c.At({0, 2}) == 1.0f);
+		REQUIRE(c.At({1, 0}) == -4.0f);
+		REQUIRE(vector_dot(a, b).At({1}) == 3.0f);
+		REQUIRE(vector_norm(a).At({1}) == 5.0f);
+		multi_array<float, 2> unit = normalize(a);
+		REQUIRE(unit.At({1, 2}) == Approx(0.8f));
+		REQUIRE(normalize(zeros<float>(size_t(1), size_t(3))).Sum() == 0.0f);
+		REQUIRE_THROWS(cross(a, zeros<float>(size_t(3), size_t(3))));
+		REQUIRE_THROWS(vector_norm(zeros<float>(size_t(3), size_t(2))));
+	}
+}
+
+TEST_CASE("Matrix products", "[linalg]")
+{
+	auto naive = [](const multi_array<double, 2>& a, const multi_array<double, 2>& b) {
+		multi_array<double, 2> c = zeros<double>(a.Shape()[0], b.Shape()[1]);
+		for (size_t i = 0; i < a.Shape()[0]; i++)
+			for (size_t j = 0; j < b.Shape()[1]; j++)
+				for (size_t k = 0; k < a.Shape()[1]; k++)
+					c.At({i, j}) += a.At({i, k}) * b.At({k, j});
+		return c;
+	};
+
+	SECTION("Matrices spanning several blocks")
+	{
+		multi_array<double, 2> a = arange(137.0 * 300.0).Apply([](const double& x) { return std::fmod(x, 17.0); }).Resize(137, 300);
+		multi_array<double, 2> b = arange(300.0 * 21.0).Apply([](const double& x) { return std::fmod(x, 5.0) - 2.0; }).Resize(300, 21);
+		multi_array<double, 2> expected = naive(a, b);
+		multi_array<double, 2> c = matmul(a, b);
+		REQUIRE(c.Shape() == expected.Shape());
+		REQUIRE((c == expected).All());
+		REQUIRE((dot(a, b) == expected).All());
+
+		// Transposed (strided) operands are not copied
+		multi_array<double, 2> bt = b.transpose().Copy();
+		REQUIRE((matmul(a, bt.transpose()) == expected).All());
+		REQUIRE((matmul(b.transpose(), a.transpose()) == expected.transpose().Copy()).All());
+	}
+
+	SECTION("Vectors")
+	{
+		multi_array<double, 2> m = arange(6.0).Resize(2, 3);
+		multi_array<double, 1> v = asarray(vector<double>{ 1, 2, 3 });
+		multi_array<double, 1> w = asarray(vector<double>{ 1, -1 });
+		REQUIRE(dot(v, v) == 14.0);
+		multi_array<double, 1> mv = matmul(m, v);
+		REQUIRE(mv.Shape()[0] == 2);
+		REQUIRE(mv[0] == 8.0);
+		REQUIRE(mv[1] == 26.0);
+		multi_array<double, 1> wm = matmul(w, m);
+		REQUIRE(wm.Shape()[0] == 3);
+		REQUIRE(wm[2] == -3.0);
+		REQUIRE((dot(m, v) == mv).All());
+		REQUIRE_THROWS(matmul(m, w));
+	}
+
+	SECTION("Matrix-vector products")
+	{
+		const size_t rows = 2500, cols = 37;
+		multi_array<double, 2> a = arange(double(rows * cols)).Apply([](const double& x) { return std::fmod(x, 11.0) - 5.0; }).Resize(rows, cols);
+		multi_array<double, 2> at = a.transpose().Copy();
+		multi_array<double, 1> x = arange(double(cols)).Apply([](const double& v) { return std::fmod(v, 4.0) - 1.0; });
+		multi_array<double, 1> y = arange(double(rows)).Apply([](const double& v) { return std::fmod(v, 3.0); });
+		multi_array<double, 2> expected = naive(a, x.Copy().Resize(cols, 1));
+		multi_array<double, 2> expectedT = naive(y.Copy().Resize(1, rows), a);
+
+		multi_array<double, 1> ax = matmul(a, x);
+		multi_array<double, 1> ax2 = matmul(at.transpose(), x);      // Columns contiguous
+		multi_array<double, 1> ya = matmul(y, a);
+		multi_array<double, 1> ya2 = matmul(y, at.transpose());
+		bool matches = true;
+		for (size_t i = 0; i < rows; i++)
+		{
+			matches = matches && (ax[i] == expected.At({i, 0})) && (ax2[i] == expected.At({i, 0}));
+		}
+		for (size_t j = 0; j < cols; j++)
+		{
+			matches = matches && (ya[j] == expectedT.At({0, j})) && (ya2[j] == expectedT.At({0, j}));
+		}
+		REQUIRE(matches);
+
+		// Strided vectors (a column of a)
+		double column = 0.0;
+		for (size_t i = 0; i < rows; i++)
+		{
+			column += a.At({i, 3}) * y[i];
+		}
+		REQUIRE(dot(at[3], y) == column);
+		REQUIRE(dot(a.transpose()[3], y) == column);
+		REQUIRE(dot(a.transpose()[3], at[3]) == dot(at[3], at[3]));
+	}
+
+	SECTION("Batched products with broadcasting")
+	{
+		multi_array<double, 3> a = arange(24.0).Resize(4, 2, 3);
+		multi_array<double, 2> b = (arange(6.0) - 2.0).Resize(3, 2);
+		multi_array<double, 3> c = matmul(a, b);
+		REQUIRE(c.Shape() == (std::array<size_t, 3>{{ 4, 2, 2 }}));
+		for (size_t i = 0; i < 4; i++)
+		{
+			REQUIRE((c[i] == naive(a[i].Copy(), b)).All());
+		}
+		multi_array<double, 4> d = matmul(arange(6.0).Resize(3, 1, 1, 2), arange(16.0).Resize(4, 2, 2));
+		REQUIRE(d.Shape() == (std::array<size_t, 4>{{ 3, 4, 1, 2 }}));
+		REQUIRE(d.At({2, 3, 0, 1}) == 4.0 * 13.0 + 5.0 * 15.0);
+	}
+
+	SECTION("Tensor contraction")
+	{
+		multi_array<double, 3> a = arange(24.0).Resize(2, 3, 4);
+		multi_array<double, 3> b = arange(60.0).Resize(3, 4, 5);
+		multi_array<double, 2> c = tensordot<2>(a, b);
+		REQUIRE(c.Shape() == (std::array<size_t, 2>{{ 2, 5 }}));
+		double expected = 0.0;
+		for (size_t j = 0; j < 3; j++)
+			for (size_t k = 0; k < 4; k++)
+				expected += a.At({1, j, k}) * b.At({j, k, 3});
+		REQUIRE(c.At({1, 3}) == expected);
+
+		multi_array<double, 4> d = tensordot<1>(a, b.transpose(), {{ 1 }}, {{ 2 }});
+		REQUIRE(d.Shape() == (std::array<size_t, 4>{{ 2, 4, 5, 4 }}));
+		expected = 0.0;
+		for (size_t j = 0; j < 3; j++)
+			expected += a.At({1, j, 2}) * b.At({j, 3, 4});
+		REQUIRE(d.At({1, 2, 4, 3}) == expected);
+		REQUIRE_THROWS(tensordot<1>(a, b, {{ 0 }}, {{ 0 }}));
+
+		multi_array<float16, 2> h = zeros<float16>(size_t(2), size_t(2)) + float16(1.5f);
+		REQUIRE(float(matmul(h, h).At({0, 1})) == 4.5f);
+	}
+}
+
+TEST_CASE("Cumulative sums and scans", "[scan]")
+{
+	SECTION("Along each axis")
+	{
+		multi_array<double, 2> a = arange(12.0).Resize(3, 4);
+		multi_array<double, 2> rows = a.CumSum<1>();
+		REQUIRE(rows.At({0, 3}) == 6.0);
+		REQUIRE(rows.At({2, 3}) == 8.0 + 9.0 + 10.0 + 11.0);
+		REQUIRE(rows.At({2, 0}) == 8.0);
+		multi_array<double, 2> columns = a.CumSum<0>();
+		REQUIRE(columns.At({2, 1}) == 1.0 + 5.0 + 9.0);
+		REQUIRE(columns.At({0, 1}) == 1.0);
+		REQUIRE(a.At({2, 3}) == 11.0);
+
+		multi_array<int, 1> p = asarray(vector<int>{ 1, 2, 3, 4, 5 }).CumProd<0>();
+		REQUIRE(p[4] == 120);
+
+		multi_array<float, 1> f = (arange(11.0f) + 1.0f).CumSum<0>();
+		for (size_t i = 0; i < 11; i++)
+		{
+			REQUIRE(f[i] == float((i + 1) * (i + 2) / 2));
+		}
+
+		multi_array<int, 1> m = asarray(vector<int>{ 3, 1, 4, 1, 5, 9, 2, 6 }).Scan<0>([](int& x, const int& y) { if (y > x) x = y; });
+		REQUIRE(m[3] == 4);
+		REQUIRE(m[7] == 9);
+
+		multi_array<float16, 1> h = ones<float16>(size_t(8)).CumSum<0>();
+		REQUIRE(float(h[7]) == 8.0f);
+
+		// Whole rows at once along the leading axes (more than one block of columns)
+		multi_array<int, 3> c = arange(3 * 4 * 1500).Resize(3, 4, 1500);
+		multi_array<int, 3> planes = c.CumSum<1>();
+		REQUIRE(planes.At({2, 3, 1499}) == c.At({2, 0, 1499}) + c.At({2, 1, 1499}) + c.At({2, 2, 1499}) + c.At({2, 3, 1499}));
+		REQUIRE(planes.At({1, 0, 1200}) == c.At({1, 0, 1200}));
+		REQUIRE((c.CumSum<0>() == c.transpose().CumSum<2>().transpose()).All());
+	}
+
+	SECTION("In place on views")
+	{
+		multi_array<double, 2> a = ones<double>(size_t(4), size_t(5));
+		a.transpose().ScanInPlace<1>(scan_add());
+		REQUIRE(a.At({3, 0}) == 4.0);
+		REQUIRE(a.At({3, 4}) == 4.0);
+
+		multi_array<double, 2> b = ones<double>(size_t(4), size_t(6));
+		b.slice<1>(_(_, _, 2)).ScanInPlace<1>(scan_add());
+		REQUIRE(b.At({1, 4}) == 3.0);
+		REQUIRE(b.At({1, 5}) == 1.0);
+		b.slice<1>(_(_, _, -1)).ScanInPlace<1>(scan_add());
+		REQUIRE(b.At({0, 0}) == 6.0 + 3.0);
+	}
+
+	SECTION("Two-pass scan of chunks")
+	{
+		multi_array<double, 1> a = arange(1001.0);
+		scan_chunked(a.DataPointer(), 1, a.Size(), 7, scan_add());
+		REQUIRE(a[1000] == 500500.0);
+		REQUIRE(a[143] == 143.0 * 144.0 / 2.0);
+		REQUIRE(a[144] == 144.0 * 145.0 / 2.0);
+
+		multi_array<int, 1> b = ones<int>(size_t(100)) * 2;
+		scan_chunked(b.DataPointer(), 1, 10, 4, scan_multiply());
+		REQUIRE(b[9] == 1024);
+		REQUIRE(b[10] == 2);
+	}
+}
+
+TEST_CASE("Samplers", "[sampling]")
+{
+	multi_array<double, 1> weights = asarray(vector<double>{ 1, 0, 3, 4 });
+	multi_array<double, 1> uniforms = linspace(0.0, 1.0, 8000, false);
+
+	SECTION("Alias method")
+	{
+		alias_sampler<> sampler(weights);
+		REQUIRE(sampler.Rows() == 1);
+		REQUIRE(sampler.Size() == 4);
+		multi_array<size_t, 1> drawn = sampler.Sample(uniforms);
+		vector<size_t> counts(4);
+		for (size_t i = 0; i < drawn.Size(); i++) counts[drawn[i]]++;
+		REQUIRE(counts[0] == 1000);
+		REQUIRE(counts[1] == 0);
+		REQUIRE(counts[2] == 3000);
+		REQUIRE(counts[3] == 4000);
+		REQUIRE(sampler(0.999999) < 4);
+		REQUIRE(sampler(uniforms[123]) == drawn[123]);
+
+		sampler.Update(0, asarray(vector<double>{ 0, 0, 0, 1 }));
+		REQUIRE(sampler(0.1) == 3);
+		REQUIRE_THROWS(sampler.Update(0, asarray(vector<double>{ 0, -1, 0, 1 })));
+		REQUIRE_THROWS(alias_sampler<>(zeros<double>(size_t(3))));
+	}
+
+	SECTION("Guide table")
+	{
+		guide_table_sampler<> sampler(weights);
+		multi_array<size_t, 1> drawn = sampler.Sample(uniforms);
+		REQUIRE(drawn[999] == 0);
+		REQUIRE(drawn[1000] == 2);
+		REQUIRE(drawn[3999] == 2);
+		REQUIRE(drawn[4000] == 3);
+		REQUIRE(drawn[7999] == 3);
+		REQUIRE(sampler.Cdf().At({0, 3}) == 1.0);
+		REQUIRE(sampler.Position(0.0625) == Approx(0.5));
+		REQUIRE(sampler.Position(0.5) == 3.0);
+		REQUIRE(sampler.Position(0.75) == Approx(3.5));
+	}
+
+	SECTION("Batched distributions")
+	{
+		multi_array<float, 2> rows = asarray(vector<float>{ 1, 0, 0, 0, 0, 1, 1, 1, 1 }).Resize(3, 3);
+		alias_sampler<float> alias(rows);
+		guide_table_sampler<float> guide(rows);
+		REQUIRE(alias.Rows() == 3);
+		multi_array<float, 1> u = asarray(vector<float>{ 0.9f, 0.5f, 0.1f, 0.5f });
+		multi_array<size_t, 1> which = asarray(vector<size_t>{ 0, 1, 2, 2 });
+		multi_array<size_t, 1> a = alias.Sample(u, which);
+		multi_array<size_t, 1> g = guide.Sample(u, which);
+		REQUIRE(a[0] == 0);
+		REQUIRE(a[1] == 2);
+		REQUIRE(g[0] == 0);
+		REQUIRE(g[1] == 2);
+		REQUIRE(g[2] == 0);
+		REQUIRE(g[3] == 1);
+		REQUIRE(guide.Sample(u, 2)[0] == 2);
+
+		guide.Update(1, asarray(vector<float>{ 1, 0, 0 }));
+		REQUIRE(guide(0.5f, 1) == 0);
+		REQUIRE(guide(0.5f, 2) == 1);
+		REQUIRE_THROWS(guide.Sample(u, asarray(vector<size_t>{ 0, 1, 2, 3 })));
+		REQUIRE_THROWS(alias.Sample(u, 3));
+		REQUIRE_THROWS(alias(0.5f, 3));
+
+		// Strided uniforms and rows
+		multi_array<size_t, 1> reversed = guide.Sample(u(_(_, _, -1)), which(_(_, _, -1)));
+		REQUIRE(reversed[0] == g[3]);
+		REQUIRE(reversed[3] == g[0]);
+	}
+}
+
+TEST_CASE("Sorting and quantiles", "[sorting]")
+{
+	SECTION("Sorting along axes")
+	{
+		multi_array<int, 2> a = asarray(vector<int>{ 3, -1, 2, 0, 5, -7, 1, 1, 4 }).Resize(3, 3);
+		multi_array<int, 2> rows = a.Sort<1>();
+		REQUIRE(rows.At({0, 0}) == -1);
+		REQUIRE(rows.At({0, 2}) == 3);
+		REQUIRE(rows.At({1, 0}) == -7);
+		multi_array<int, 2> columns = a.Sort<0>();
+		REQUIRE(columns.At({0, 1}) == -1);
+		REQUIRE(columns.At({2, 1}) == 5);
+
+		multi_array<size_t, 2> order = a.ArgSort<0>();
+		REQUIRE(order.At({0, 2}) == 1);
+		REQUIRE(order.At({1, 2}) == 0);
+		REQUIRE(order.At({2, 2}) == 2);
+
+		a.transpose().SortInPlace<0>();
+		REQUIRE(a.At({0, 0}) == -1);
+		REQUIRE(a.At({0, 2}) == 3);
+	}
+
+	SECTION("Radix sort of long lines")
+	{
+		const size_t n = 5000;
+		multi_array<double, 1> x = arange(double(n)).Apply([](const double& v) { return std::sin(v) * 1000.0; });
+		x[17] = -0.0;
+		x[18] = std::numeric_limits<double>::infinity();
+		x[19] = std::numeric_limits<double>::quiet_NaN();
+		multi_array<double, 1> sorted = x.Sort<0>();
+		multi_array<size_t, 1> order = x.ArgSort<0>();
+		REQUIRE(std::isnan(sorted[n - 1]));
+		REQUIRE(sorted[n - 2] == std::numeric_limits<double>::infinity());
+		REQUIRE(order[n - 1] == 19);
+		bool ordered = true;
+		for (size_t i = 1; i < n - 1; i++)
+		{
+			ordered = ordered && (sorted[i - 1] <= sorted[i]) && (x[order[i]] == sorted[i]);
+		}
+		REQUIRE(ordered);
+
+		multi_array<int64_t, 1> big = arange(int64_t(3000)).Apply([](const int64_t& v) { return (v * 7919) % 3001 - 1500; });
+		multi_array<int64_t, 1> sortedBig = big.Sort<0>();
+		REQUIRE(sortedBig[0] == -1500);
+		REQUIRE(sortedBig[2999] == 1500);
+
+		// Chunks merged pairwise, stable for equal keys
+		vector<uint32_t> keys(1000);
+		vector<size_t> indices(1000);
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			keys[i] = uint32_t((i * 37) % 10);
+			indices[i] = i;
+		}
+		sort_keys_chunked(keys.data(), indices.data(), keys.size(), 6);
+		REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+		REQUIRE(keys[0] == 0);
+		REQUIRE(indices[0] == 0);
+		REQUIRE(indices[1] == 10);
+		REQUIRE(indices[99] == 990);
+
+		// Uneven runs: each merge slice starts inside the runs found by the merge path
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			keys[i] = (i < 500) ? uint32_t(1000 + i % 3) : uint32_t(i % 7);
+			indices[i] = i;
+		}
+		vector<uint32_t> expected(keys.begin(), keys.begin() + 997);
+		std::sort(expected.begin(), expected.end());
+		sort_keys_chunked(keys.data(), indices.data(), 997, 5);
+		REQUIRE(std::equal(expected.begin(), expected.end(), keys.begin()));
+		bool stable = true;
+		for (size_t i = 1; i < 997; i++)
+		{
+			stable = stable && ((keys[i - 1] != keys[i]) || (indices[i - 1] < indices[i]));
+		}
+		REQUIRE(stable);
+
+		vector<int> left{ 1, 3, 3, 7 }, right{ 2, 3, 8 };
+		REQUIRE(merge_path_split(left.data(), 4, right.data(), 3, 0) == 0);
+		REQUIRE(merge_path_split(left.data(), 4, right.data(), 3, 4) == 3);      // 1 2 3 3 | 3 (right) 7 8
+		REQUIRE(merge_path_split(left.data(), 4, right.data(), 3, 7) == 4);
+	}
+
+	SECTION("Partition and quantiles")
+	{
+		multi_array<double, 1> x = asarray(vector<double>{ 7, 1, 5, 3, 9, 2 });
+		multi_array<double, 1> p = x.Partition<0>(2);
+		REQUIRE(p[2] == 3.0);
+		REQUIRE(std::max(p[0], p[1]) < 3.0);
+		REQUIRE(x.Quantile(0.5) == 4.0);
+		REQUIRE(x.Percentile(0.0) == 1.0);
+		REQUIRE(x.Percentile(100.0) == 9.0);
+		REQUIRE(x.Quantile(0.3) == Approx(2.5));
+		REQUIRE_THROWS(x.Quantile(1.5));
+
+		multi_array<float, 2> grid = arange(12.0f).Resize(3, 4);
+		multi_array<double, 1> medians = grid.Quantile<1>(0.5);
+		REQUIRE(medians.Size() == 3);
+		REQUIRE(medians[2] == 9.5);
+		multi_array<double, 1> high = grid.Percentile<0>(75.0);
+		REQUIRE(high[1] == 7.0);
+		REQUIRE_THROWS(grid.Quantile<1>(1.5));
+		REQUIRE_THROWS(grid.Percentile<0>(-1.0));
+		REQUIRE_THROWS(zeros<float>(3, 0).Quantile<1>(0.5));
+	}
+}
+
+TEST_CASE("Searching sorted edges", "[search]")
+{
+	SECTION("Uniform, logarithmic and irregular edges")
+	{
+		multi_array<double, 1> values = asarray(vector<double>{ -1.0, 0.0, 2.5, 3.0, 10.0, 11.0, std::numeric_limits<double>::quiet_NaN() });
+		multi_array<size_t, 1> left = searchsorted(linspace(0.0, 10.0, 11), values);
+		multi_array<size_t, 1> right = searchsorted(linspace(0.0, 10.0, 11), values, search_side::right);
+		REQUIRE(left[0] == 0);
+		REQUIRE(left[1] == 0);
+		REQUIRE(left[2] == 3);
+		REQUIRE(left[3] == 3);
+		REQUIRE(left[4] == 10);
+		REQUIRE(left[5] == 11);
+		REQUIRE(left[6] == 11);
+		REQUIRE(right[1] == 1);
+		REQUIRE(right[3] == 4);
+		REQUIRE(right[4] == 11);
+
+		multi_array<double, 1> edges = asarray(vector<double>{ 0.0, 0.5, 2.0, 7.0, 7.5 });
+		multi_array<double, 2> grid = linspace(-1.0, 9.0, 41).Resize(41, 1);
+		multi_array<size_t, 2> bins = digitize(grid.transpose(), edges);
+		bool matches = true;
+		for (size_t i = 0; i < 41; i++)
+		{
+			const double x = grid.At({i, 0});
+			size_t expected = 0;
+			while (expected < 5 && edges[expected] <= x) expected++;
+			matches = matches && (bins.At({0, i}) == expected);
+		}
+		REQUIRE(matches);
+
+		multi_array<double, 1> powers = logspace(-3.0, 3.0, 7);
+		multi_array<size_t, 1> decades = searchsorted(powers, asarray(vector<double>{ 0.0005, powers[0], 0.5, powers[3], 5000.0 }));
+		REQUIRE(decades[0] == 0);
+		REQUIRE(decades[1] == 0);
+		REQUIRE(decades[2] == 3);
+		REQUIRE(decades[3] == 3);
+		REQUIRE(decades[4] == 7);
+	}
+
+	SECTION("Infinite edges")
+	{
+		const double inf = std::numeric_limits<double>::infinity();
+		multi_array<double, 1> edges = asarray(vector<double>{ -inf, 0.0, 1.0, inf });
+		multi_array<double, 1> values = asarray(vector<double>{ -5.0, 0.5, 5.0, 100.0 });
+		multi_array<size_t, 1> left = searchsorted(edges, values);
+		REQUIRE(left[0] == 1);
+		REQUIRE(left[1] == 2);
+		REQUIRE(left[2] == 3);
+		REQUIRE(left[3] == 3);
+		multi_array<size_t, 1> bins = digitize(values, edges);
+		REQUIRE(bins[0] == 1);
+		REQUIRE(bins[2] == 3);
+		REQUIRE(searchsorted(edges, asarray(vector<double>{ -inf, inf }), search_side::right)[1] == 4);
+
+		// Equally spaced inner points do not make the axis uniform
+		multi_array<double, 1> half = asarray(vector<double>{ 0.0, 1.0, 2.0, inf });
+		REQUIRE(searchsorted(half, values)[3] == 3);
+		REQUIRE_FALSE(table_axis<double>(half).IsUniform());
+	}
+
+	SECTION("Integers and repeated edges")
+	{
+		multi_array<int, 1> edges = asarray(vector<int>{ 1, 2, 2, 2, 5 });
+		multi_array<int, 1> values = asarray(vector<int>{ 0, 1, 2, 3, 5, 6 });
+		multi_array<size_t, 1> left = searchsorted(edges, values);
+		multi_array<size_t, 1> right = searchsorted(edges, values, search_side::right);
+		REQUIRE(left[1] == 0);
+		REQUIRE(left[2] == 1);
+		REQUIRE(right[2] == 4);
+		REQUIRE(left[3] == 4);
+		REQUIRE(left[4] == 4);
+		REQUIRE(right[4] == 5);
+		REQUIRE(right[5] == 5);
+		REQUIRE(digitize(values, edges, true)[2] == 1);
+
+		REQUIRE_THROWS(searchsorted(asarray(vector<int>{ 3, 1 }), values));
+	}
+}
+
+TEST_CASE("Bin counts and histograms", "[histogram]")
+{
+	SECTION("Bincount")
+	{
+		multi_array<int, 2> indices = asarray(vector<int>{ 0, 1, 1, 3, 1, 0 }).Resize(2, 3);
+		multi_array<size_t, 1> counts = bincount(indices);
+		REQUIRE(counts.Size() == 4);
+		REQUIRE(counts[0] == 2);
+		REQUIRE(counts[1] == 3);
+		REQUIRE(counts[2] == 0);
+		REQUIRE(counts[3] == 1);
+		REQUIRE(bincount(indices, 6).Size() == 6);
+
+		multi_array<double, 2> weights = linspace(0.5, 3.0, 6).Resize(2, 3);
+		multi_array<double, 1> sums = bincount(indices.transpose(), weights.transpose());
+		REQUIRE(sums[0] == Approx(3.5));
+		REQUIRE(sums[1] == Approx(1.0 + 1.5 + 2.5));
+		REQUIRE(sums[3] == Approx(2.0));
+
+		REQUIRE_THROWS(bincount(asarray(vector<int>{ 1, -1 })));
+
+		// Bins growing past histogram_private_bins switch to one counter per bin
+		multi_array<int64_t, 1> spread = arange(int64_t(50000)).Apply([](const int64_t& i) { return (i * 7919) % 40000; });
+		multi_array<size_t, 1> spreadCounts = bincount(spread);
+		REQUIRE(spreadCounts.Size() == 40000);
+		REQUIRE(spreadCounts[0] == 2);
+		REQUIRE(spreadCounts[39999] == 1);
+		REQUIRE(spreadCounts.Sum() == 50000);
+		spread[45678] = -3;
+		REQUIRE_THROWS(bincount(spread));
+
+		// Many entries in few bins go through the sub-histograms
+		multi_array<size_t, 1> skewed = arange(size_t(100003)).Apply([](const size_t& i) { return (i % 7 == 0) ? i % 5 : 2; });
+		multi_array<size_t, 1> skewedCounts = bincount(skewed);
+		REQUIRE(skewedCounts.Size() == 5);
+		REQUIRE(skewedCounts.Sum() == 100003);
+		size_t ones = 0;
+		for (size_t i = 0; i < 100003; i++)
+		{
+			ones += (skewed[i] == 1);
+		}
+		REQUIRE(skewedCounts[1] == ones);
+	}
+
+	SECTION("Histograms along axes")
+	{
+		multi_array<double, 1> values = asarray(vector<double>{ -1.0, 0.0, 0.5, 2.5, 4.0, 5.0, std::numeric_limits<double>::quiet_NaN() });
+		multi_array<size_t, 1> h = histogram1d(values, 4, 0.0, 4.0);
+		REQUIRE(h.Size() == 4);
+		REQUIRE(h[0] == 2);
+		REQUIRE(h[1] == 0);
+		REQUIRE(h[2] == 1);
+		REQUIRE(h[3] == 1);     // The upper edge belongs to the last bin
+
+		// Values on the edges of uniform axes land in the same bins as by search
+		multi_array<double, 1> onEdges = linspace(-1.0, 5.0, 601);
+		for (const table_axis<double>& axis : { uniform_axis(30, 0.0, 3.0), table_axis<double>(linspace(0.0, 3.0, 31)) })
+		{
+			multi_array<double, 1> edges = axis.Points();
+			multi_array<size_t, 1> located = histogram1d(onEdges(_(_, _, 1)), axis);
+			multi_array<size_t, 1> bins = digitize(onEdges, edges);
+			bool same = true;
+			for (size_t bin = 0; bin < 30; bin++)
+			{
+				size_t count = 0;
+				for (size_t i = 0; i < onEdges.Size(); i++)
+				{
+					count += (bins[i] == bin + 1) || ((bin == 29) && (onEdges[i] == 3.0));
+				}
+				same = same && (located[bin] == count);
+			}
+			REQUIRE(same);
+		}
+
+		// Edges of uniform_axis are within an ulp or so of linspace, and exact
+		table_axis<double> fine = uniform_axis(1000, 0.0, 10.0);
+		REQUIRE(fine.IsExact());
+		REQUIRE(count_nonzero(abs(fine.Points() - linspace(0.0, 10.0, 1001)) > 1e-14) == 0);
+		REQUIRE(fine.Locate(std::nextafter(fine.Points()[700], 0.0)) == 699);
+		REQUIRE(fine.Locate(fine.Points()[700]) == 700);
+
+		multi_array<double, 1> weights = ones<double>(7);
+		weights[2] = 3.0;
+		multi_array<double, 1> hw = histogram1d(values, table_axis<double>(asarray(vector<double>{ 0.0, 1.0, 3.0 })), weights);
+		REQUIRE(hw[0] == Approx(4.0));
+		REQUIRE(hw[1] == Approx(1.0));
+
+		// Open-ended outer bins
+		const double inf = std::numeric_limits<double>::infinity();
+		multi_array<size_t, 1> open = histogram1d(values, table_axis<double>(asarray(vector<double>{ -inf, 0.0, 1.0, inf })));
+		REQUIRE(open[0] == 1);
+		REQUIRE(open[1] == 2);
+		REQUIRE(open[2] == 3);
+
+		const size_t n = 20000;
+		multi_array<double, 1> x = arange(double(n)).Apply([](const double& v) { return std::fmod(v * 0.37, 10.0); });
+		multi_array<double, 1> y = arange(double(n)).Apply([](const double& v) { return std::fmod(v * 0.6180339887, 6.0) - 1.0; });
+		multi_array<double, 1> z = arange(double(n)).Apply([](const double& v) { return std::fmod(v * 0.13, 3.0); });
+		histogram<2> reference(uniform_axis(5, 0.0, 10.0), uniform_axis(4, 0.0, 4.0));
+		multi_array<double, 2> points(std::array<size_t, 2>{{ n, 2 }});
+		for (size_t i = 0; i < n; i++)
+		{
+			points.At({i, 0}) = x[i];
+			points.At({i, 1}) = y[i];
+		}
+		reference.Fill(points);
+		multi_array<size_t, 2> h2 = histogram2d(x, y, uniform_axis(5, 0.0, 10.0), uniform_axis(4, 0.0, 4.0));
+		bool matches = true;
+		for (size_t i = 0; i < 5; i++)
+		{
+			for (size_t j = 0; j < 4; j++)
+			{
+				matches = matches && (double(h2.At({i, j})) == reference.Values().At({i, j}));
+			}
+		}
+		REQUIRE(matches);
+
+		multi_array<double, 3> h3 = histogram3d(x, y, z, uniform_axis(2, 0.0, 10.0), uniform_axis(2, -1.0, 5.0), uniform_axis(3, 0.0, 3.0), ones<double>(n) * 0.5);
+		REQUIRE(h3.Sum() == Approx(n * 0.5));
+		REQUIRE_THROWS(histogram2d(x, linspace(0.0, 1.0, 10), uniform_axis(2, 0.0, 1.0), uniform_axis(2, 0.0, 1.0)));
+	}
+}
+
+TEST_CASE("Nonzero elements", "[nonzero]")
+{
+	multi_array<double, 2> a = zeros<double>(3, 4);
+	a.At({0, 1}) = 2.0;
+	a.At({1, 3}) = -1.0;
+	a.At({2, 0}) = std::numeric_limits<double>::quiet_NaN();
+	a.At({2, 2}) = -0.0;
+
+	SECTION("Arrays and views")
+	{
+		REQUIRE(count_nonzero(a) == 3);
+		multi_array<size_t, 1> flat = flatnonzero(a);
+		REQUIRE(flat.Size() == 3);
+		REQUIRE(flat[0] == 1);
+		REQUIRE(flat[1] == 7);
+		REQUIRE(flat[2] == 8);
+
+		multi_array<size_t, 2> where = argwhere(a);
+		REQUIRE((where.Shape() == std::array<size_t, 2>{{ 3, 2 }}));
+		REQUIRE(where.At({1, 0}) == 1);
+		REQUIRE(where.At({1, 1}) == 3);
+		REQUIRE(where.At({2, 0}) == 2);
+
+		multi_array<size_t, 2> indices = nonzero(a.transpose());
+		REQUIRE((indices.Shape() == std::array<size_t, 2>{{ 2, 3 }}));
+		REQUIRE(indices.At({0, 0}) == 0);
+		REQUIRE(indices.At({1, 0}) == 2);
+		REQUIRE(indices.At({0, 1}) == 1);
+		REQUIRE(indices.At({1, 1}) == 0);
+		REQUIRE(indices.At({0, 2}) == 3);
+
+		multi_array<int, 1> counts = asarray(vector<int>{ 0, 0, 5, 0 });
+		REQUIRE(count_nonzero(counts) == 1);
+		REQUIRE(flatnonzero(counts)[0] == 2);
+		REQUIRE(argwhere(zeros<float>(5, 5)).Size() == 0);
+
+		multi_array<size_t, 1> selected = flatnonzero(a.Test([](const double& x) { return x < 0.0; }));
+		REQUIRE(selected.Size() == 1);
+		REQUIRE(selected[0] == 7);
+	}
+
+	SECTION("Chunked search")
+	{
+		const size_t n = 10007;
+		multi_array<float, 1> x = arange(float(n)).Apply([](const float& v) { return (std::fmod(v, 13.0f) < 2.0f) ? v : 0.0f; });
+		vector<size_t> expected;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (x[i] != 0.0f)
+			{
+				expected.push_back(i);
+			}
+		}
+		REQUIRE(count_nonzero(x) == expected.size());
+		for (size_t chunks : { size_t(1), size_t(3), size_t(7), size_t(1000) })
+		{
+			multi_array<size_t, 1> flat = nonzero_chunked(x.DataPointer(), n, chunks);
+			bool matches = (flat.Size() == expected.size());
+			for (size_t i = 0; matches && (i < flat.Size()); i++)
+			{
+				matches = (flat[i] == expected[i]);
+			}
+			REQUIRE(matches);
+		}
+	}
+}